@@ -0,0 +1,400 @@
+// c64conv_bench: throughput benchmarks for the conversion pipeline.
+//
+// Usage: c64conv_bench [--format json|csv] [--filter TEXT] [--min-time SECONDS]
+//
+// Every input is synthesized in-process from a fixed seed, so numbers are comparable
+// between runs and releases. Results are printed as JSON (default) or CSV with one
+// record per benchmark: timing statistics and pixels processed per second.
+// Configure with -DCMAKE_BUILD_TYPE=Release; unoptimized numbers are meaningless.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "asmgenerator.h"
+#include "blockreducer.h"
+#include "conversioncontext.h"
+#include "dither.h"
+#include "pallet.h"
+#include "scale.h"
+
+struct SyntheticImage {
+    std::string name;
+    int width;
+    int height;
+    std::vector<uint8_t> pixels;
+};
+
+struct BenchResult {
+    std::string name;
+    std::string image;
+    int width;
+    int height;
+    long long pixels;        // pixels processed per iteration
+    int iterations;
+    double median_ns;
+    double min_ns;
+};
+
+// Small deterministic PRNG so images do not depend on the standard library implementation
+struct XorShift {
+    uint32_t state;
+    uint32_t next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+};
+
+static SyntheticImage make_gradient(int width, int height)
+{
+    SyntheticImage img{ "gradient", width, height, std::vector<uint8_t>(static_cast<size_t>(width) * height * 3) };
+    for (auto y = 0; y < height; ++y) {
+        for (auto x = 0; x < width; ++x) {
+            auto idx = (static_cast<size_t>(y) * width + x) * 3;
+            img.pixels[idx] = static_cast<uint8_t>(x * 255 / std::max(1, width - 1));
+            img.pixels[idx + 1] = static_cast<uint8_t>(y * 255 / std::max(1, height - 1));
+            img.pixels[idx + 2] = static_cast<uint8_t>((x + y) * 255 / std::max(1, width + height - 2));
+        }
+    }
+    return img;
+}
+
+static SyntheticImage make_noise(int width, int height)
+{
+    SyntheticImage img{ "noise", width, height, std::vector<uint8_t>(static_cast<size_t>(width) * height * 3) };
+    XorShift rng{ 0x12345678 };
+    for (auto& value : img.pixels)
+        value = static_cast<uint8_t>(rng.next() >> 24);
+    return img;
+}
+
+// Sum of sinusoids with 1/f amplitudes: smooth regions, edges and fine detail like a photo
+static SyntheticImage make_photo(int width, int height)
+{
+    SyntheticImage img{ "photo", width, height, std::vector<uint8_t>(static_cast<size_t>(width) * height * 3) };
+    XorShift rng{ 0x9E3779B9 };
+
+    struct Wave { float fx, fy, phase, amplitude; int channel; };
+    std::vector<Wave> waves;
+    for (auto i = 1; i <= 24; ++i) {
+        float frequency = 0.002f * i * i;
+        float angle = (rng.next() % 6283) / 1000.0f;
+        waves.push_back({ frequency * std::cos(angle), frequency * std::sin(angle),
+            (rng.next() % 6283) / 1000.0f, 90.0f / i, i % 3 });
+    }
+
+    for (auto y = 0; y < height; ++y) {
+        for (auto x = 0; x < width; ++x) {
+            float channel[3] = { 128.0f, 118.0f, 100.0f };
+            for (auto& wave : waves) {
+                float value = wave.amplitude * std::sin(wave.fx * x + wave.fy * y + wave.phase);
+                channel[wave.channel] += value;
+                channel[(wave.channel + 1) % 3] += value * 0.5f;
+            }
+            auto idx = (static_cast<size_t>(y) * width + x) * 3;
+            for (auto c = 0; c < 3; ++c) {
+                float noisy = channel[c] + static_cast<int>(rng.next() % 17) - 8;
+                img.pixels[idx + c] = static_cast<uint8_t>(std::clamp(noisy, 0.0f, 255.0f));
+            }
+        }
+    }
+    return img;
+}
+
+class BenchRunner {
+public:
+    BenchRunner(std::string filter, double min_time) : filter(std::move(filter)), min_time(min_time) {}
+
+    // setup runs before every iteration outside the timed region (e.g. restoring a mutated input)
+    void run(const std::string& name, const SyntheticImage& img, long long pixels,
+        const std::function<void()>& setup, const std::function<void()>& body)
+    {
+        std::string full_name = name + "/" + img.name + "/" + std::to_string(img.width) + "x" + std::to_string(img.height);
+        if (!filter.empty() && full_name.find(filter) == std::string::npos)
+            return;
+
+        std::vector<double> samples;
+        double total = 0;
+        setup();
+        body();     // warm-up: LUTs, caches and scratch buffers
+        while ((total < min_time * 1e9 || samples.size() < 5) && samples.size() < 100000) {
+            setup();
+            auto start = std::chrono::steady_clock::now();
+            body();
+            auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            samples.push_back(elapsed);
+            total += elapsed;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        results.push_back({ name, img.name, img.width, img.height, pixels, static_cast<int>(samples.size()),
+            samples[samples.size() / 2], samples.front() });
+    }
+
+    void run(const std::string& name, const SyntheticImage& img, long long pixels, const std::function<void()>& body)
+    {
+        run(name, img, pixels, [] {}, body);
+    }
+
+    void print_json(std::ostream& out) const
+    {
+        out << "[\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            auto& r = results[i];
+            out << "  {\"name\": \"" << r.name << "\", \"image\": \"" << r.image << "\", \"width\": " << r.width
+                << ", \"height\": " << r.height << ", \"pixels\": " << r.pixels << ", \"iterations\": " << r.iterations
+                << ", \"median_ns\": " << static_cast<long long>(r.median_ns) << ", \"min_ns\": " << static_cast<long long>(r.min_ns)
+                << ", \"pixels_per_sec\": " << static_cast<long long>(pixels_per_sec(r)) << "}"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        out << "]" << std::endl;
+    }
+
+    void print_csv(std::ostream& out) const
+    {
+        out << "name,image,width,height,pixels,iterations,median_ns,min_ns,pixels_per_sec\n";
+        for (auto& r : results) {
+            out << r.name << "," << r.image << "," << r.width << "," << r.height << "," << r.pixels << ","
+                << r.iterations << "," << static_cast<long long>(r.median_ns) << "," << static_cast<long long>(r.min_ns)
+                << "," << static_cast<long long>(pixels_per_sec(r)) << "\n";
+        }
+        out << std::flush;
+    }
+
+private:
+    static double pixels_per_sec(const BenchResult& r) { return r.median_ns > 0 ? r.pixels * 1e9 / r.median_ns : 0; }
+
+    std::string filter;
+    double min_time;
+    std::vector<BenchResult> results;
+};
+
+// Quantize in place so hires images satisfy convert_to_c64_memory's two-colors-per-cell rule
+static std::vector<uint8_t> reduced_hires(const SyntheticImage& img)
+{
+    std::vector<uint8_t> pixels = img.pixels;
+    convert_to_c64_hires(pixels.data(), img.width, img.height);
+    return pixels;
+}
+
+static void bench_palette(BenchRunner& runner, const SyntheticImage& img)
+{
+    const int count = img.width * img.height;
+    volatile float distance_sink = 0;
+    volatile int index_sink = 0;
+
+    runner.run("color_distance", img, count, [&] {
+        float sum = 0;
+        for (auto i = 0; i < count; ++i)
+            sum += color_distance(&img.pixels[i * 3], i & 15);
+        distance_sink = sum;
+    });
+
+    runner.run("find_closest_color_exact", img, count, [&] {
+        int sum = 0;
+        for (auto i = 0; i < count; ++i)
+            sum += find_closest_color_exact(&img.pixels[i * 3], c64_palette);
+        index_sink = sum;
+    });
+
+    runner.run("find_closest_color", img, count, [&] {
+        int sum = 0;
+        for (auto i = 0; i < count; ++i)
+            sum += find_closest_color(&img.pixels[i * 3], c64_palette);
+        index_sink = sum;
+    });
+
+    std::vector<uint8_t> indices(count);
+    runner.run("find_closest_colors", img, count, [&] {
+        find_closest_colors(img.pixels.data(), count, indices.data(), c64_palette);
+    });
+    runner.run("find_closest_colors_lab", img, count, [&] {
+        find_closest_colors(img.pixels.data(), count, indices.data(), c64_palette, ColorMetric::Lab);
+    });
+}
+
+static void bench_scale(BenchRunner& runner, const SyntheticImage& img)
+{
+    std::vector<uint8_t> output(320 * 200 * 3);
+    runner.run("scale_to_c64", img, static_cast<long long>(img.width) * img.height, [&] {
+        scale_to_c64(img.pixels.data(), img.width, img.height, output.data(), 320, 200, 3);
+    });
+    runner.run("scale_area", img, static_cast<long long>(img.width) * img.height, [&] {
+        scale_area(img.pixels.data(), img.width, img.height, output.data(), 320, 200, 3);
+    });
+}
+
+static void bench_screen_stages(BenchRunner& runner, const SyntheticImage& img)
+{
+    const long long count = static_cast<long long>(img.width) * img.height;
+    std::vector<uint8_t> work(img.pixels.size());
+    auto restore = [&] { std::copy(img.pixels.begin(), img.pixels.end(), work.begin()); };
+
+    BlockReducerScratch scratch;
+    BlockReduceOptions frequency;
+    frequency.solver = BlockSolver::Frequency;
+    BlockReduceOptions exhaustive;
+    exhaustive.solver = BlockSolver::Exhaustive;
+    runner.run("reduce_hires_frequency", img, count, restore, [&] {
+        convert_to_c64_hires(work.data(), img.width, img.height, frequency, &scratch);
+    });
+    runner.run("reduce_hires_exhaustive", img, count, restore, [&] {
+        convert_to_c64_hires(work.data(), img.width, img.height, exhaustive, &scratch);
+    });
+    // Every cell is a repeat after the warm-up run: the cost of hashing and lookup alone
+    CellColorCache cell_cache;
+    BlockReduceOptions cached = exhaustive;
+    cached.cell_cache = &cell_cache;
+    runner.run("reduce_hires_exhaustive_cached", img, count, restore, [&] {
+        convert_to_c64_hires(work.data(), img.width, img.height, cached, &scratch);
+    });
+    BlockReduceOptions lab = exhaustive;
+    lab.metric = ColorMetric::Lab;
+    runner.run("reduce_hires_exhaustive_lab", img, count, restore, [&] {
+        convert_to_c64_hires(work.data(), img.width, img.height, lab, &scratch);
+    });
+    runner.run("reduce_multicolor_frequency", img, count, restore, [&] {
+        convert_to_c64_multicolor(work.data(), img.width, img.height, frequency, &scratch);
+    });
+    runner.run("reduce_multicolor_exhaustive", img, count, restore, [&] {
+        convert_to_c64_multicolor(work.data(), img.width, img.height, exhaustive, &scratch);
+    });
+    BlockReduceOptions search = exhaustive;
+    search.search_background = true;
+    runner.run("reduce_multicolor_background_search", img, count, restore, [&] {
+        convert_to_c64_multicolor(work.data(), img.width, img.height, search, &scratch);
+    });
+
+    runner.run("apply_dithering", img, count, restore, [&] {
+        apply_dithering(work.data(), img.width, img.height, 3, c64_palette);
+    });
+    runner.run("apply_floyd_steinberg", img, count, restore, [&] {
+        apply_floyd_steinberg(work.data(), img.width, img.height);
+    });
+
+    DitherScratch dither;
+    const std::pair<const char*, DitherKernel> kernels[] = {
+        { "diffuse_floyd", DitherKernel::FloydSteinberg },
+        { "diffuse_atkinson", DitherKernel::Atkinson },
+        { "diffuse_sierra_lite", DitherKernel::SierraLite },
+    };
+    for (auto& [name, kernel] : kernels) {
+        runner.run(name, img, count, restore, [&] {
+            diffuse_error(work.data(), img.width, img.height, 3, c64_palette, kernel, nullptr, &dither);
+        });
+    }
+    runner.run("diffuse_floyd_4_threads", img, count, restore, [&] {
+        diffuse_error(work.data(), img.width, img.height, 3, c64_palette, DitherKernel::FloydSteinberg, nullptr, &dither, 4);
+    });
+
+    const std::pair<const char*, DitherKernel> matrices[] = {
+        { "ordered_bayer4", DitherKernel::Bayer4 },
+        { "ordered_bayer8", DitherKernel::Bayer8 },
+        { "ordered_bluenoise", DitherKernel::BlueNoise },
+    };
+    for (auto& [name, kernel] : matrices) {
+        runner.run(name, img, count, restore, [&] {
+            apply_ordered_dither(work.data(), img.width, img.height, 3, c64_palette, kernel, nullptr, &dither);
+        });
+    }
+
+    auto hires = reduced_hires(img);
+    runner.run("convert_to_c64_memory", img, count, [&] {
+        auto data = convert_to_c64_memory(hires.data(), img.width, img.height, false);
+        (void)data;
+    });
+    std::vector<uint8_t> hires_indices(static_cast<size_t>(img.width) * img.height);
+    find_closest_colors(hires.data(), img.width * img.height, hires_indices.data(), c64_palette);
+    runner.run("convert_indexed_to_c64_memory", img, count, [&] {
+        auto data = convert_indexed_to_c64_memory(hires_indices.data(), img.width, img.height, false);
+        (void)data;
+    });
+
+    auto hires_data = convert_indexed_to_c64_memory(hires_indices.data(), img.width, img.height, false);
+    runner.run("make_packed_prg", img, count, [&] {
+        auto packed = make_packed_prg(hires_data);
+        (void)packed;
+    });
+}
+
+static void bench_pipeline(BenchRunner& runner, const SyntheticImage& img)
+{
+    for (auto multicolor : { false, true }) {
+        for (auto dither : { false, true }) {
+            ConvertOptions options;
+            options.use_hires = !multicolor;
+            options.use_multicolor = multicolor;
+            options.use_dithering = dither;
+
+            ConversionContext context(options);
+            int target_width, target_height;
+            ConversionContext::target_size(img.width, img.height, options, target_width, target_height);
+            std::vector<uint8_t> output(static_cast<size_t>(target_width) * target_height * 3);
+
+            std::string name = std::string("pipeline_") + (multicolor ? "multicolor" : "hires") + (dither ? "_dither" : "");
+            runner.run(name, img, static_cast<long long>(img.width) * img.height, [&] {
+                context.convert(img.pixels, img.width, img.height, output, target_width, target_height);
+                auto data = convert_indexed_to_c64_memory(context.native_indices().data(), context.native_width(),
+                    target_height, multicolor, context.last_reduce().bg_color);
+                (void)data;
+            });
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string format = "json";
+    std::string filter;
+    double min_time = 0.25;
+
+    for (auto arg = 1; arg < argc; ++arg) {
+        std::string arg_str = argv[arg];
+        if (arg_str == "--format" && arg + 1 < argc) {
+            format = argv[++arg];
+        }
+        else if (arg_str == "--filter" && arg + 1 < argc) {
+            filter = argv[++arg];
+        }
+        else if (arg_str == "--min-time" && arg + 1 < argc) {
+            min_time = std::stod(argv[++arg]);
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--format json|csv] [--filter TEXT] [--min-time SECONDS]" << std::endl;
+            return 1;
+        }
+    }
+    if (format != "json" && format != "csv") {
+        std::cerr << "Unknown format: " << format << std::endl;
+        return 1;
+    }
+
+    BenchRunner runner(filter, min_time);
+
+    // Screen-sized inputs for the per-pixel stages
+    std::vector<SyntheticImage> screens = { make_gradient(320, 200), make_noise(320, 200), make_photo(320, 200) };
+    for (auto& img : screens) {
+        bench_palette(runner, img);
+        bench_screen_stages(runner, img);
+    }
+
+    // Source-sized inputs for scaling and the whole pipeline
+    std::vector<SyntheticImage> sources = { make_photo(640, 400), make_photo(1920, 1080), make_noise(4000, 3000) };
+    for (auto& img : sources) {
+        bench_scale(runner, img);
+        bench_pipeline(runner, img);
+    }
+
+    if (format == "csv")
+        runner.print_csv(std::cout);
+    else
+        runner.print_json(std::cout);
+    return 0;
+}
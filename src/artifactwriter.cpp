@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "artifactwriter.h"
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+class FileArtifactWriter : public ArtifactWriter {
+public:
+    ArtifactStats write(const std::string& path, std::span<const uint8_t> data) override
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file)
+            throw std::runtime_error("Cannot create " + path);
+
+        // The buffer is already complete, so stdio's own buffering would only add a copy
+        std::setvbuf(file, nullptr, _IONBF, 0);
+        bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+        written = std::fclose(file) == 0 && written;
+        if (!written)
+            throw std::runtime_error("Failed to write " + path);
+        return { path, data.size(), elapsed_ms(start) };
+    }
+};
+
+ArtifactWriter& file_artifact_writer()
+{
+    static FileArtifactWriter writer;
+    return writer;
+}
+
+// POSIX ustar: a 512-byte header per member, data padded to 512 bytes, two zero blocks at the end
+class TarArtifactWriter : public ArtifactWriter {
+public:
+    static constexpr size_t block = 512;
+
+    explicit TarArtifactWriter(const std::string& archive_path) : archive_path(archive_path)
+    {
+        file = std::fopen(archive_path.c_str(), "wb");
+        if (!file)
+            throw std::runtime_error("Cannot create archive " + archive_path);
+        std::setvbuf(file, nullptr, _IONBF, 0);
+    }
+
+    ~TarArtifactWriter() override
+    {
+        try {
+            finish();
+        }
+        catch (const std::exception&) {
+            // Only finish() called directly can report this
+        }
+    }
+
+    void finish() override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!file)
+            return;
+        uint8_t trailer[2 * block] = {};
+        bool written = std::fwrite(trailer, 1, sizeof trailer, file) == sizeof trailer;
+        written = std::fclose(file) == 0 && written;
+        file = nullptr;
+        if (!written)
+            throw std::runtime_error("Failed to complete archive " + archive_path);
+    }
+
+    ArtifactStats write(const std::string& path, std::span<const uint8_t> data) override
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        // Header, data and padding go out together
+        size_t padded = (data.size() + block - 1) / block * block;
+        std::vector<uint8_t> member(block + padded, 0);
+        write_header(member.data(), path, data.size());
+        std::copy(data.begin(), data.end(), member.begin() + block);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!file)
+            throw std::runtime_error("Archive " + archive_path + " is already complete");
+        if (std::fwrite(member.data(), 1, member.size(), file) != member.size())
+            throw std::runtime_error("Failed to write " + path + " to archive " + archive_path);
+        return { archive_path + ":" + member_name(path), data.size(), elapsed_ms(start) };
+    }
+
+private:
+    static std::string member_name(const std::string& path)
+    {
+        auto first = path.find_first_not_of('/');
+        return first == std::string::npos ? path : path.substr(first);
+    }
+
+    static void write_octal(uint8_t* field, size_t width, unsigned long long value)
+    {
+        // width - 1 digits and a terminating NUL
+        std::snprintf(reinterpret_cast<char*>(field), width, "%0*llo", static_cast<int>(width - 1), value);
+    }
+
+    static void write_header(uint8_t* header, const std::string& path, size_t size)
+    {
+        // Names over 100 characters are split at a '/' into the 155-character prefix field
+        auto name = member_name(path);
+        std::string prefix;
+        if (name.size() > 100) {
+            auto split = name.rfind('/', 155);
+            if (split == std::string::npos || name.size() - split - 1 > 100)
+                throw std::runtime_error("Path too long for archive: " + path);
+            prefix = name.substr(0, split);
+            name = name.substr(split + 1);
+        }
+
+        std::memcpy(header, name.data(), name.size());
+        write_octal(header + 100, 8, 0644);                     // mode
+        write_octal(header + 108, 8, 0);                        // uid
+        write_octal(header + 116, 8, 0);                        // gid
+        write_octal(header + 124, 12, size);
+        write_octal(header + 136, 12, static_cast<unsigned long long>(std::time(nullptr)));
+        header[156] = '0';                                      // regular file
+        std::memcpy(header + 257, "ustar", 6);
+        std::memcpy(header + 263, "00", 2);
+        std::memcpy(header + 345, prefix.data(), prefix.size());
+
+        // Checksum: byte sum of the header with the checksum field read as spaces
+        std::memset(header + 148, ' ', 8);
+        unsigned sum = 0;
+        for (size_t i = 0; i < block; ++i)
+            sum += header[i];
+        std::snprintf(reinterpret_cast<char*>(header + 148), 8, "%06o", sum);
+    }
+
+    std::string archive_path;
+    std::FILE* file = nullptr;
+    std::mutex mutex;
+};
+
+std::unique_ptr<ArtifactWriter> open_archive_writer(const std::string& archive_path)
+{
+    return std::make_unique<TarArtifactWriter>(archive_path);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <memory>
+#include <span>
+#include <stdint.h>
+#include <string>
+
+// One generated file as stored: where it went, its size and how long storing it took
+struct ArtifactStats {
+    std::string path;
+    size_t bytes = 0;
+    double milliseconds = 0;
+};
+
+// Destination for generated files (output image, PRGs, ASM, Koala). Every artifact is
+// assembled in memory first and handed over as one buffer, which is stored with a single
+// write. Implementations are thread-safe, so batch workers can share one.
+class ArtifactWriter {
+public:
+    virtual ~ArtifactWriter() = default;
+
+    // Store data under path; throws std::runtime_error if it cannot be written
+    virtual ArtifactStats write(const std::string& path, std::span<const uint8_t> data) = 0;
+
+    // Complete everything written so far (e.g. an archive's trailer); throws std::runtime_error
+    // if that fails. Call it before reporting success; the writer takes nothing more afterwards.
+    virtual void finish() {}
+};
+
+// Writes each artifact to its own file at path (unbuffered, one fwrite)
+extern ArtifactWriter& file_artifact_writer();
+
+// Collects every artifact into one tar archive at archive_path, created or truncated,
+// with the artifact paths (relative, without a leading '/') as member names. Batches of
+// many small files then cost one open and a sequential append each. finish() completes the
+// archive; a writer destroyed without it still does, but cannot report a failure.
+// Throws std::runtime_error if the archive cannot be created.
+extern std::unique_ptr<ArtifactWriter> open_archive_writer(const std::string& archive_path);
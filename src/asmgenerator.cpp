@@ -1,4 +1,3 @@
-#include <map>
 #include <vector>
 #include <array>
 #include <algorithm>
@@ -7,129 +6,166 @@
 
 #include "pallet.h"
 #include "asmgenerator.h"
+#include "packer.h"
 
-C64ImageData convert_to_c64_memory(uint8_t* image, int width, int height, bool multicolor)
+static const int screen_columns = 40;
+static const int screen_rows = 25;
+static const int cell_height = 8;
+
+C64ImageData pack_c64_cells(const uint8_t* cell_indices, int cols, int rows, bool multicolor, int background)
 {
     const int screen_bitmap_size = 8000;
-    const int bytes_per_line = 320;
     const int color_ram_size = 1000;
-    const int screenWidth = multicolor ? 160 : 320;
-    const int screenHeight = 200;
+    const int cell_width = multicolor ? 4 : 8;
+    const int cell_pixels = cell_width * cell_height;
+    const int bits_per_pixel = multicolor ? 2 : 1;
 
-    std::map<std::pair<int, int>, std::array<int, 3>> colordict;
     C64ImageData result;
- 
-    // center image on screen
-    auto startX = 0; //  (screenWidth - width) / 2;
-    auto startY = 0; //  (screenHeight - height) / 2;
-
-    result.bitmap_data.resize(screen_bitmap_size);
-    for (auto image_y = 0; image_y < height; image_y++) {
-        auto y = startY + image_y;
-        auto row = y / 8;
-        auto line = y & 7;
-        for (auto image_x = 0; image_x < width; ++image_x) {
-            auto x = startX + image_x;
-            auto ch = x / 8;
-            auto bit = 7 - (x & 7);
-            auto byte = row * bytes_per_line + ch * 8 + line;
-
-            auto idx = (image_y * width + image_x) * 3;
-            uint8_t color_idx = find_closest_color(&image[idx], c64_palette);
-            if (color_idx < 0) {
-                throw std::runtime_error("Color not in c64 pallette");
+    result.multicolor = multicolor;
+    result.background = static_cast<uint8_t>(background & 0x0f);
+    result.bitmap_data.assign(screen_bitmap_size, 0);
+    result.screen_ram.assign(color_ram_size, 0);
+    result.color_ram.assign(color_ram_size, 0);
+
+    for (auto row = 0; row < std::min(rows, screen_rows); ++row) {
+        for (auto col = 0; col < std::min(cols, screen_columns); ++col) {
+            const uint8_t* cell = &cell_indices[static_cast<size_t>(row * cols + col) * cell_pixels];
+
+            // Bit patterns are handed out in order of first appearance. Hires: 0 (screen
+            // low nibble), then 1 (high nibble). Multicolor: the background is always 00,
+            // then 01 (screen high nibble), 10 (screen low nibble), 11 (color RAM).
+            std::array<int8_t, 16> pattern;
+            pattern.fill(-1);
+            int next = multicolor ? 1 : 0;
+            std::array<uint8_t, 4> colors = { result.background, 0, 0, 0 };
+            if (multicolor)
+                pattern[result.background] = 0;
+
+            auto* bytes = &result.bitmap_data[(row * screen_columns + col) * cell_height];
+            for (auto i = 0; i < cell_pixels; ++i) {
+                auto color = cell[i];
+                if (color == unused_pixel)
+                    continue;
+                if (pattern[color] < 0) {
+                    if (next == (1 << bits_per_pixel)) {
+                        throw std::runtime_error(std::string("More than ") + std::to_string(next) + " colors in block "
+                            + std::to_string(row) + ", " + std::to_string(col));
+                    }
+                    pattern[color] = static_cast<int8_t>(next);
+                    colors[next++] = color;
+                }
+                auto x = i % cell_width;
+                auto shift = 8 - bits_per_pixel * (x + 1);
+                bytes[i / cell_width] |= pattern[color] << shift;
             }
+
+            auto cell_index = row * screen_columns + col;
             if (multicolor) {
-                throw std::invalid_argument("Multi color not supported yet");
+                result.screen_ram[cell_index] = (colors[1] << 4) | colors[2];
+                result.color_ram[cell_index] = colors[3];
             }
             else {
-                if (colordict.find({ row, ch }) == colordict.end()) {
-                    colordict[{row, ch}] = { 0, 0, 0 };
-                }
-                auto& dict = colordict[{row, ch}];
-                auto n = dict[0];
-                switch (n) {
-                    case 0:
-                        // set as background color
-                        // do not set bitmap
-                        dict[0] = 1;
-                        dict[1] = color_idx;
-                        break;
-
-                    case 1:
-                        // the color is not the background color
-                        // add foreground color and
-                        // set bitmap
-                        if (dict[1] != color_idx) {
-                            dict[0] = 2;
-                            dict[2] = color_idx;
-                            result.bitmap_data[byte] |= 1 << bit;
-                        }
-                        break;
-
-                    case 2:
-                        if (dict[2] == color_idx) {
-                            result.bitmap_data[byte] |= 1 << bit;
-                        }
-                        else if (dict[1] != color_idx) {
-                            dict[0] &= 0xFF;
-                            throw std::runtime_error(std::string("More than 2 colors in block " + std::to_string(row) + ", " + std::to_string(ch)));
-                        }
-                        break;
-
-                    default:
-                        throw std::runtime_error("internal error");
-                        break;
-                }
+                result.screen_ram[cell_index] = (colors[1] << 4) | colors[0];
             }
         }
     }
- 
-    result.color_ram.resize(color_ram_size);
-    auto b = 0;
-    for (auto r = 0; r < 25; ++r) {
-        for (auto c = 0; c < 40; ++c) {
-
-            uint8_t c0 = 0;
-            uint8_t c1 = 0;
-
-            if (colordict.find({r, c}) != colordict.end()) {
-                auto& cc = colordict[{r, c}];
-                auto n = cc[0];
-                if (n > 0)
-                    c0 = (cc[1] & 0x0f);       // background
-                if (n > 1)
-                    c1 = (cc[2] & 0x0f) << 4;  // foreground
-                if (n > 2)
-                    throw std::runtime_error(std::string("More than 2 colors in block " + std::to_string(r) + ", " + std::to_string(c)));
+    return result;
+}
 
-            }
-            result.color_ram[b] = c0 | c1;
-            ++b;
-        }
+// Regroup an image's palette indices cell by cell so packing reads each cell contiguously;
+// index_of(x, y) gives the index of one pixel
+template <typename IndexOf>
+static C64ImageData pack_image(int width, int height, bool multicolor, int background, IndexOf index_of)
+{
+    const int cell_width = multicolor ? 4 : 8;
+    const int cols = (width + cell_width - 1) / cell_width;
+    const int rows = (height + cell_height - 1) / cell_height;
+    const int cell_pixels = cell_width * cell_height;
+    std::vector<uint8_t> cell_indices(static_cast<size_t>(cols) * rows * cell_pixels, unused_pixel);
+
+    for (auto y = 0; y < height; ++y) {
+        uint8_t* cell_row = &cell_indices[static_cast<size_t>(y / cell_height) * cols * cell_pixels + (y % cell_height) * cell_width];
+        for (auto x = 0; x < width; ++x)
+            cell_row[(x / cell_width) * cell_pixels + x % cell_width] = index_of(x, y);
     }
-    return result;
+    return pack_c64_cells(cell_indices.data(), cols, rows, multicolor, background);
+}
+
+C64ImageData convert_to_c64_memory(const uint8_t* image, int width, int height, bool multicolor, int background)
+{
+    // Pixels are already on the palette, so the LUT resolves them without distance math
+    auto& lut = get_palette_lut(c64_palette);
+    return pack_image(width, height, multicolor, background, [&](int x, int y) {
+        return lut.lookup(&image[(static_cast<size_t>(y) * width + x) * 3]);
+    });
+}
+
+C64ImageData convert_indexed_to_c64_memory(const uint8_t* indices, int width, int height, bool multicolor, int background)
+{
+    return pack_image(width, height, multicolor, background, [&](int x, int y) {
+        return indices[static_cast<size_t>(y) * width + x];
+    });
+}
+
+std::vector<uint8_t> make_prg(uint16_t load_address, std::span<const uint8_t> data)
+{
+    std::vector<uint8_t> prg;
+    prg.reserve(data.size() + 2);
+    prg.push_back(static_cast<uint8_t>(load_address & 0xFF));
+    prg.push_back(static_cast<uint8_t>(load_address >> 8));
+    prg.insert(prg.end(), data.begin(), data.end());
+    return prg;
+}
+
+std::vector<uint8_t> make_koala(const C64ImageData& img)
+{
+    std::vector<uint8_t> koala;
+    koala.reserve(2 + img.bitmap_data.size() + img.screen_ram.size() + img.color_ram.size() + 1);
+    koala.push_back(static_cast<uint8_t>(koala_load_address & 0xFF));
+    koala.push_back(static_cast<uint8_t>(koala_load_address >> 8));
+    koala.insert(koala.end(), img.bitmap_data.begin(), img.bitmap_data.end());
+    koala.insert(koala.end(), img.screen_ram.begin(), img.screen_ram.end());
+    koala.insert(koala.end(), img.color_ram.begin(), img.color_ram.end());
+    koala.push_back(img.background);
+    return koala;
 }
 
-bool generate_6502_image(const C64ImageData& img, std::ofstream& bitmap, std::ofstream& color)
+std::vector<uint8_t> make_packed_prg(const C64ImageData& img)
 {
-    auto bitmapLoadAddr = 0x2000;
-    auto colorLoadAddr = 0x0400;
+    std::vector<uint8_t> packed;
+    packed.reserve(2 + img.bitmap_data.size() + img.screen_ram.size() + img.color_ram.size());
+    packed.push_back(static_cast<uint8_t>(packed_load_address & 0xFF));
+    packed.push_back(static_cast<uint8_t>(packed_load_address >> 8));
+    pack_stream(img.bitmap_data, bitmap_load_address, packed);
+    pack_stream(img.screen_ram, screen_load_address, packed);
+    if (img.multicolor)
+        pack_stream(img.color_ram, color_ram_load_address, packed);
+    end_packed_streams(packed);
+    return packed;
+}
 
-    bitmap << (unsigned char)(bitmapLoadAddr & 0xFF);
-    bitmap << (unsigned char)((bitmapLoadAddr >> 8) & 0xFF);
-    for (auto& byte : img.bitmap_data)
-        bitmap << (unsigned char)byte;
+static void write_all(std::ostream& out, const std::vector<uint8_t>& data)
+{
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+}
 
-    color << (unsigned char)(colorLoadAddr & 0xFF);
-    color << (unsigned char)((colorLoadAddr >> 8) & 0xFF);
-    for (auto& byte : img.color_ram)
-        color << (unsigned char)byte;
+bool generate_6502_image(const C64ImageData& img, std::ofstream& bitmap, std::ofstream& color, std::ofstream* color_ram)
+{
+    write_all(bitmap, make_prg(bitmap_load_address, img.bitmap_data));
+    write_all(color, make_prg(screen_load_address, img.screen_ram));
+    if (color_ram)
+        write_all(*color_ram, make_prg(color_ram_load_address, img.color_ram));
 
-    return true;
+    return bitmap && color && (!color_ram || *color_ram);
 }
 
-std::string generate_6502_asm(const std::string& fname)
+bool write_koala(const C64ImageData& img, std::ostream& out)
+{
+    write_all(out, make_koala(img));
+    return static_cast<bool>(out);
+}
+
+std::string generate_6502_asm(const std::string& fname, bool multicolor, int background, bool packed)
 {
     std::string tempname;
     size_t last_dot = fname.find_last_of(".");
@@ -141,85 +177,247 @@ std::string generate_6502_asm(const std::string& fname)
     for (auto& ch : tempname)
         name += toupper(ch);
 
-    std::ostringstream oss;
-    oss <<
-        "        MSGFLG = $009D\n" <<
-        "        FA = $00BA\n" <<
-        "        STROUT = $AB1E\n" <<
-        "\n" <<
-        "        CIAICR = $DC0D\n" <<
-        "        CIACRA = $DC0E\n" <<
-        "        RESTOR = $FF8A\n" <<
-        "        SETLFS = $FFBA\n" <<
-        "        SETNAM = $FFBD\n" <<
-        "        LOAD = $FFD5\n" <<
-        "         \n" <<
-        "        .org $102               ; this MUST BE the autostart address\n" <<
-        "\n" <<
-        "        lda #$7F                ;   suppress any irq&nmi\n" <<
-        "        sta CIAICR              ;   to disallow abort load by R/S\n" <<
-        "        sta CIACRA\n" <<
-        "        jsr RESTOR              ;   restore i/o-vex (just for sure...)\n" <<
-        "         \n" <<
-        "        lda $D018\n" <<
-        "        ora #%00001000\n" <<
-        "        sta $D018\n" <<
-        "        lda $D011\n" <<
-        "        ora #%00100000\n" <<
-        "        sta $D011\n" <<
-        "\n" <<
-        "\n" <<
-        "        ;;;;;;;;; load BITMAP\n" <<
-        "        lda #NAMELEN\n" <<
-        "        ldx #<NAME\n" <<
-        "        ldy #>NAME\n" <<
-        "        jsr SETNAM              ;   set name of file to load\n" <<
-        "\n" <<
-        "        lda FA                  ;   last device number - should be 8\n" <<
-        "        tax\n" <<
-        "        tay\n" <<
-        "        jsr SETLFS              ;   open 8,8,8\n" <<
-        "\n" <<
-        "        lda #0                  ;   load... (lda #1 would verify)\n" <<
-        "        sta MSGFLG              ;   flag progam mode (to suppress 'searching for...' msg)\n" <<
-        "        jsr LOAD                ;   ...filename,8,8\n" <<
-        "  \n" <<
-        "\n" <<
-        "        ;;;;;;;;; load COLOR\n" <<
-        "        lda #CNAMELEN\n" <<
-        "        ldx #<CNAME\n" <<
-        "        ldy #>CNAME\n" <<
-        "        jsr SETNAM              ;   set name of file to load\n" <<
-        "\n" <<
-        "        lda FA                  ;   last device number - should be 8\n" <<
-        "        tax\n" <<
-        "        tay\n" <<
-        "        jsr SETLFS              ;   open 8,8,8\n" <<
-        "\n" <<
-        "        lda #0                  ;   load... (lda #1 would verify)\n" <<
-        "        sta MSGFLG              ;   flag progam mode (to suppress 'searching for...' msg)\n" <<
-        "        jsr LOAD                ;   ...filename,8,8\n" <<
-        "\n" <<
-        "        lda #$81                ;  restore any irq&nmi\n" <<
-        "        sta CIAICR              ;\n" <<
-        "        sta CIACRA\n" <<
-        "\n" <<
-        "LOOPFOREVER\n" <<
-        "        jmp LOOPFOREVER         ; loop\n" <<
-        "\n" <<
-        "NAME    .str "; 
-        
-    oss <<
-        "\"" << name << "IMAGE\",0        ;   enter name of prg-to-load here\n" <<
-        "        NAMELEN = * - NAME - 1\n" <<
-        "\n" <<
-        "CNAME    .str ";    
-    oss <<
-        "\"" << name << "COLOR\",0        ;   enter name of prg-to-load here\n" <<
-        "        CNAMELEN = * - CNAME - 1\n" <<
-        "\n" <<
-        "                                ;   now comes the smart part:\n" <<
+    // The loader runs from the stack page, so it and its file names have to end well clear
+    // of where the KERNAL's LOAD pushes. Byte counts of the code below (zero page symbols
+    // counted as absolute, in case the assembler does so), plus each name, its suffix and 0.
+    const size_t load_call_bytes = 25;
+    size_t loader_bytes = 27 + (multicolor ? 13 : 0) + 11;
+    if (packed)
+        loader_bytes += load_call_bytes + 109 + name.size() + 5;
+    else if (multicolor)
+        loader_bytes += 3 * load_call_bytes + 3 * name.size() + 17;
+    else
+        loader_bytes += 2 * load_call_bytes + 2 * name.size() + 12;
+    if (0x102 + loader_bytes > 0x1E0)
+        throw std::runtime_error("File name too long for the loader in the stack page: " + name);
+
+    // Adjacent literals below join at compile time, so each += is one append
+    std::string code;
+    code.reserve(4096);
+    code +=
+        "        MSGFLG = $009D\n"
+        "        FA = $00BA\n"
+        "        STROUT = $AB1E\n"
+        "\n"
+        "        CIAICR = $DC0D\n"
+        "        CIACRA = $DC0E\n"
+        "        RESTOR = $FF8A\n"
+        "        SETLFS = $FFBA\n"
+        "        SETNAM = $FFBD\n"
+        "        LOAD = $FFD5\n";
+
+    if (packed) {
+        code +=
+            "\n"
+            "        SRC = $FB               ;   depacker pointers (free zero page)\n"
+            "        DST = $FD\n"
+            "        REF = $F7\n"
+            "        PACKED = " + std::to_string(packed_load_address) + "   ;   load address of the packed file\n";
+    }
+
+    code +=
+        "         \n"
+        "        .org $102               ; this MUST BE the autostart address\n"
+        "\n"
+        "        lda #$7F                ;   suppress any irq&nmi\n"
+        "        sta CIAICR              ;   to disallow abort load by R/S\n"
+        "        sta CIACRA\n"
+        "        jsr RESTOR              ;   restore i/o-vex (just for sure...)\n"
+        "         \n"
+        "        lda $D018\n"
+        "        ora #%00001000\n"
+        "        sta $D018\n"
+        "        lda $D011\n"
+        "        ora #%00100000\n"
+        "        sta $D011\n";
+
+    if (multicolor) {
+        code +=
+            "        lda $D016\n"
+            "        ora #%00010000          ;   multicolor mode\n"
+            "        sta $D016\n"
+            "        lda #" + std::to_string(background & 0x0f) + "\n"
+            "        sta $D021               ;   background color\n";
+    }
+
+    if (packed) {
+        code +=
+            "\n"
+            "\n"
+            "        ;;;;;;;;; load PACKED\n"
+            "        lda #PNAMELEN\n"
+            "        ldx #<PNAME\n"
+            "        ldy #>PNAME\n"
+            "        jsr SETNAM              ;   set name of file to load\n"
+            "\n"
+            "        lda FA                  ;   last device number - should be 8\n"
+            "        tax\n"
+            "        tay\n"
+            "        jsr SETLFS              ;   open 8,8,8\n"
+            "\n"
+            "        lda #0                  ;   load... (lda #1 would verify)\n"
+            "        sta MSGFLG              ;   flag progam mode (to suppress 'searching for...' msg)\n"
+            "        jsr LOAD                ;   ...filename,8,8\n"
+            "\n"
+            "        ;;;;;;;;; depack: streams of address, then tokens\n"
+            "        ;;;;;;;;; $01-$7F literals, $84-$FF copy from offset back, $00 end\n"
+            "        lda #<PACKED\n"
+            "        sta SRC\n"
+            "        lda #>PACKED\n"
+            "        sta SRC+1\n"
+            "DSTREAM\n"
+            "        jsr GETBYTE\n"
+            "        sta DST\n"
+            "        jsr GETBYTE             ;   address high byte 0 ends the list\n"
+            "        beq DDONE\n"
+            "        sta DST+1\n"
+            "DTOKEN\n"
+            "        jsr GETBYTE\n"
+            "        beq DSTREAM             ;   0 ends the stream\n"
+            "        bmi DMATCH\n"
+            "        tax                     ;   literal count, y = 0\n"
+            "DLIT\n"
+            "        lda (SRC),y\n"
+            "        sta (DST),y\n"
+            "        iny\n"
+            "        dex\n"
+            "        bne DLIT\n"
+            "        tya                     ;   skip the literals in the input\n"
+            "        clc\n"
+            "        adc SRC\n"
+            "        sta SRC\n"
+            "        bcc DADVANCE\n"
+            "        inc SRC+1\n"
+            "        jmp DADVANCE\n"
+            "DMATCH\n"
+            "        and #$7F\n"
+            "        tax                     ;   match length\n"
+            "        jsr GETBYTE\n"
+            "        sta REF\n"
+            "        jsr GETBYTE\n"
+            "        sta REF+1\n"
+            "        lda REF                 ;   REF = DST + negative offset\n"
+            "        clc\n"
+            "        adc DST\n"
+            "        sta REF\n"
+            "        lda REF+1\n"
+            "        adc DST+1\n"
+            "        sta REF+1\n"
+            "DCOPY\n"
+            "        lda (REF),y             ;   forward byte copy, so overlapping matches repeat\n"
+            "        sta (DST),y\n"
+            "        iny\n"
+            "        dex\n"
+            "        bne DCOPY\n"
+            "DADVANCE\n"
+            "        tya                     ;   DST += count\n"
+            "        clc\n"
+            "        adc DST\n"
+            "        sta DST\n"
+            "        bcc DTOKEN\n"
+            "        inc DST+1\n"
+            "        jmp DTOKEN\n"
+            "\n"
+            "GETBYTE                         ;   a = next input byte, y = 0, flags from a\n"
+            "        ldy #0\n"
+            "        lda (SRC),y\n"
+            "        inc SRC\n"
+            "        bne GETBYTE1\n"
+            "        inc SRC+1\n"
+            "GETBYTE1\n"
+            "        cmp #0\n"
+            "        rts\n"
+            "DDONE\n";
+    }
+    else {
+        code +=
+            "\n"
+            "\n"
+            "        ;;;;;;;;; load BITMAP\n"
+            "        lda #NAMELEN\n"
+            "        ldx #<NAME\n"
+            "        ldy #>NAME\n"
+            "        jsr SETNAM              ;   set name of file to load\n"
+            "\n"
+            "        lda FA                  ;   last device number - should be 8\n"
+            "        tax\n"
+            "        tay\n"
+            "        jsr SETLFS              ;   open 8,8,8\n"
+            "\n"
+            "        lda #0                  ;   load... (lda #1 would verify)\n"
+            "        sta MSGFLG              ;   flag progam mode (to suppress 'searching for...' msg)\n"
+            "        jsr LOAD                ;   ...filename,8,8\n"
+            "  \n"
+            "\n"
+            "        ;;;;;;;;; load COLOR\n"
+            "        lda #CNAMELEN\n"
+            "        ldx #<CNAME\n"
+            "        ldy #>CNAME\n"
+            "        jsr SETNAM              ;   set name of file to load\n"
+            "\n"
+            "        lda FA                  ;   last device number - should be 8\n"
+            "        tax\n"
+            "        tay\n"
+            "        jsr SETLFS              ;   open 8,8,8\n"
+            "\n"
+            "        lda #0                  ;   load... (lda #1 would verify)\n"
+            "        sta MSGFLG              ;   flag progam mode (to suppress 'searching for...' msg)\n"
+            "        jsr LOAD                ;   ...filename,8,8\n";
+
+        if (multicolor) {
+            code +=
+                "\n"
+                "        ;;;;;;;;; load COLOR RAM\n"
+                "        lda #RNAMELEN\n"
+                "        ldx #<RNAME\n"
+                "        ldy #>RNAME\n"
+                "        jsr SETNAM              ;   set name of file to load\n"
+                "\n"
+                "        lda FA                  ;   last device number - should be 8\n"
+                "        tax\n"
+                "        tay\n"
+                "        jsr SETLFS              ;   open 8,8,8\n"
+                "\n"
+                "        lda #0                  ;   load... (lda #1 would verify)\n"
+                "        sta MSGFLG              ;   flag progam mode (to suppress 'searching for...' msg)\n"
+                "        jsr LOAD                ;   ...filename,8,8\n";
+        }
+    }
+
+    code +=
+        "\n"
+        "        lda #$81                ;  restore any irq&nmi\n"
+        "        sta CIAICR              ;\n"
+        "        sta CIACRA\n"
+        "\n"
+        "LOOPFOREVER\n"
+        "        jmp LOOPFOREVER         ; loop\n"
+        "\n";
+
+    if (packed) {
+        code +=
+            "PNAME    .str \"" + name + "PACK\",0        ;   enter name of prg-to-load here\n"
+            "        PNAMELEN = * - PNAME - 1\n"
+            "\n";
+    }
+    else {
+        code +=
+            "NAME    .str \"" + name + "IMAGE\",0        ;   enter name of prg-to-load here\n"
+            "        NAMELEN = * - NAME - 1\n"
+            "\n"
+            "CNAME    .str \"" + name + "COLOR\",0        ;   enter name of prg-to-load here\n"
+            "        CNAMELEN = * - CNAME - 1\n"
+            "\n";
+        if (multicolor) {
+            code +=
+                "RNAME    .str \"" + name + "CRAM\",0        ;   enter name of prg-to-load here\n"
+                "        RNAMELEN = * - RNAME - 1\n"
+                "\n";
+        }
+    }
+    code +=
+        "                                ;   now comes the smart part:\n"
         "        .fill $01, $200-*\n";
 
-    return oss.str();
+    return code;
 }
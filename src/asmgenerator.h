@@ -2,14 +2,61 @@
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <span>
+#include <stdint.h>
 #include <vector>
 
 struct C64ImageData {
-    std::vector<uint8_t> color_ram;
-    std::vector<uint8_t> bitmap_data;
+    std::vector<uint8_t> color_ram;     // $D800: multicolor %11 color per cell
+    std::vector<uint8_t> bitmap_data;   // $2000
+    std::vector<uint8_t> screen_ram;    // $0400: two colors per cell, high and low nibble
+    uint8_t background = 0;             // $D021: multicolor %00 color
     bool multicolor;
 };
 
-extern std::string generate_6502_asm(const std::string& name);
-extern C64ImageData convert_to_c64_memory(uint8_t* image, int width, int height, bool multicolor);
-extern bool generate_6502_image(const C64ImageData& img, std::ofstream& bitmap, std::ofstream& color);
+// Marks cell_indices entries outside the image; they take whichever colors the cell already has
+const uint8_t unused_pixel = 0xFF;
+
+// Loader for the generated files. With packed, it loads the one file from make_packed_prg
+// and depacks it in place instead of loading bitmap, screen and color RAM separately.
+// Throws std::runtime_error if the name is too long for the loader to fit below $1E0.
+extern std::string generate_6502_asm(const std::string& name, bool multicolor = false, int background = 0,
+    bool packed = false);
+
+// Pack palette indices into C64 memory in one pass. cell_indices holds cols x rows cells,
+// each 8x8 (hires) or 4x8 (multicolor) indices row-major and contiguous; cells beyond the
+// 40x25 screen are dropped. Throws std::runtime_error if a cell has more colors than the
+// mode allows (background included for multicolor).
+extern C64ImageData pack_c64_cells(const uint8_t* cell_indices, int cols, int rows, bool multicolor, int background = 0);
+
+// pack_c64_cells for an RGB image whose pixels are already C64 palette colors
+// (multicolor: one pixel per fat pixel, width up to 160)
+extern C64ImageData convert_to_c64_memory(const uint8_t* image, int width, int height, bool multicolor, int background = 0);
+
+// Same from one C64 palette index per pixel
+extern C64ImageData convert_indexed_to_c64_memory(const uint8_t* indices, int width, int height, bool multicolor,
+    int background = 0);
+
+// Load addresses of the generated files
+const uint16_t bitmap_load_address = 0x2000;
+const uint16_t screen_load_address = 0x0400;
+const uint16_t color_ram_load_address = 0xD800;
+const uint16_t koala_load_address = 0x6000;
+const uint16_t packed_load_address = 0x4000;   // above the bitmap, so depacking never overwrites unread input
+
+// A PRG file in memory: the little-endian load address followed by data
+extern std::vector<uint8_t> make_prg(uint16_t load_address, std::span<const uint8_t> data);
+
+// A Koala Painter file in memory: load address $6000, bitmap, screen RAM, color RAM, background
+extern std::vector<uint8_t> make_koala(const C64ImageData& img);
+
+// The bitmap, screen RAM and (multicolor) color RAM as one PRG at packed_load_address,
+// each a stream of pack_stream() for the loader's depacker
+extern std::vector<uint8_t> make_packed_prg(const C64ImageData& img);
+
+// Write the bitmap and screen RAM (and, when color_ram is given, color RAM) as PRG files
+extern bool generate_6502_image(const C64ImageData& img, std::ofstream& bitmap, std::ofstream& color,
+    std::ofstream* color_ram = nullptr);
+
+// Write make_koala(img) to out
+extern bool write_koala(const C64ImageData& img, std::ostream& out);
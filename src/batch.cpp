@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+#include "batch.h"
+#include "conversioncontext.h"
+#include "threadpool.h"
+
+namespace fs = std::filesystem;
+
+// Extensions stb_image can decode
+static bool is_image_file(const fs::path& path)
+{
+    static const char* extensions[] = {
+        ".png", ".jpg", ".jpeg", ".bmp", ".gif", ".tga", ".psd", ".hdr", ".pic", ".pnm", ".ppm", ".pgm"
+    };
+
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char ch) { return std::tolower(ch); });
+    return std::find(std::begin(extensions), std::end(extensions), ext) != std::end(extensions);
+}
+
+// '*' matches any run of characters, '?' any single character
+static bool wildcard_match(const char* pattern, const char* name)
+{
+    if (*pattern == '\0')
+        return *name == '\0';
+    if (*pattern == '*')
+        return wildcard_match(pattern + 1, name) || (*name && wildcard_match(pattern, name + 1));
+    if (*name && (*pattern == '?' || *pattern == *name))
+        return wildcard_match(pattern + 1, name + 1);
+    return false;
+}
+
+// Names compare as text, except that runs of digits compare as numbers
+static bool natural_less(const std::string& a, const std::string& b)
+{
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (std::isdigit(static_cast<unsigned char>(a[i])) && std::isdigit(static_cast<unsigned char>(b[j]))) {
+            auto a_end = a.find_first_not_of("0123456789", i);
+            auto b_end = b.find_first_not_of("0123456789", j);
+            a_end = a_end == std::string::npos ? a.size() : a_end;
+            b_end = b_end == std::string::npos ? b.size() : b_end;
+            auto a_digits = a.substr(i, a_end - i);
+            auto b_digits = b.substr(j, b_end - j);
+            a_digits.erase(0, std::min(a_digits.find_first_not_of('0'), a_digits.size() - 1));
+            b_digits.erase(0, std::min(b_digits.find_first_not_of('0'), b_digits.size() - 1));
+            if (a_digits.size() != b_digits.size())
+                return a_digits.size() < b_digits.size();
+            if (a_digits != b_digits)
+                return a_digits < b_digits;
+            i = a_end;
+            j = b_end;
+        }
+        else {
+            if (a[i] != b[j])
+                return a[i] < b[j];
+            ++i;
+            ++j;
+        }
+    }
+    return a.size() - i < b.size() - j;
+}
+
+std::vector<std::string> collect_image_inputs(const std::string& input_spec)
+{
+    std::vector<fs::path> inputs;
+    fs::path spec(input_spec);
+    bool listed = false;
+
+    if (fs::is_directory(spec)) {
+        for (auto& entry : fs::directory_iterator(spec)) {
+            if (entry.is_regular_file() && is_image_file(entry.path()))
+                inputs.push_back(entry.path());
+        }
+    }
+    else if (input_spec.find_first_of("*?") != std::string::npos) {
+        auto dir = spec.has_parent_path() ? spec.parent_path() : fs::path(".");
+        auto pattern = spec.filename().string();
+        if (!fs::is_directory(dir))
+            throw std::runtime_error("Batch input directory not found: " + dir.string());
+        for (auto& entry : fs::directory_iterator(dir)) {
+            if (entry.is_regular_file() && wildcard_match(pattern.c_str(), entry.path().filename().string().c_str()))
+                inputs.push_back(entry.path());
+        }
+    }
+    else {
+        std::ifstream manifest(spec);
+        if (!manifest)
+            throw std::runtime_error("Cannot open batch input: " + input_spec);
+        std::string line;
+        while (std::getline(manifest, line)) {
+            line.erase(0, line.find_first_not_of(" \t\r"));
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (!line.empty() && line[0] != '#')
+                inputs.push_back(line);
+        }
+        listed = true;
+    }
+
+    std::vector<std::string> paths;
+    for (auto& input : inputs)
+        paths.push_back(input.string());
+    // Directory iteration order is unspecified
+    if (!listed)
+        std::sort(paths.begin(), paths.end(), natural_less);
+    return paths;
+}
+
+std::vector<BatchJob> collect_batch_jobs(const std::string& input_spec, const std::string& output_dir)
+{
+    std::vector<fs::path> inputs;
+    for (auto& input : collect_image_inputs(input_spec))
+        inputs.push_back(input);
+
+    // Keep runs reproducible, whatever order the inputs came in
+    std::sort(inputs.begin(), inputs.end());
+
+    // Outputs are named after the input's stem; inputs sharing one (a.png and a.jpg) keep
+    // their extension in the name as well (a_png.png, a_jpg.png)
+    std::map<std::string, int> stem_count;
+    for (auto& input : inputs)
+        ++stem_count[input.stem().string()];
+
+    std::map<std::string, std::string> claimed;     // output name -> input that has it
+    std::vector<BatchJob> jobs;
+    for (auto& input : inputs) {
+        auto name = input.stem().string();
+        if (stem_count[name] > 1)
+            name += "_" + input.extension().string().substr(input.extension().empty() ? 0 : 1);
+        auto [found, inserted] = claimed.emplace(name, input.string());
+        if (!inserted) {
+            // Jobs run concurrently, so two of them writing one output would clobber each other
+            throw std::runtime_error("Batch inputs " + found->second + " and " + input.string()
+                + " would both be written as " + name + ".png; rename one of them");
+        }
+        auto output = fs::path(output_dir) / name;
+        output += ".png";
+        jobs.push_back({ input.string(), output.string() });
+    }
+
+    fs::create_directories(output_dir);
+    return jobs;
+}
+
+std::vector<BatchFailure> run_batch(const std::vector<BatchJob>& jobs, const ConvertOptions& options,
+    std::vector<ConversionStats>* stats)
+{
+    // Image-level parallelism replaces the per-image cell-row split
+    ConvertOptions job_options = options;
+    job_options.threads = 1;
+    job_options.preview = false;
+    // Workers take jobs in any order, so no image is the previous frame of another
+    job_options.cell_reuse_tolerance = -1;
+
+    std::vector<std::string> errors(jobs.size());
+    std::vector<char> failed(jobs.size(), 0);
+    std::vector<ConversionStats> job_stats(jobs.size());
+    std::mutex log_mutex;
+
+    work_stealing_for(static_cast<int>(jobs.size()), options.threads, [&](int i) {
+        // One context per worker thread keeps its buffers warm across jobs
+        thread_local ConversionContext context;
+        std::ostringstream log;
+        try {
+            auto result = convert_image(jobs[i].input_path, jobs[i].output_path, job_options, log, context);
+            log << "Converted " << jobs[i].input_path << " -> " << result.output_path
+                << " (" << result.width << "x" << result.height << ")\n";
+            job_stats[i] = result.stats;
+        }
+        catch (const std::exception& e) {
+            failed[i] = 1;
+            errors[i] = e.what();
+            log << "FAILED " << jobs[i].input_path << ": " << e.what() << "\n";
+        }
+
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cout << log.str() << std::flush;
+    });
+
+    std::vector<BatchFailure> failures;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        if (failed[i])
+            failures.push_back({ jobs[i].input_path, errors[i] });
+        else if (stats)
+            stats->push_back(job_stats[i]);
+    }
+    return failures;
+}
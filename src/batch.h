@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "c64converter.h"
+
+struct BatchJob {
+    std::string input_path;
+    std::string output_path;
+};
+
+struct BatchFailure {
+    std::string input_path;
+    std::string reason;
+};
+
+// Image paths named by input_spec: a directory (all decodable images in it), a glob such as
+// "art/*.png" (wildcards in the file name only) or a manifest file listing one input path
+// per line ('#' starts a comment). Manifest entries keep their order; directory and glob
+// matches are sorted by name with digit runs compared as numbers (frame2 before frame10).
+extern std::vector<std::string> collect_image_inputs(const std::string& input_spec);
+
+// Expand a batch input (as for collect_image_inputs) into jobs writing <output_dir>/<stem>.png,
+// in path order. Inputs with the same stem are written as <stem>_<ext>.png instead; if two
+// inputs would still share an output (same file name in different directories), throws
+// std::runtime_error before anything is converted.
+extern std::vector<BatchJob> collect_batch_jobs(const std::string& input_spec, const std::string& output_dir);
+
+// Convert every job concurrently; one failing image does not affect the others.
+// options.threads is the number of images converted at once (0 = all cores).
+// stats, if given, receives the stage stats of every image that converted, in job order.
+extern std::vector<BatchFailure> run_batch(const std::vector<BatchJob>& jobs, const ConvertOptions& options,
+    std::vector<ConversionStats>* stats = nullptr);
@@ -1,141 +1,1006 @@
 #include <array>
 #include <algorithm>
+#include <chrono>
+#include <string>
 #include <vector>
 #include "blockreducer.h"
 #include "pallet.h"
+#include "simd.h"
+#include "threadpool.h"
+#include "trace.h"
 #include <cassert>
-#include <map>
+#include <limits>
 
-void reduce_colors_per_multicolor_block(uint8_t* image, int width, int height, int channels,
-    const std::vector<std::array<uint8_t, 3>>& palette = c64_palette);
+// Pixels a reducer works on: packed RGB, or palette indices for an image that is already
+// on the palette (dithered). Indexed input skips the nearest-color search, and each cell
+// collapses to at most 16 distinct colors.
+struct ReducerPixels {
+    uint8_t* rgb;               // null for indexed input
+    const uint8_t* indices;     // used when rgb is null
+    int width;
+    int height;
+};
 
-void reduce_colors_per_block(uint8_t* image, int width, int height, int channels,
-    const std::vector<std::array<uint8_t, 3>>& palette = c64_palette);
+// Reducer output: the palette index of every pixel when indices is set (it may be the
+// input's own buffer), otherwise the chosen colors are written back into the RGB input
+BlockReduceResult reduce_colors_per_multicolor_block(const ReducerPixels& pixels, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, const BlockReduceOptions& options, BlockReducerScratch& scratch);
 
+void reduce_colors_per_block(const ReducerPixels& pixels, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, const BlockReduceOptions& options, BlockReducerScratch& scratch);
 
-void convert_to_c64_hires(uint8_t* image, int width, int height, int bg_color)
+
+void convert_to_c64_hires(uint8_t* image, int width, int height, int bg_color, int threads,
+    BlockReducerScratch* scratch)
 {
-    reduce_colors_per_block(image, width, height, 3, c64_palette);
+    BlockReduceOptions options;
+    options.bg_color = bg_color;
+    options.threads = threads;
+    convert_to_c64_hires(image, width, height, options, scratch);
 }
 
-void convert_to_c64_multicolor(uint8_t* image, int width, int height, int bg_color)
+void convert_to_c64_multicolor(uint8_t* image, int width, int height, int bg_color, int threads,
+    BlockReducerScratch* scratch)
 {
-    reduce_colors_per_multicolor_block(image, width, height, 3, c64_palette);
+    BlockReduceOptions options;
+    options.bg_color = bg_color;
+    options.threads = threads;
+    convert_to_c64_multicolor(image, width, height, options, scratch);
 }
 
-void reduce_colors_per_multicolor_block(uint8_t* image, int width, int height, int channels,
-    const std::vector<std::array<uint8_t, 3>>& palette)
+void convert_to_c64_hires(uint8_t* image, int width, int height, const BlockReduceOptions& options,
+    BlockReducerScratch* scratch, uint8_t* indices)
 {
-    const int palette_size = static_cast<int>(palette.size());
-    assert(palette_size == 16);
-    const int block_width = 4;  // Multicolor blocks are 4x8 pixels
-    const int block_height = 8;
+    BlockReducerScratch local;
+    reduce_colors_per_block({ image, nullptr, width, height }, indices, c64_palette, options, scratch ? *scratch : local);
+}
+
+BlockReduceResult convert_to_c64_multicolor(uint8_t* image, int width, int height, const BlockReduceOptions& options,
+    BlockReducerScratch* scratch, uint8_t* indices)
+{
+    BlockReducerScratch local;
+    return reduce_colors_per_multicolor_block({ image, nullptr, width, height }, indices, c64_palette, options,
+        scratch ? *scratch : local);
+}
+
+void reduce_indexed_hires(uint8_t* indices, int width, int height, const BlockReduceOptions& options,
+    BlockReducerScratch* scratch)
+{
+    BlockReducerScratch local;
+    reduce_colors_per_block({ nullptr, indices, width, height }, indices, c64_palette, options, scratch ? *scratch : local);
+}
+
+BlockReduceResult reduce_indexed_multicolor(uint8_t* indices, int width, int height, const BlockReduceOptions& options,
+    BlockReducerScratch* scratch)
+{
+    BlockReducerScratch local;
+    return reduce_colors_per_multicolor_block({ nullptr, indices, width, height }, indices, c64_palette, options,
+        scratch ? *scratch : local);
+}
+
+bool CellColorCache::find(std::string_view key, std::array<uint8_t, 4>& colors)
+{
+    auto& entry = shard(key);
+    {
+        std::lock_guard<std::mutex> lock(entry.mutex);
+        auto it = entry.cells.find(key);
+        if (it != entry.cells.end()) {
+            colors = it->second;
+            ++hit_count;
+            return true;
+        }
+    }
+    ++miss_count;
+    return false;
+}
+
+void CellColorCache::insert(std::string_view key, const std::array<uint8_t, 4>& colors)
+{
+    auto& entry = shard(key);
+    std::lock_guard<std::mutex> lock(entry.mutex);
+    if (entry.cells.size() >= max_shard_entries)
+        entry.cells.clear();
+    entry.cells.emplace(key, colors);
+}
+
+// Cell-indexed layout of the image: cell (row, col) lives at row * cols + col.
+// Partial cells at the right and bottom edges are part of the grid.
+struct CellGrid {
+    int block_width;
+    int block_height;
+    int cols;
+    int rows;
+
+    CellGrid(int width, int height, int block_width, int block_height) :
+        block_width(block_width), block_height(block_height),
+        cols((width + block_width - 1) / block_width),
+        rows((height + block_height - 1) / block_height)
+    {
+    }
+
+    int size() const { return cols * rows; }
+};
+
+// Size the scratch buffers for an image; only grows capacity when needed
+static void prepare_scratch(BlockReducerScratch& scratch, int width, int height, const CellGrid& grid)
+{
+    scratch.cell_freq.resize(grid.size());
+    scratch.cell_colors.resize(grid.size());
+    scratch.indices.resize(static_cast<size_t>(width) * height);
+}
 
-    std::map<std::pair<int, int>, std::array<int, 16>> colorfreqdict;
+// Per-cell cost table for the exhaustive solver: cost[c][u] is the metric_distance from
+// the cell's u-th distinct pixel color to palette color c, times how often it occurs.
+// Columns past count are zero, so sums can always run over whole blocks of lanes.
+struct CellCosts {
+    static constexpr int max_pixels = 64;
+    static constexpr int lanes = 8;
 
-    // Step 1: Get frequency of colors in each 4x8 block
-    for (auto y = 0; y < height; y++) {
-        auto block_row = y / block_height;
+    alignas(32) uint32_t cost[16][max_pixels];
+    int count;
+    uint8_t candidates[16];     // colors worth trying, ascending; see find_candidates
+    int candidate_count;
 
-        for (auto x = 0; x < width; x++) {
-            auto block_col = x / block_width;
+    int padded_count() const { return (count + lanes - 1) / lanes * lanes; }
+};
 
-            if (colorfreqdict.find({ block_row, block_col }) == colorfreqdict.end()) {
-                colorfreqdict[{block_row, block_col}] = { 0 };
+// Distinct pixel colors of one cell, planar, with their pixel counts. The three planes hold
+// the colors' metric_coords (RGB itself for the RGB metric). Entries past count are zero
+// up to the next whole block of lanes, so padded lanes cost nothing.
+struct CellColors {
+    alignas(32) int32_t r[CellCosts::max_pixels];
+    alignas(32) int32_t g[CellCosts::max_pixels];
+    alignas(32) int32_t b[CellCosts::max_pixels];
+    alignas(32) uint32_t weights[CellCosts::max_pixels];
+    int count;
+};
+
+// Merge a cell's pixels into distinct colors through a small hash table: dithered cells
+// hold only a handful and multicolor cells are pairs of equal pixels, which shrinks every
+// later pair/triple sum to a few lanes.
+static void collect_cell_colors(const uint8_t* image, int width, int height, const CellGrid& grid,
+    int cell_row, int cell_col, ColorMetric metric, CellColors& colors)
+{
+    static constexpr int hash_size = 128;   // power of two, at least twice max_pixels
+    int8_t slots[hash_size];
+    uint32_t keys[CellCosts::max_pixels];
+    int count = 0;
+    std::fill_n(slots, hash_size, static_cast<int8_t>(-1));
+
+    auto first_x = cell_col * grid.block_width;
+    auto last_x = std::min(width, first_x + grid.block_width);
+    auto last_y = std::min(height, (cell_row + 1) * grid.block_height);
+    for (auto y = cell_row * grid.block_height; y < last_y; y++) {
+        for (auto x = first_x; x < last_x; x++) {
+            const uint8_t* pixel = &image[(y * width + x) * 3];
+            uint32_t key = pixel[0] | (pixel[1] << 8) | (pixel[2] << 16);
+            auto h = (key * 2654435761u) >> 25;
+            while (slots[h] >= 0 && keys[slots[h]] != key)
+                h = (h + 1) & (hash_size - 1);
+            if (slots[h] < 0) {
+                slots[h] = static_cast<int8_t>(count);
+                keys[count] = key;
+                auto coords = metric_coords(pixel, metric);
+                colors.r[count] = coords[0];
+                colors.g[count] = coords[1];
+                colors.b[count] = coords[2];
+                colors.weights[count++] = 0;
             }
+            ++colors.weights[slots[h]];
+        }
+    }
+
+    colors.count = count;
+    for (auto u = count; u % CellCosts::lanes != 0; ++u) {
+        colors.r[u] = colors.g[u] = colors.b[u] = 0;
+        colors.weights[u] = 0;
+    }
+}
+
+// Same for indexed pixels: a palette histogram of the cell
+static void collect_cell_colors(const uint8_t* indices, int width, int height, const CellGrid& grid,
+    int cell_row, int cell_col, const PaletteLut& lut, CellColors& colors)
+{
+    uint32_t counts[16] = {};
+    auto first_x = cell_col * grid.block_width;
+    auto last_x = std::min(width, first_x + grid.block_width);
+    auto last_y = std::min(height, (cell_row + 1) * grid.block_height);
+    for (auto y = cell_row * grid.block_height; y < last_y; y++) {
+        for (auto x = first_x; x < last_x; x++)
+            ++counts[indices[y * width + x]];
+    }
+
+    int count = 0;
+    for (auto c = 0; c < 16; ++c) {
+        if (counts[c] == 0)
+            continue;
+        colors.r[count] = lut.coords[c][0];
+        colors.g[count] = lut.coords[c][1];
+        colors.b[count] = lut.coords[c][2];
+        colors.weights[count++] = counts[c];
+    }
+
+    colors.count = count;
+    for (auto u = count; u % CellCosts::lanes != 0; ++u) {
+        colors.r[u] = colors.g[u] = colors.b[u] = 0;
+        colors.weights[u] = 0;
+    }
+}
+
+static void fill_cost_rows_scalar(const CellColors& colors, int padded_count, const PaletteLut& lut, CellCosts& costs)
+{
+    for (auto c = 0; c < 16; ++c) {
+        const int32_t* entry = lut.coords[c].data();
+        uint32_t* row = costs.cost[c];
+        for (auto u = 0; u < padded_count; ++u) {
+            const int32_t color[3] = { colors.r[u], colors.g[u], colors.b[u] };
+            row[u] = colors.weights[u] * metric_distance(color, entry, lut.metric);
+        }
+    }
+}
+
+// True when color d is at least as close as color c to every pixel of the cell;
+// equal reports whether it is exactly as close to all of them
+static bool no_worse_scalar(const CellCosts& costs, int d, int c, bool& equal)
+{
+    equal = true;
+    for (auto u = 0; u < costs.count; ++u) {
+        if (costs.cost[d][u] > costs.cost[c][u])
+            return false;
+        equal = equal && costs.cost[d][u] == costs.cost[c][u];
+    }
+    return true;
+}
+
+#ifdef SIMD_X86
+
+TARGET_AVX2 static bool no_worse_avx2(const CellCosts& costs, int d, int c, bool& equal)
+{
+    const int blocks = costs.padded_count() / CellCosts::lanes;
+    __m256i all_equal = _mm256_set1_epi32(-1);
+    for (auto k = 0; k < blocks; ++k) {
+        __m256i vc = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[c]) + k);
+        __m256i vd = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[d]) + k);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_max_epu32(vc, vd), vc)) != -1)
+            return false;
+        all_equal = _mm256_and_si256(all_equal, _mm256_cmpeq_epi32(vc, vd));
+    }
+    equal = _mm256_movemask_epi8(all_equal) == -1;
+    return true;
+}
+
+#endif
+
+// A color is dropped when another color is at least as close to every pixel of the cell
+// (exactly as close to all of them only counts for the lower index). Swapping the
+// dominating color in never raises a set's cost, so the best set of survivors is still
+// the best set overall; keeping a few extra colors is always safe. Colors nearest to some
+// pixel are kept unchecked, and a color can only be dominated by one with a lower total.
+// fixed (the multicolor background, or -1) is always part of the set: it prunes what it
+// dominates but is not a candidate itself. Survivors are topped up with the lowest unused
+// colors when there are fewer than needed.
+static void find_candidates(CellCosts& costs, int fixed, int needed)
+{
+    uint32_t totals[16] = {};
+    uint16_t nearest = 0;
+    for (auto u = 0; u < costs.count; ++u) {
+        uint32_t least = costs.cost[0][u];
+        for (auto c = 1; c < 16; ++c)
+            least = std::min(least, costs.cost[c][u]);
+        for (auto c = 0; c < 16; ++c) {
+            totals[c] += costs.cost[c][u];
+            nearest |= (costs.cost[c][u] == least) << c;
+        }
+    }
+
+#ifdef SIMD_X86
+    auto no_worse = cpu_simd_level() == SimdLevel::AVX2 ? no_worse_avx2 : no_worse_scalar;
+#else
+    auto no_worse = no_worse_scalar;
+#endif
 
-            auto idx = (y * width + x) * 3;
-            uint8_t color_idx = find_closest_color(&image[idx], palette);
-            colorfreqdict[{block_row, block_col}][color_idx]++;
+    uint16_t used = 0;
+    costs.candidate_count = 0;
+    for (auto c = 0; c < 16; ++c) {
+        if (c == fixed)
+            continue;
+        auto dominated = false;
+        if (!(nearest & (1u << c))) {
+            for (auto d = 0; d < 16 && !dominated; ++d) {
+                bool equal;
+                if (d == c || totals[d] > totals[c] || !no_worse(costs, d, c, equal))
+                    continue;
+                dominated = !equal || d < c || d == fixed;
+            }
+        }
+        if (!dominated) {
+            costs.candidates[costs.candidate_count++] = static_cast<uint8_t>(c);
+            used |= 1u << c;
         }
     }
 
-    // Step 2: For each block, select 3 most common colors + background (black)
-    std::map<std::pair<int, int>, std::array<uint8_t, 4>> block_colors;
-    for (auto block_row = 0; block_row < height / block_height; block_row++) {
-        for (auto block_col = 0; block_col < width / block_width; block_col++) {
-            auto& freq = colorfreqdict[{block_row, block_col}];
+    for (auto c = 0; c < 16 && costs.candidate_count < needed; ++c) {
+        if (c == fixed || (used & (1u << c)))
+            continue;
+        costs.candidates[costs.candidate_count++] = static_cast<uint8_t>(c);
+    }
+    std::sort(costs.candidates, costs.candidates + costs.candidate_count);
+}
+
+// Sum of the element-wise minimum of two cost rows; a plain loop the compiler vectorizes
+static inline uint32_t sum_min(const uint32_t* a, const uint32_t* b, int count)
+{
+    uint32_t sum = 0;
+    for (auto u = 0; u < count; ++u)
+        sum += std::min(a[u], b[u]);
+    return sum;
+}
+
+// Least-error hires pair: all pairs of candidates (at most 120)
+static std::array<uint8_t, 4> select_hires_exhaustive_scalar(const CellCosts& costs)
+{
+    const int count = costs.padded_count();
+    const uint8_t* cand = costs.candidates;
+    uint32_t best = std::numeric_limits<uint32_t>::max();
+    std::array<uint8_t, 4> colors = { 0, 0, 0, 0 };
+    for (auto i = 0; i < costs.candidate_count; ++i) {
+        for (auto j = i + 1; j < costs.candidate_count; ++j) {
+            uint32_t sum = sum_min(costs.cost[cand[i]], costs.cost[cand[j]], count);
+            if (sum < best) {
+                best = sum;
+                colors = { cand[i], cand[j], 0, 0 };
+            }
+        }
+    }
+    return colors;
+}
 
-            // Find top 3 colors (excluding background)
-            std::array<uint8_t, 3> top_colors = { 0, 0, 0 };
-            for (int i = 1; i < 16; i++) { // Skip background (0)
-                if (freq[i] > freq[top_colors[0]]) {
-                    top_colors[2] = top_colors[1];
-                    top_colors[1] = top_colors[0];
-                    top_colors[0] = i;
+// Least-error multicolor triple alongside the shared background: all triples of the
+// cand_count candidates in cand (at most 455), none of them bg. The background is folded
+// into the pair minimum, so each triple is one more sum_min. error receives the cell's cost.
+static std::array<uint8_t, 4> select_multicolor_exhaustive_scalar(const CellCosts& costs,
+    const uint8_t* cand, int cand_count, int bg, uint32_t& error)
+{
+    const int count = costs.padded_count();
+    alignas(32) uint32_t pair_min[CellCosts::max_pixels];
+    uint32_t best = std::numeric_limits<uint32_t>::max();
+    std::array<uint8_t, 4> colors = { static_cast<uint8_t>(bg), 0, 0, 0 };
+    for (auto i = 0; i < cand_count; ++i) {
+        for (auto j = i + 1; j < cand_count; ++j) {
+            for (auto u = 0; u < count; ++u)
+                pair_min[u] = std::min({ costs.cost[bg][u], costs.cost[cand[i]][u], costs.cost[cand[j]][u] });
+            for (auto k = j + 1; k < cand_count; ++k) {
+                uint32_t sum = sum_min(pair_min, costs.cost[cand[k]], count);
+                if (sum < best) {
+                    best = sum;
+                    colors = { static_cast<uint8_t>(bg), cand[i], cand[j], cand[k] };
                 }
-                else if (freq[i] > freq[top_colors[1]]) {
-                    top_colors[2] = top_colors[1];
-                    top_colors[1] = i;
+            }
+        }
+    }
+    error = best;
+    return colors;
+}
+
+// Background search for one cell: the least-error triple for all 16 backgrounds at once.
+// A background among the candidates gets its answer from the 4-sets of candidates
+// containing it, so those are enumerated once (at most 1820) rather than per background.
+static void search_multicolor_cell_scalar(const CellCosts& costs, uint32_t* error, std::array<uint8_t, 4>* choices)
+{
+    const int count = costs.padded_count();
+    const int n = costs.candidate_count;
+    const uint8_t* cand = costs.candidates;
+    alignas(32) uint32_t pair_min[CellCosts::max_pixels];
+    alignas(32) uint32_t triple_min[CellCosts::max_pixels];
+    std::fill(error, error + 16, std::numeric_limits<uint32_t>::max());
+    for (auto i = 0; i < n; ++i) {
+        for (auto j = i + 1; j < n; ++j) {
+            for (auto u = 0; u < count; ++u)
+                pair_min[u] = std::min(costs.cost[cand[i]][u], costs.cost[cand[j]][u]);
+            for (auto k = j + 1; k < n; ++k) {
+                for (auto u = 0; u < count; ++u)
+                    triple_min[u] = std::min(pair_min[u], costs.cost[cand[k]][u]);
+                for (auto l = k + 1; l < n; ++l) {
+                    uint32_t sum = sum_min(triple_min, costs.cost[cand[l]], count);
+                    const uint8_t set[4] = { cand[i], cand[j], cand[k], cand[l] };
+                    for (auto m = 0; m < 4; ++m) {
+                        if (sum < error[set[m]]) {
+                            error[set[m]] = sum;
+                            choices[set[m]] = { set[m], set[m == 0], set[m <= 1 ? 2 : 1], set[m <= 2 ? 3 : 2] };
+                        }
+                    }
                 }
-                else if (freq[i] > freq[top_colors[2]]) {
-                    top_colors[2] = i;
+            }
+        }
+    }
+
+    // The other backgrounds branch and bound over triples: each starts from a candidate
+    // background's triple, and a pair is skipped once even the cheapest of the later
+    // candidates per pixel can't bring it below the best so far
+    alignas(32) uint32_t later_min[16][CellCosts::max_pixels];
+    std::copy_n(costs.cost[cand[n - 1]], count, later_min[n - 1]);
+    for (auto i = n - 2; i >= 0; --i) {
+        for (auto u = 0; u < count; ++u)
+            later_min[i][u] = std::min(later_min[i + 1][u], costs.cost[cand[i]][u]);
+    }
+    for (auto bg = 0; bg < 16; ++bg) {
+        if (error[bg] != std::numeric_limits<uint32_t>::max())
+            continue;
+        for (auto i = 0; i < n; ++i) {
+            auto& seed = choices[cand[i]];
+            for (auto u = 0; u < count; ++u)
+                triple_min[u] = std::min({ costs.cost[bg][u], costs.cost[seed[1]][u], costs.cost[seed[2]][u] });
+            uint32_t sum = sum_min(triple_min, costs.cost[seed[3]], count);
+            if (sum < error[bg]) {
+                error[bg] = sum;
+                choices[bg] = { static_cast<uint8_t>(bg), seed[1], seed[2], seed[3] };
+            }
+        }
+        for (auto i = 0; i < n; ++i) {
+            for (auto j = i + 1; j + 1 < n; ++j) {
+                for (auto u = 0; u < count; ++u)
+                    pair_min[u] = std::min({ costs.cost[bg][u], costs.cost[cand[i]][u], costs.cost[cand[j]][u] });
+                if (sum_min(pair_min, later_min[j + 1], count) >= error[bg])
+                    continue;
+                for (auto k = j + 1; k < n; ++k) {
+                    uint32_t sum = sum_min(pair_min, costs.cost[cand[k]], count);
+                    if (sum < error[bg]) {
+                        error[bg] = sum;
+                        choices[bg] = { static_cast<uint8_t>(bg), cand[i], cand[j], cand[k] };
+                    }
                 }
             }
+        }
+    }
+}
 
-            // Store colors: [background, mc1, mc2, mc3]
-            block_colors[{block_row, block_col}] = { 0, top_colors[0], top_colors[1], top_colors[2] };
+#ifdef SIMD_X86
+
+// Squared Euclidean distance in metric coordinates, so every metric but redmean
+TARGET_AVX2 static void fill_cost_rows_avx2(const CellColors& colors, int padded_count, const PaletteLut& lut,
+    CellCosts& costs)
+{
+    const int blocks = padded_count / CellCosts::lanes;
+    for (auto c = 0; c < 16; ++c) {
+        const __m256i pr = _mm256_set1_epi32(lut.coords[c][0]);
+        const __m256i pg = _mm256_set1_epi32(lut.coords[c][1]);
+        const __m256i pb = _mm256_set1_epi32(lut.coords[c][2]);
+        for (auto k = 0; k < blocks; ++k) {
+            __m256i dr = _mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(colors.r) + k), pr);
+            __m256i dg = _mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(colors.g) + k), pg);
+            __m256i db = _mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(colors.b) + k), pb);
+            __m256i dist = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)),
+                _mm256_mullo_epi32(db, db));
+            __m256i weight = _mm256_load_si256(reinterpret_cast<const __m256i*>(colors.weights) + k);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(costs.cost[c]) + k, _mm256_mullo_epi32(dist, weight));
         }
     }
+}
 
-    // Step 3: Remap pixels to their closest selected color
-    for (auto y = 0; y < height; y++) {
-        auto block_row = y / block_height;
+TARGET_AVX2 static inline uint32_t horizontal_sum_avx2(__m256i v)
+{
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(sum));
+}
 
-        for (auto x = 0; x < width; x++) {
-            auto block_col = x / block_width;
-            auto& colors = block_colors[{block_row, block_col}];
+// The scalar solvers with sum_min done eight lanes at a time; same scan order and ties
+TARGET_AVX2 static uint32_t sum_min_avx2(const uint32_t* a, const uint32_t* b, int blocks)
+{
+    __m256i acc = _mm256_setzero_si256();
+    for (auto k = 0; k < blocks; ++k) {
+        __m256i va = _mm256_load_si256(reinterpret_cast<const __m256i*>(a) + k);
+        __m256i vb = _mm256_load_si256(reinterpret_cast<const __m256i*>(b) + k);
+        acc = _mm256_add_epi32(acc, _mm256_min_epu32(va, vb));
+    }
+    return horizontal_sum_avx2(acc);
+}
 
-            auto idx = (y * width + x) * 3;
-            uint8_t original_idx = find_closest_color(&image[idx], palette);
+TARGET_AVX2 static std::array<uint8_t, 4> select_hires_exhaustive_avx2(const CellCosts& costs)
+{
+    const int blocks = costs.padded_count() / CellCosts::lanes;
+    const uint8_t* cand = costs.candidates;
+    uint32_t best = std::numeric_limits<uint32_t>::max();
+    std::array<uint8_t, 4> colors = { 0, 0, 0, 0 };
+    for (auto i = 0; i < costs.candidate_count; ++i) {
+        for (auto j = i + 1; j < costs.candidate_count; ++j) {
+            uint32_t sum = sum_min_avx2(costs.cost[cand[i]], costs.cost[cand[j]], blocks);
+            if (sum < best) {
+                best = sum;
+                colors = { cand[i], cand[j], 0, 0 };
+            }
+        }
+    }
+    return colors;
+}
 
-            // Find closest color from our selected 4
-            float min_dist = FLT_MAX;
-            uint8_t best_color = 0;
-            for (int i = 0; i < 4; i++) {
-                float dist = color_distance(&image[idx], colors[i]);
-                if (dist < min_dist) {
-                    min_dist = dist;
-                    best_color = colors[i];
+TARGET_AVX2 static std::array<uint8_t, 4> select_multicolor_exhaustive_avx2(const CellCosts& costs,
+    const uint8_t* cand, int cand_count, int bg, uint32_t& error)
+{
+    const int blocks = costs.padded_count() / CellCosts::lanes;
+    alignas(32) uint32_t pair_min[CellCosts::max_pixels];
+    uint32_t best = std::numeric_limits<uint32_t>::max();
+    std::array<uint8_t, 4> colors = { static_cast<uint8_t>(bg), 0, 0, 0 };
+    for (auto i = 0; i < cand_count; ++i) {
+        for (auto j = i + 1; j < cand_count; ++j) {
+            for (auto k = 0; k < blocks; ++k) {
+                __m256i vbg = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[bg]) + k);
+                __m256i va = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[cand[i]]) + k);
+                __m256i vb = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[cand[j]]) + k);
+                _mm256_store_si256(reinterpret_cast<__m256i*>(pair_min) + k, _mm256_min_epu32(vbg, _mm256_min_epu32(va, vb)));
+            }
+            for (auto k = j + 1; k < cand_count; ++k) {
+                uint32_t sum = sum_min_avx2(pair_min, costs.cost[cand[k]], blocks);
+                if (sum < best) {
+                    best = sum;
+                    colors = { static_cast<uint8_t>(bg), cand[i], cand[j], cand[k] };
                 }
             }
+        }
+    }
+    error = best;
+    return colors;
+}
+
+TARGET_AVX2 static void search_multicolor_cell_avx2(const CellCosts& costs, uint32_t* error, std::array<uint8_t, 4>* choices)
+{
+    const int blocks = costs.padded_count() / CellCosts::lanes;
+    const int n = costs.candidate_count;
+    const uint8_t* cand = costs.candidates;
+    alignas(32) uint32_t pair_min[CellCosts::max_pixels];
+    alignas(32) uint32_t triple_min[CellCosts::max_pixels];
+    std::fill(error, error + 16, std::numeric_limits<uint32_t>::max());
+    for (auto i = 0; i < n; ++i) {
+        for (auto j = i + 1; j < n; ++j) {
+            for (auto b = 0; b < blocks; ++b)
+                _mm256_store_si256(reinterpret_cast<__m256i*>(pair_min) + b, _mm256_min_epu32(
+                    _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[cand[i]]) + b),
+                    _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[cand[j]]) + b)));
+            for (auto k = j + 1; k < n; ++k) {
+                for (auto b = 0; b < blocks; ++b) {
+                    __m256i pair = _mm256_load_si256(reinterpret_cast<const __m256i*>(pair_min) + b);
+                    _mm256_store_si256(reinterpret_cast<__m256i*>(triple_min) + b, _mm256_min_epu32(pair,
+                        _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[cand[k]]) + b)));
+                }
+                for (auto l = k + 1; l < n; ++l) {
+                    uint32_t sum = sum_min_avx2(triple_min, costs.cost[cand[l]], blocks);
+                    const uint8_t set[4] = { cand[i], cand[j], cand[k], cand[l] };
+                    for (auto m = 0; m < 4; ++m) {
+                        if (sum < error[set[m]]) {
+                            error[set[m]] = sum;
+                            choices[set[m]] = { set[m], set[m == 0], set[m <= 1 ? 2 : 1], set[m <= 2 ? 3 : 2] };
+                        }
+                    }
+                }
+            }
+        }
+    }
 
-            // Set pixel to closest color
-            for (int i = 0; i < 3; i++) {
-                image[idx + i] = palette[best_color][i];
+    alignas(32) uint32_t later_min[16][CellCosts::max_pixels];
+    std::copy_n(costs.cost[cand[n - 1]], blocks * CellCosts::lanes, later_min[n - 1]);
+    for (auto i = n - 2; i >= 0; --i) {
+        for (auto b = 0; b < blocks; ++b) {
+            __m256i later = _mm256_load_si256(reinterpret_cast<const __m256i*>(later_min[i + 1]) + b);
+            __m256i own = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[cand[i]]) + b);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(later_min[i]) + b, _mm256_min_epu32(later, own));
+        }
+    }
+    for (auto bg = 0; bg < 16; ++bg) {
+        if (error[bg] != std::numeric_limits<uint32_t>::max())
+            continue;
+        for (auto i = 0; i < n; ++i) {
+            auto& seed = choices[cand[i]];
+            for (auto b = 0; b < blocks; ++b) {
+                __m256i vbg = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[bg]) + b);
+                __m256i v1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[seed[1]]) + b);
+                __m256i v2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[seed[2]]) + b);
+                _mm256_store_si256(reinterpret_cast<__m256i*>(triple_min) + b, _mm256_min_epu32(vbg, _mm256_min_epu32(v1, v2)));
+            }
+            uint32_t sum = sum_min_avx2(triple_min, costs.cost[seed[3]], blocks);
+            if (sum < error[bg]) {
+                error[bg] = sum;
+                choices[bg] = { static_cast<uint8_t>(bg), seed[1], seed[2], seed[3] };
+            }
+        }
+        for (auto i = 0; i < n; ++i) {
+            for (auto j = i + 1; j + 1 < n; ++j) {
+                for (auto b = 0; b < blocks; ++b) {
+                    __m256i vbg = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[bg]) + b);
+                    __m256i va = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[cand[i]]) + b);
+                    __m256i vb = _mm256_load_si256(reinterpret_cast<const __m256i*>(costs.cost[cand[j]]) + b);
+                    _mm256_store_si256(reinterpret_cast<__m256i*>(pair_min) + b, _mm256_min_epu32(vbg, _mm256_min_epu32(va, vb)));
+                }
+                if (sum_min_avx2(pair_min, later_min[j + 1], blocks) >= error[bg])
+                    continue;
+                for (auto k = j + 1; k < n; ++k) {
+                    uint32_t sum = sum_min_avx2(pair_min, costs.cost[cand[k]], blocks);
+                    if (sum < error[bg]) {
+                        error[bg] = sum;
+                        choices[bg] = { static_cast<uint8_t>(bg), cand[i], cand[j], cand[k] };
+                    }
+                }
             }
         }
     }
 }
 
-void reduce_colors_per_block(uint8_t* image, int width, int height, int channels,
-    const std::vector<std::array<uint8_t, 3>>& palette)
+#endif
+
+// CellColorCache key of one cell: what decides its colors (mode, background, metric, input
+// kind, clipped cell size), then its pixels row by row
+static void make_cell_key(const ReducerPixels& pixels, const CellGrid& grid, int cell_row, int cell_col,
+    int mode, int bg, ColorMetric metric, std::string& key)
+{
+    const int first_x = cell_col * grid.block_width;
+    const int first_y = cell_row * grid.block_height;
+    const int cell_width = std::min(pixels.width - first_x, grid.block_width);
+    const int cell_height = std::min(pixels.height - first_y, grid.block_height);
+    const int bytes_per_pixel = pixels.rgb ? 3 : 1;
+    const uint8_t* source = pixels.rgb ? pixels.rgb : pixels.indices;
+
+    key.clear();
+    key += static_cast<char>(mode);
+    key += static_cast<char>(bg);
+    key += static_cast<char>(metric);
+    key += static_cast<char>(bytes_per_pixel);
+    key += static_cast<char>(cell_width);
+    key += static_cast<char>(cell_height);
+    for (auto y = first_y; y < first_y + cell_height; ++y) {
+        auto* row = reinterpret_cast<const char*>(&source[(static_cast<size_t>(y) * pixels.width + first_x) * bytes_per_pixel]);
+        key.append(row, static_cast<size_t>(cell_width) * bytes_per_pixel);
+    }
+}
+
+// Costs and candidates for one cell; fixed and needed as for find_candidates
+static void fill_cell_costs(const ReducerPixels& pixels, const CellGrid& grid,
+    int cell_row, int cell_col, const PaletteLut& lut, int fixed, int needed, CellCosts& costs)
+{
+    CellColors colors;
+    if (pixels.rgb)
+        collect_cell_colors(pixels.rgb, pixels.width, pixels.height, grid, cell_row, cell_col, lut.metric, colors);
+    else
+        collect_cell_colors(pixels.indices, pixels.width, pixels.height, grid, cell_row, cell_col, lut, colors);
+    costs.count = colors.count;
+#ifdef SIMD_X86
+    if (cpu_simd_level() == SimdLevel::AVX2 && lut.metric != ColorMetric::Redmean)
+        fill_cost_rows_avx2(colors, costs.padded_count(), lut, costs);
+    else
+#endif
+        fill_cost_rows_scalar(colors, costs.padded_count(), lut, costs);
+    find_candidates(costs, fixed, needed);
+}
+
+static std::array<uint8_t, 4> select_hires_exhaustive(const CellCosts& costs)
+{
+#ifdef SIMD_X86
+    if (cpu_simd_level() == SimdLevel::AVX2)
+        return select_hires_exhaustive_avx2(costs);
+#endif
+    return select_hires_exhaustive_scalar(costs);
+}
+
+static std::array<uint8_t, 4> select_multicolor_exhaustive(const CellCosts& costs,
+    const uint8_t* cand, int cand_count, int bg, uint32_t& error)
+{
+#ifdef SIMD_X86
+    if (cpu_simd_level() == SimdLevel::AVX2)
+        return select_multicolor_exhaustive_avx2(costs, cand, cand_count, bg, error);
+#endif
+    return select_multicolor_exhaustive_scalar(costs, cand, cand_count, bg, error);
+}
+
+static void search_multicolor_cell(const CellCosts& costs, uint32_t* error, std::array<uint8_t, 4>* choices)
+{
+#ifdef SIMD_X86
+    if (cpu_simd_level() == SimdLevel::AVX2)
+        return search_multicolor_cell_avx2(costs, error, choices);
+#endif
+    search_multicolor_cell_scalar(costs, error, choices);
+}
+
+// Squared error of a cell reduced to colors, from its cost table
+static uint32_t cell_error(const CellCosts& costs, const std::array<uint8_t, 4>& colors)
+{
+    uint32_t sum = 0;
+    for (auto u = 0; u < costs.count; ++u)
+        sum += std::min({ costs.cost[colors[0]][u], costs.cost[colors[1]][u], costs.cost[colors[2]][u], costs.cost[colors[3]][u] });
+    return sum;
+}
+
+// Top 3 colors of a multicolor cell by frequency, excluding the background: [bg, mc1, mc2, mc3].
+// Slots stay at the background when fewer than 3 other colors occur more often than it.
+static std::array<uint8_t, 4> select_multicolor_by_frequency(const std::array<int, 16>& freq, int bg)
+{
+    std::array<uint8_t, 3> top_colors = { static_cast<uint8_t>(bg), static_cast<uint8_t>(bg), static_cast<uint8_t>(bg) };
+    for (int i = 0; i < 16; i++) {
+        if (i == bg)
+            continue;
+        if (freq[i] > freq[top_colors[0]]) {
+            top_colors[2] = top_colors[1];
+            top_colors[1] = top_colors[0];
+            top_colors[0] = i;
+        }
+        else if (freq[i] > freq[top_colors[1]]) {
+            top_colors[2] = top_colors[1];
+            top_colors[1] = i;
+        }
+        else if (freq[i] > freq[top_colors[2]]) {
+            top_colors[2] = i;
+        }
+    }
+    return { static_cast<uint8_t>(bg), top_colors[0], top_colors[1], top_colors[2] };
+}
+
+// Deadline for BlockReduceOptions::time_budget_ms; never expires without a budget
+struct SolverDeadline {
+    bool limited;
+    std::chrono::steady_clock::time_point end;
+
+    explicit SolverDeadline(int budget_ms) :
+        limited(budget_ms > 0),
+        end(std::chrono::steady_clock::now() + std::chrono::milliseconds(budget_ms))
+    {
+    }
+
+    bool expired() const { return limited && std::chrono::steady_clock::now() >= end; }
+};
+
+// Step 1 of both reducers: build a palette histogram for every cell in one cell row.
+// Cell rows touch disjoint pixels and histograms, so they can run on separate threads.
+// Indexed pixels are counted as they are; RGB ones are matched to the palette first.
+static void count_cell_row_colors(const ReducerPixels& pixels, const CellGrid& grid,
+    int cell_row, std::array<int, 16>* freq_row, uint8_t* indices, const PaletteLut& lut)
+{
+    std::fill_n(freq_row, grid.cols, std::array<int, 16>{});
+
+    const int width = pixels.width;
+    auto last_y = std::min(pixels.height, (cell_row + 1) * grid.block_height);
+    for (auto y = cell_row * grid.block_height; y < last_y; y++) {
+        const uint8_t* row_indices = &pixels.indices[y * width];
+        if (pixels.rgb) {
+            find_closest_colors(&pixels.rgb[y * width * 3], width, &indices[y * width], lut.palette, lut.metric);
+            row_indices = &indices[y * width];
+        }
+
+        for (auto x = 0; x < width; x++)
+            freq_row[x / grid.block_width][row_indices[x]]++;
+    }
+}
+
+// Step 3 of both reducers: give every pixel of one cell row the nearest of its cell's
+// chosen colors (the first count entries of each colors_row entry; ties go to the later
+// one for hires and the earlier for multicolor, as the reducers always have). Indexed
+// pixels look the answer up in a per-cell table instead of measuring each pixel.
+// Pixels are measured in metric coordinates.
+static void remap_cell_row(const ReducerPixels& pixels, uint8_t* indices, const CellGrid& grid, int cell_row,
+    const std::array<uint8_t, 4>* colors_row, int count, const PaletteLut& lut, const uint8_t* keep_row)
+{
+    const auto& palette = lut.palette;
+    const ColorMetric metric = lut.metric;
+    auto nearest = [&](const int32_t* pixel, const std::array<uint8_t, 4>& colors) {
+        if (count == 2) {
+            uint32_t d0 = metric_distance(pixel, lut.coords[colors[0]].data(), metric);
+            uint32_t d1 = metric_distance(pixel, lut.coords[colors[1]].data(), metric);
+            return colors[(d0 < d1) ? 0 : 1];
+        }
+        uint32_t min_dist = std::numeric_limits<uint32_t>::max();
+        uint8_t best_color = 0;
+        for (int i = 0; i < count; i++) {
+            uint32_t dist = metric_distance(pixel, lut.coords[colors[i]].data(), metric);
+            if (dist < min_dist) {
+                min_dist = dist;
+                best_color = colors[i];
+            }
+        }
+        return best_color;
+    };
+
+    const int width = pixels.width;
+    const int first_y = cell_row * grid.block_height;
+    const int last_y = std::min(pixels.height, first_y + grid.block_height);
+    if (!pixels.rgb) {
+        for (auto col = 0; col < grid.cols; ++col) {
+            if (keep_row && keep_row[col])
+                continue;
+            uint8_t table[16];
+            for (auto c = 0; c < 16; ++c)
+                table[c] = nearest(lut.coords[c].data(), colors_row[col]);
+            auto last_x = std::min(width, (col + 1) * grid.block_width);
+            for (auto y = first_y; y < last_y; y++) {
+                for (auto x = col * grid.block_width; x < last_x; x++)
+                    indices[y * width + x] = table[pixels.indices[y * width + x]];
+            }
+        }
+        return;
+    }
+
+    for (auto y = first_y; y < last_y; y++) {
+        for (auto col = 0; col < grid.cols; ++col) {
+            if (keep_row && keep_row[col])
+                continue;
+            auto last_x = std::min(width, (col + 1) * grid.block_width);
+            for (auto x = col * grid.block_width; x < last_x; x++) {
+                auto idx = (y * width + x) * 3;
+                const uint8_t* pixel = &pixels.rgb[idx];
+                auto coords = metric == ColorMetric::RGB
+                    ? std::array<int32_t, 3>{ pixel[0], pixel[1], pixel[2] } : metric_coords(pixel, metric);
+                uint8_t best_color = nearest(coords.data(), colors_row[col]);
+                if (indices) {
+                    indices[y * width + x] = best_color;
+                }
+                else {
+                    for (int i = 0; i < 3; i++)
+                        pixels.rgb[idx + i] = palette[best_color][i];
+                }
+            }
+        }
+    }
+}
+
+// Background search: reduce every cell against each of the 16 candidate backgrounds from
+// one cost table (and histogram) per cell, keeping every choice. Cell rows run in
+// parallel and total their own errors, which are summed in row order afterwards, so the
+// pick doesn't depend on the thread count. The least total wins; ties go to the lower index.
+static void search_background(const ReducerPixels& pixels, const CellGrid& grid,
+    const PaletteLut& lut, const BlockReduceOptions& options,
+    const SolverDeadline& deadline, BlockReducerScratch& scratch, BlockReduceResult& result)
+{
+    scratch.background_choices.resize(grid.size());
+    scratch.background_row_cost.resize(grid.rows);
+
+    parallel_for(grid.rows, options.threads, [&](int cell_row) {
+        TraceSpan span(options.trace, "background search row", "cell_row", cell_row);
+        auto* freq_row = &scratch.cell_freq[cell_row * grid.cols];
+        auto& row_cost = scratch.background_row_cost[cell_row];
+        row_cost.fill(0);
+
+        const bool exhaustive = options.solver == BlockSolver::Exhaustive && !deadline.expired();
+        if (!exhaustive)
+            count_cell_row_colors(pixels, grid, cell_row, freq_row, scratch.indices.data(), lut);
+
+        CellCosts costs;
+        for (auto block_col = 0; block_col < grid.cols; block_col++) {
+            auto& choices = scratch.background_choices[cell_row * grid.cols + block_col];
+
+            // Candidates without a fixed background cover every background; four of them
+            // leave at least three once the background itself is taken out
+            fill_cell_costs(pixels, grid, cell_row, block_col, lut, -1, 4, costs);
+            uint32_t error[16];
+            if (exhaustive) {
+                search_multicolor_cell(costs, error, choices.data());
+            }
+            else {
+                for (auto bg = 0; bg < 16; ++bg) {
+                    choices[bg] = select_multicolor_by_frequency(freq_row[block_col], bg);
+                    error[bg] = cell_error(costs, choices[bg]);
+                }
+            }
+            for (auto bg = 0; bg < 16; ++bg)
+                row_cost[bg] += error[bg];
+        }
+    });
+
+    result.background_cost.fill(0);
+    for (auto& row_cost : scratch.background_row_cost) {
+        for (auto bg = 0; bg < 16; ++bg)
+            result.background_cost[bg] += row_cost[bg];
+    }
+    result.bg_color = static_cast<int>(std::min_element(result.background_cost.begin(), result.background_cost.end())
+        - result.background_cost.begin());
+    result.searched = true;
+}
+
+BlockReduceResult reduce_colors_per_multicolor_block(const ReducerPixels& pixels, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, const BlockReduceOptions& options, BlockReducerScratch& scratch)
 {
     const int palette_size = static_cast<int>(palette.size());
     assert(palette_size == 16);
-    std::map<std::pair<int, int>, std::array<int, 16>> colorfreqdict;
-    // step 1 get the frequency of each 8x8 bloack
-    for (auto y = 0; y < height; y++) {
-        auto row = y / 8;
+    const CellGrid grid(pixels.width, pixels.height, 4, 8);  // Multicolor blocks are 4x8 pixels
+    prepare_scratch(scratch, pixels.width, pixels.height, grid);
+    const SolverDeadline deadline(options.time_budget_ms);
+    // Cached colors are only valid for the palette they were solved against
+    CellColorCache* cache = &palette == &c64_palette ? options.cell_cache : nullptr;
+    const PaletteLut& lut = get_palette_lut(palette, options.metric);
 
-        for (auto x = 0; x < width; ++x) {
-            auto ch = x / 8;
+    BlockReduceResult result;
+    result.bg_color = options.bg_color;
+    if (options.search_background)
+        search_background(pixels, grid, lut, options, deadline, scratch, result);
+    const int bg = result.bg_color;
 
-            if (colorfreqdict.find({ row, ch }) == colorfreqdict.end()) {
-                colorfreqdict[{row, ch}] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    parallel_for(grid.rows, options.threads, [&](int cell_row) {
+        TraceSpan span(options.trace, "reduce row", "cell_row", cell_row);
+        auto* freq_row = &scratch.cell_freq[cell_row * grid.cols];
+        auto* colors_row = &scratch.cell_colors[cell_row * grid.cols];
+        const uint8_t* keep_row = options.keep_cells ? &options.keep_cells[cell_row * grid.cols] : nullptr;
+
+        if (options.search_background) {
+            // Steps 1 and 2 already ran for every background
+            for (auto block_col = 0; block_col < grid.cols; block_col++) {
+                if (!keep_row || !keep_row[block_col])
+                    colors_row[block_col] = scratch.background_choices[cell_row * grid.cols + block_col][bg];
             }
-            auto& freq = colorfreqdict[{row, ch}];
+        }
+        else {
+            // Step 1: Get frequency of colors in each 4x8 block (the exhaustive solver works from costs instead)
+            const bool exhaustive = options.solver == BlockSolver::Exhaustive && !deadline.expired();
+            if (!exhaustive)
+                count_cell_row_colors(pixels, grid, cell_row, freq_row, scratch.indices.data(), lut);
 
-            auto idx = (y * width + x) * 3;
-            uint8_t color_idx = find_closest_color(&image[idx], c64_palette);
-            freq[color_idx]++;
+            // Step 2: For each block, select 3 colors + the background, either the least-error
+            // triple or the 3 most common
+            CellCosts costs;
+            std::string key;
+            for (auto block_col = 0; block_col < grid.cols; block_col++) {
+                if (keep_row && keep_row[block_col])
+                    continue;
+                if (exhaustive) {
+                    if (cache) {
+                        make_cell_key(pixels, grid, cell_row, block_col, 'm', bg, lut.metric, key);
+                        if (cache->find(key, colors_row[block_col]))
+                            continue;
+                    }
+                    uint32_t error;
+                    fill_cell_costs(pixels, grid, cell_row, block_col, lut, bg, 3, costs);
+                    colors_row[block_col] = select_multicolor_exhaustive(costs, costs.candidates, costs.candidate_count, bg, error);
+                    if (cache)
+                        cache->insert(key, colors_row[block_col]);
+                }
+                else {
+                    colors_row[block_col] = select_multicolor_by_frequency(freq_row[block_col], bg);
+                }
+            }
         }
-    }
 
-    std::map<std::pair<int, int>, std::array<int, 2>> colordict;
-    for (auto row = 0; row < 25; ++row) {
-        for (auto ch = 0; ch < 40; ++ch) {
-            auto& freq = colorfreqdict[{row, ch}];
+        // Step 3: Remap pixels to their closest selected color
+        remap_cell_row(pixels, indices, grid, cell_row, colors_row, 4, lut, keep_row);
+    });
+    return result;
+}
+
+void reduce_colors_per_block(const ReducerPixels& pixels, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, const BlockReduceOptions& options, BlockReducerScratch& scratch)
+{
+    const int palette_size = static_cast<int>(palette.size());
+    assert(palette_size == 16);
+    const CellGrid grid(pixels.width, pixels.height, 8, 8);
+    prepare_scratch(scratch, pixels.width, pixels.height, grid);
+    const SolverDeadline deadline(options.time_budget_ms);
+    CellColorCache* cache = &palette == &c64_palette ? options.cell_cache : nullptr;
+    const PaletteLut& lut = get_palette_lut(palette, options.metric);
+
+    parallel_for(grid.rows, options.threads, [&](int cell_row) {
+        TraceSpan span(options.trace, "reduce row", "cell_row", cell_row);
+        auto* freq_row = &scratch.cell_freq[cell_row * grid.cols];
+        auto* colors_row = &scratch.cell_colors[cell_row * grid.cols];
+        const uint8_t* keep_row = options.keep_cells ? &options.keep_cells[cell_row * grid.cols] : nullptr;
+
+        // step 1 get the frequency of each 8x8 bloack (the exhaustive solver works from costs instead)
+        const bool exhaustive = options.solver == BlockSolver::Exhaustive && !deadline.expired();
+        if (!exhaustive)
+            count_cell_row_colors(pixels, grid, cell_row, freq_row, scratch.indices.data(), lut);
+
+        // step 2 pick the least-error pair, or the two most frequent colors
+        CellCosts costs;
+        std::string key;
+        for (auto ch = 0; ch < grid.cols; ++ch) {
+            if (keep_row && keep_row[ch])
+                continue;
+            if (exhaustive) {
+                if (cache) {
+                    make_cell_key(pixels, grid, cell_row, ch, 'h', 0, lut.metric, key);
+                    if (cache->find(key, colors_row[ch]))
+                        continue;
+                }
+                fill_cell_costs(pixels, grid, cell_row, ch, lut, -1, 2, costs);
+                colors_row[ch] = select_hires_exhaustive(costs);
+                if (cache)
+                    cache->insert(key, colors_row[ch]);
+                continue;
+            }
+
+            auto& freq = freq_row[ch];
             auto hi = 0;
             auto next = 0;
 
@@ -149,27 +1014,10 @@ void reduce_colors_per_block(uint8_t* image, int width, int height, int channels
                 }
             }
 
-            colordict[{row, ch}][0] = hi;
-            colordict[{row, ch}][1] = next;
+            colors_row[ch] = { static_cast<uint8_t>(hi), static_cast<uint8_t>(next), 0, 0 };
         }
-    }
-
-    // Remap pixels
-    for (auto y = 0; y < height; y++) {
-        auto row = y / 8;
 
-        for (auto x = 0; x < width; ++x) {
-            auto ch = x / 8;
-
-            auto& color = colordict[{row, ch}];
-            auto idx = (y * width + x) * 3;
-
-            float d0 = color_distance(&image[idx], color[0]);
-            float d1 = color_distance(&image[idx], color[1]);
-
-            auto n = (d0 < d1) ? 0 : 1;
-            for (auto i = 0; i < 3; ++i)
-                image[idx + i] = c64_palette[color[n]][i];
-        }
-    }
-}
\ No newline at end of file
+        // Remap pixels
+        remap_cell_row(pixels, indices, grid, cell_row, colors_row, 2, lut, keep_row);
+    });
+}
@@ -1,9 +1,107 @@
 #pragma once
 #include <stdint.h>
 #include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include "pallet.h"
 
-extern void convert_to_c64_hires(uint8_t* image, int width, int height, int bg_color = C64_BLACK);
-extern void convert_to_c64_multicolor(uint8_t* image, int width, int height, int bg_color = C64_BLACK);
+// Working memory for the block reducers. Pass the same one to repeated calls and the
+// buffers are only reallocated when an image needs more cells or pixels than before.
+struct BlockReducerScratch {
+    std::vector<std::array<int, 16>> cell_freq;        // palette histogram per cell
+    std::vector<std::array<uint8_t, 4>> cell_colors;   // chosen colors per cell (hires uses two)
+    std::vector<uint8_t> indices;                      // nearest palette index per pixel
+    std::vector<std::array<std::array<uint8_t, 4>, 16>> background_choices;    // background search: colors per cell per background
+    std::vector<std::array<uint64_t, 16>> background_row_cost;                // background search: error per cell row per background
+};
 
+// Exhaustive cell solves memoized by cell content: the cell's pixels (RGB or palette
+// indices), its size, the mode and the background. Tiles that repeat within an image or
+// across images (borders, UI chrome, flat fills) are then solved once. Keys hold the whole
+// cell, so a hit gives exactly the colors a solve would. Thread-safe: one cache can serve
+// every thread and image. Holds up to max_entries cells and starts over when full.
+class CellColorCache {
+public:
+    explicit CellColorCache(size_t max_entries = 1 << 16) : max_shard_entries(max_entries / shard_count + 1) {}
+
+    bool find(std::string_view key, std::array<uint8_t, 4>& colors);
+    void insert(std::string_view key, const std::array<uint8_t, 4>& colors);
+
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+
+private:
+    static constexpr size_t shard_count = 16;
+
+    // Transparent, so lookups by string_view need no std::string
+    struct KeyHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::array<uint8_t, 4>, KeyHash, std::equal_to<>> cells;
+    };
+
+    Shard& shard(std::string_view key) { return shards[KeyHash{}(key) % shard_count]; }
+
+    size_t max_shard_entries;
+    std::array<Shard, shard_count> shards;
+    std::atomic<uint64_t> hit_count{ 0 };
+    std::atomic<uint64_t> miss_count{ 0 };
+};
+
+// How each cell's colors are chosen
+enum class BlockSolver {
+    Frequency,      // most frequent nearest-palette colors in the cell
+    Exhaustive      // every hires pair / multicolor triple; least total error under the metric
+};
+
+class TraceRecorder;
+
+struct BlockReduceOptions {
+    int bg_color = C64_BLACK;
+    int threads = 1;                // cell rows run on up to this many threads (0 = all cores)
+    BlockSolver solver = BlockSolver::Exhaustive;
+    int time_budget_ms = 0;         // Exhaustive only: once spent, remaining cell rows fall back
+                                    // to Frequency (0 = no limit; output then depends on timing)
+    bool search_background = false; // Multicolor only: try all 16 backgrounds and keep the least
+                                    // total error; bg_color is then ignored
+    ColorMetric metric = ColorMetric::RGB;  // how pixel to palette color error is measured
+    CellColorCache* cell_cache = nullptr;   // Exhaustive only: reuse solves of cells seen before
+    const uint8_t* keep_cells = nullptr;    // One flag per cell, row-major: nonzero keeps the colors
+                                            // and pixel indices from the previous call with the same
+                                            // scratch and output (frame sequences)
+    TraceRecorder* trace = nullptr;         // records each cell row as a trace event on its thread
+};
+
+struct BlockReduceResult {
+    int bg_color = C64_BLACK;                   // background the image was reduced against
+    bool searched = false;                      // background_cost is filled in
+    std::array<uint64_t, 16> background_cost{}; // total squared error per candidate background
+};
+
+// threads: cell rows are reduced on up to this many threads (0 = all cores); output does not depend on it
+// scratch: optional reusable working memory; a temporary one is used when null
+extern void convert_to_c64_hires(uint8_t* image, int width, int height, int bg_color = C64_BLACK, int threads = 1,
+    BlockReducerScratch* scratch = nullptr);
+extern void convert_to_c64_multicolor(uint8_t* image, int width, int height, int bg_color = C64_BLACK, int threads = 1,
+    BlockReducerScratch* scratch = nullptr);
+
+// indices: optional output; when given it receives every pixel's palette index and image is left as it was
+extern void convert_to_c64_hires(uint8_t* image, int width, int height, const BlockReduceOptions& options,
+    BlockReducerScratch* scratch = nullptr, uint8_t* indices = nullptr);
+extern BlockReduceResult convert_to_c64_multicolor(uint8_t* image, int width, int height, const BlockReduceOptions& options,
+    BlockReducerScratch* scratch = nullptr, uint8_t* indices = nullptr);
+
+// Reduce an image that is already on the C64 palette (such as dithered output), given as one
+// palette index per pixel and rewritten in place. Same choices as the RGB forms on the same pixels.
+extern void reduce_indexed_hires(uint8_t* indices, int width, int height, const BlockReduceOptions& options,
+    BlockReducerScratch* scratch = nullptr);
+extern BlockReduceResult reduce_indexed_multicolor(uint8_t* indices, int width, int height, const BlockReduceOptions& options,
+    BlockReducerScratch* scratch = nullptr);
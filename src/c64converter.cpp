@@ -0,0 +1,591 @@
+#include <iostream>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <optional>
+
+#include "c64converter.h"
+#include "conversioncache.h"
+#include "conversioncontext.h"
+#include "asmgenerator.h"
+#include "prglinker.h"
+#include "imagereader.h"
+
+// STB headers
+#include "stb_image_write.h"
+
+const int RGBChannels = 3;
+
+typedef std::array<uint8_t, 3>Color;
+
+Color getpixel(const uint8_t* input_buffer, int width, int height, int x, int y)
+{
+    auto idx = (y * width + x) * 3;
+    Color color{ input_buffer[idx], input_buffer[idx + 1], input_buffer[idx + 2] };
+    return color;
+}
+
+void setpixel(uint8_t* output_buffer, int width, int height, int x, int y, Color color)
+{
+    int idx = (y * width + x) * 3;
+    output_buffer[idx + 0] = color[0];
+    output_buffer[idx + 1] = color[1];
+    output_buffer[idx + 2] = color[2];
+}
+
+
+void copy_multi_color_bitmap(
+    const uint8_t* input_buffer, int input_width, int input_height,
+    uint8_t* output_buffer, int output_width, int output_height)
+{
+
+    for (int y = 0; y < input_height; ++y) {
+        for (int x = 0; x < input_width; ++x) {
+            Color color = getpixel(input_buffer, input_width, input_height, x, y); // lookup from bitmap/ram
+
+            setpixel(output_buffer, output_width, output_height, 2 * x + 0, y, color); // double-width
+            setpixel(output_buffer, output_width, output_height, 2 * x + 1, y, color);
+        }
+
+        // An odd output width repeats the last fat pixel once more
+        if (output_width > 2 * input_width && input_width > 0) {
+            setpixel(output_buffer, output_width, output_height, 2 * input_width, y,
+                getpixel(input_buffer, input_width, input_height, input_width - 1, y));
+        }
+    }
+}
+
+// Function to generate ASM filename based on output path
+std::string get_filename(const std::string& output_path, const std::string& ext)
+{
+    size_t last_dot = output_path.find_last_of(".");
+    if (last_dot == std::string::npos) {
+        return output_path + ext;
+    }
+    return output_path.substr(0, last_dot) + ext;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::vector<uint8_t> read_file(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Error loading image: " + path + "\nReason: cannot open file");
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// RGB for width x height native palette indices into output, output_width wide (multicolor
+// fat pixels are widened as copy_multi_color_bitmap does)
+static void indices_to_rgb(std::span<const uint8_t> indices, int width, int height, std::span<uint8_t> output,
+    int output_width)
+{
+    std::vector<uint8_t> native;
+    uint8_t* rgb = output.data();
+    if (output_width != width) {
+        native.resize(indices.size() * 3);
+        rgb = native.data();
+    }
+    for (size_t i = 0; i < indices.size(); ++i) {
+        auto& color = c64_palette[indices[i]];
+        rgb[i * 3] = color[0];
+        rgb[i * 3 + 1] = color[1];
+        rgb[i * 3 + 2] = color[2];
+    }
+    if (output_width != width)
+        copy_multi_color_bitmap(native.data(), width, height, output.data(), output_width, height);
+}
+
+// Whole decimal integer in [min, max]; false for anything else, including nothing at all
+static bool parse_int(const char* text, long min, long max, int& value)
+{
+    char* end = nullptr;
+    errno = 0;
+    long parsed = std::strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || errno == ERANGE || parsed < min || parsed > max)
+        return false;
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+bool parse_convert_options(int argc, char** argv, int first, ConvertOptions& options, std::ostream& errors)
+{
+    auto skipArg = false;
+    for (auto arg = first; arg < argc; ++arg) {
+        if (skipArg) {
+            skipArg = false;
+            continue;
+        }
+
+        std::string arg_str = argv[arg];
+        if (arg_str == "--dither") {
+            options.use_dithering = true;
+            options.dither_kernel = DitherKernel::FloydSteinberg;
+        }
+        else if (arg_str.rfind("--dither=", 0) == 0) {
+            std::string kernel = arg_str.substr(9);
+            options.use_dithering = true;
+            if (kernel == "floyd") {
+                options.dither_kernel = DitherKernel::FloydSteinberg;
+            }
+            else if (kernel == "atkinson") {
+                options.dither_kernel = DitherKernel::Atkinson;
+            }
+            else if (kernel == "sierra-lite") {
+                options.dither_kernel = DitherKernel::SierraLite;
+            }
+            else if (kernel == "bayer4") {
+                options.dither_kernel = DitherKernel::Bayer4;
+            }
+            else if (kernel == "bayer8") {
+                options.dither_kernel = DitherKernel::Bayer8;
+            }
+            else if (kernel == "bluenoise") {
+                options.dither_kernel = DitherKernel::BlueNoise;
+            }
+            else {
+                errors << "Unknown dither kernel: " << kernel << std::endl;
+                return false;
+            }
+        }
+        else if (arg_str == "--hires") {
+            options.use_hires = true;
+        }
+        else if (arg_str == "--multicolor") {
+            options.use_multicolor = true;
+        }
+        else if (arg_str == "--preview") {
+            options.preview = true;
+        }
+        else if (arg_str == "--asm") {
+            options.generate_asm = true;
+        }
+        else if (arg_str == "--koala") {
+            options.generate_koala = true;
+        }
+        else if (arg_str == "--prg") {
+            options.generate_prg = true;
+        }
+        else if (arg_str == "--pack") {
+            options.pack = true;
+        }
+        else if (arg_str == "--cache") {
+            if (arg + 1 < argc) {
+                options.cache_dir = argv[arg + 1];
+                skipArg = true;
+            }
+            else {
+                errors << "No directory specified for cache" << std::endl;
+                return false;
+            }
+        }
+        else if (arg_str == "--stats") {
+            options.stats = StatsFormat::Table;
+        }
+        else if (arg_str == "--stats=json") {
+            options.stats = StatsFormat::JSON;
+        }
+        else if (arg_str == "--trace") {
+            if (arg + 1 < argc) {
+                options.trace_path = argv[arg + 1];
+                skipArg = true;
+            }
+            else {
+                errors << "No file specified for trace" << std::endl;
+                return false;
+            }
+        }
+        else if (arg_str == "--archive") {
+            if (arg + 1 < argc) {
+                options.archive_path = argv[arg + 1];
+                skipArg = true;
+            }
+            else {
+                errors << "No file specified for archive" << std::endl;
+                return false;
+            }
+        }
+        else if (arg_str == "--width") {
+            // Bounded so width * height * 3 stays well inside size_t and int arithmetic
+            if (!parse_int(arg + 1 < argc ? argv[arg + 1] : "", 1, 16384, options.output_width)) {
+                errors << "Width must be 1-16384 pixels" << std::endl;
+                return false;
+            }
+            skipArg = true;
+        }
+        else if (arg_str == "--height") {
+            // Bounded so width * height * 3 stays well inside size_t and int arithmetic
+            if (!parse_int(arg + 1 < argc ? argv[arg + 1] : "", 1, 16384, options.output_height)) {
+                errors << "Height must be 1-16384 pixels" << std::endl;
+                return false;
+            }
+            skipArg = true;
+        }
+        else if (arg_str == "--solver") {
+            std::string solver = (arg + 1 < argc) ? argv[arg + 1] : "";
+            if (solver == "exhaustive") {
+                options.block_solver = BlockSolver::Exhaustive;
+            }
+            else if (solver == "frequency") {
+                options.block_solver = BlockSolver::Frequency;
+            }
+            else {
+                errors << "Unknown block solver: " << solver << std::endl;
+                return false;
+            }
+            skipArg = true;
+        }
+        else if (arg_str == "--metric") {
+            std::string metric = (arg + 1 < argc) ? argv[arg + 1] : "";
+            if (metric == "rgb") {
+                options.color_metric = ColorMetric::RGB;
+            }
+            else if (metric == "redmean") {
+                options.color_metric = ColorMetric::Redmean;
+            }
+            else if (metric == "lab") {
+                options.color_metric = ColorMetric::Lab;
+            }
+            else if (metric == "yuv") {
+                options.color_metric = ColorMetric::YUV;
+            }
+            else {
+                errors << "Color metric must be rgb, redmean, lab or yuv" << std::endl;
+                return false;
+            }
+            skipArg = true;
+        }
+        else if (arg_str == "--solver-budget") {
+            if (!parse_int(arg + 1 < argc ? argv[arg + 1] : "", 0, std::numeric_limits<int>::max(), options.solver_budget_ms)) {
+                errors << "Solver budget must be 0 or more milliseconds (0 = no limit)" << std::endl;
+                return false;
+            }
+            skipArg = true;
+        }
+        else if (arg_str == "--background") {
+            std::string background = (arg + 1 < argc) ? argv[arg + 1] : "";
+            if (background == "auto") {
+                options.search_background = true;
+            }
+            else {
+                char* end = nullptr;
+                long color = std::strtol(background.c_str(), &end, 10);
+                if (background.empty() || *end != '\0' || color < 0 || color > 15) {
+                    errors << "Background must be a color 0-15 or auto" << std::endl;
+                    return false;
+                }
+                options.background = static_cast<int>(color);
+                options.search_background = false;
+            }
+            skipArg = true;
+        }
+        else if (arg_str == "--tolerance") {
+            std::string tolerance = (arg + 1 < argc) ? argv[arg + 1] : "";
+            char* end = nullptr;
+            long value = std::strtol(tolerance.c_str(), &end, 10);
+            if (tolerance.empty() || *end != '\0' || value < 0 || value > 255) {
+                errors << "Tolerance must be 0-255" << std::endl;
+                return false;
+            }
+            options.cell_reuse_tolerance = static_cast<int>(value);
+            skipArg = true;
+        }
+        else if (arg_str == "--scale") {
+            std::string filter = (arg + 1 < argc) ? argv[arg + 1] : "";
+            if (filter == "area") {
+                options.scale_filter = ScaleFilter::Area;
+            }
+            else if (filter == "nearest") {
+                options.scale_filter = ScaleFilter::Nearest;
+            }
+            else {
+                errors << "Scale filter must be area or nearest" << std::endl;
+                return false;
+            }
+            skipArg = true;
+        }
+        else if (arg_str == "--threads") {
+            if (!parse_int(arg + 1 < argc ? argv[arg + 1] : "", 0, 1024, options.threads)) {
+                errors << "Threads must be 0-1024 (0 = all cores)" << std::endl;
+                return false;
+            }
+            skipArg = true;
+        }
+        else {
+            errors << "Unknown argument: " << arg_str << std::endl;
+            return false;
+        }
+    }
+
+    // Validate mode selection
+    if (options.use_hires && options.use_multicolor) {
+        errors << "Cannot specify both multicolor and hires" << std::endl;
+        return false;
+    }
+    if (!options.use_hires && !options.use_multicolor) {
+        errors << "Must specify either --hires or --multicolor" << std::endl;
+        return false;
+    }
+    if (options.generate_koala && !options.use_multicolor) {
+        errors << "Koala output needs --multicolor" << std::endl;
+        return false;
+    }
+    if (options.pack && !options.generate_asm && !options.generate_prg) {
+        errors << "Packed output needs --asm or --prg" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+ConvertResult convert_image(const std::string& input_path, const std::string& output_path,
+    const ConvertOptions& options, std::ostream& log)
+{
+    ConversionContext context;
+    return convert_image(input_path, output_path, options, log, context);
+}
+
+// The pipeline behind both forms of convert_image: input_file is the input's bytes (only
+// read when options.cache_dir is set) and open_reader opens it for decoding
+static ConvertResult convert_source(const std::string& input_name, std::span<const uint8_t> input_file,
+    const std::function<std::unique_ptr<ImageReader>()>& open_reader, const std::string& output_path,
+    const ConvertOptions& options, std::ostream& log, ConversionContext& context)
+{
+    ConvertResult result;
+    ConversionStats& stats = result.stats;
+    auto started = std::chrono::steady_clock::now();
+    TraceSpan image_span(options.trace, input_name.c_str());
+
+    // With an on-disk cache, an unchanged input skips decoding and conversion entirely
+    std::string cache_key;
+    CachedConversion cached;
+    bool cache_hit = false;
+    if (!options.cache_dir.empty()) {
+        StageTimer timer(stats[Stage::Cache], options.trace, "cache lookup");
+        cache_key = conversion_cache_key(input_file, options);
+        cache_hit = !cache_key.empty()
+            && load_cached_conversion(options.cache_dir, cache_key, input_file, options, cached);
+    }
+
+    int target_width, target_height;
+    std::vector<uint8_t> scaled_image;
+    std::span<const uint8_t> native_indices;
+    int native_width;
+    BlockReduceResult reduced;
+    if (cache_hit) {
+        log << "Cache hit: " << cache_key << std::endl;
+        target_width = cached.width;
+        target_height = cached.height;
+        native_width = options.use_multicolor ? target_width / 2 : target_width;
+        native_indices = cached.indices;
+        reduced = cached.reduce;
+        stats[Stage::Cache].bytes = static_cast<long long>(cached.indices.size());
+        scaled_image.resize(static_cast<size_t>(target_width) * target_height * 3);
+        indices_to_rgb(cached.indices, native_width, target_height, scaled_image, target_width);
+    }
+    else {
+        // Open input image; rows are decoded and scaled incrementally
+        auto& decode = stats[Stage::Decode];
+        auto decode_started = std::chrono::steady_clock::now();
+        // Decoding and scaling alternate row by row, so the trace shows them as one event
+        std::optional<TraceSpan> streaming_span(std::in_place, options.trace, "decode and scale");
+        auto reader = open_reader();
+        decode.milliseconds += elapsed_ms(decode_started);
+
+        // Calculate target dimensions maintaining aspect ratio
+        ConversionContext::target_size(reader->width, reader->height, options, target_width, target_height);
+
+        scaled_image.resize(static_cast<size_t>(target_width) * target_height * 3);
+        std::vector<uint8_t> source_row(static_cast<size_t>(reader->width) * 3);
+        context.options = options;
+        context.begin(reader->width, reader->height, scaled_image, target_width, target_height);
+        for (auto y = 0; y < reader->height; ++y) {
+            auto row_started = std::chrono::steady_clock::now();
+            if (!reader->read_row(source_row.data())) {
+                throw std::runtime_error("Error loading image: " + input_name + "\n"
+                    + "Reason: " + reader->error());
+            }
+            decode.milliseconds += elapsed_ms(row_started);
+            context.push_row(source_row.data());
+        }
+        streaming_span.reset();
+        context.finish();
+        native_indices = context.native_indices();
+        native_width = context.native_width();
+        reduced = context.last_reduce();
+        decode.pixels = static_cast<long long>(reader->width) * reader->height;
+        decode.bytes = decode.pixels * 3;
+        stats.add(context.stats());
+
+        if (!cache_key.empty()) {
+            StageTimer timer(stats[Stage::Cache], options.trace, "cache store");
+            stats[Stage::Cache].bytes = static_cast<long long>(native_indices.size());
+            cached.width = target_width;
+            cached.height = target_height;
+            cached.reduce = reduced;
+            cached.indices.assign(native_indices.begin(), native_indices.end());
+            try {
+                store_cached_conversion(options.cache_dir, cache_key, input_file, options, cached);
+                log << "Cached as: " << cache_key << std::endl;
+            }
+            catch (const std::exception& e) {
+                // A cache that cannot be written only costs the next run its shortcut
+                log << "Warning: " << e.what() << std::endl;
+            }
+        }
+    }
+
+    if (reduced.searched) {
+        log << "Background search (total squared error):" << std::endl;
+        for (auto bg = 0; bg < 16; ++bg) {
+            log << "  " << bg << ": " << reduced.background_cost[bg]
+                << (bg == reduced.bg_color ? "  <- chosen" : "") << std::endl;
+        }
+    }
+
+    // Pack into C64 memory once for every output that needs it
+    C64ImageData c64_data;
+    if (options.generate_asm || options.generate_prg || options.generate_koala) {
+        StageTimer timer(stats[Stage::C64Memory], options.trace, stage_name(Stage::C64Memory));
+        c64_data = convert_indexed_to_c64_memory(native_indices.data(), native_width, target_height,
+            options.use_multicolor, reduced.bg_color);
+        stats[Stage::C64Memory].pixels = static_cast<long long>(native_width) * target_height;
+        stats[Stage::C64Memory].bytes = static_cast<long long>(c64_data.bitmap_data.size() + c64_data.screen_ram.size()
+            + (options.use_multicolor ? c64_data.color_ram.size() : 0));
+    }
+
+    ArtifactWriter& writer = options.artifact_writer ? *options.artifact_writer : file_artifact_writer();
+    auto& write = stats[Stage::Write];
+    auto store = [&](const std::string& what, const std::string& path, std::span<const uint8_t> data) {
+        TraceSpan span(options.trace, stage_name(Stage::Write));
+        auto artifact = writer.write(path, data);
+        log << what << " generated: " << artifact.path << " (" << artifact.bytes << " bytes, "
+            << artifact.milliseconds << " ms)" << std::endl;
+        write.milliseconds += artifact.milliseconds;
+        write.bytes += static_cast<long long>(artifact.bytes);
+        result.artifacts.push_back(std::move(artifact));
+    };
+
+    // Building the ASM, PRG and Koala files; store() books its own time under Write
+    auto& outputs = stats[Stage::Outputs];
+    auto outputs_started = std::chrono::steady_clock::now();
+    const double written_before = write.milliseconds;
+    std::optional<TraceSpan> outputs_span;
+    if (options.generate_asm || options.generate_prg || options.generate_koala)
+        outputs_span.emplace(options.trace, stage_name(Stage::Outputs));
+
+    // Generate ASM if requested
+    if (options.generate_asm) {
+        std::string asm_code = generate_6502_asm(output_path, options.use_multicolor, reduced.bg_color, options.pack);
+        store("Assembly code", get_filename(output_path, ".asm"),
+            std::span(reinterpret_cast<const uint8_t*>(asm_code.data()), asm_code.size()));
+        if (options.pack) {
+            auto packed = make_packed_prg(c64_data);
+            auto raw = c64_data.bitmap_data.size() + c64_data.screen_ram.size()
+                + (options.use_multicolor ? c64_data.color_ram.size() : 0);
+            log << "Packed " << raw << " bytes to " << packed.size() << " (" << packed.size() * 100 / raw
+                << "%)" << std::endl;
+            store("packed", get_filename(output_path, "pack") + ".prg", packed);
+        }
+        else {
+            store("bitmap", get_filename(output_path, "image") + ".prg", make_prg(bitmap_load_address, c64_data.bitmap_data));
+            store("color", get_filename(output_path, "color") + ".prg", make_prg(screen_load_address, c64_data.screen_ram));
+            if (options.use_multicolor) {
+                store("color RAM", get_filename(output_path, "cram") + ".prg",
+                    make_prg(color_ram_load_address, c64_data.color_ram));
+            }
+        }
+    }
+
+    // Self-contained PRG if requested
+    if (options.generate_prg)
+        store("Runnable PRG", get_filename(output_path, ".prg"), make_runnable_prg(c64_data, options.pack));
+
+    // Koala Painter file if requested
+    if (options.generate_koala)
+        store("Koala image", get_filename(output_path, ".kla"), make_koala(c64_data));
+
+    if (!result.artifacts.empty()) {
+        outputs.milliseconds = elapsed_ms(outputs_started) - (write.milliseconds - written_before);
+        outputs.bytes = write.bytes;
+    }
+    outputs_span.reset();
+
+    // Encode the output image in memory, then store it like every other artifact
+    result.output_path = output_path;
+    std::string extension = output_path.substr(output_path.find_last_of(".") + 1);
+
+    std::vector<uint8_t> encoded;
+    encoded.reserve(static_cast<size_t>(target_width) * target_height * RGBChannels / 2);
+    auto append = [](void* context, void* data, int size) {
+        auto& buffer = *static_cast<std::vector<uint8_t>*>(context);
+        auto* bytes = static_cast<const uint8_t*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+    };
+
+    auto encode_started = std::chrono::steady_clock::now();
+    std::optional<TraceSpan> encode_span(std::in_place, options.trace, stage_name(Stage::Encode));
+    bool save_result = false;
+    if (extension == "png") {
+        save_result = stbi_write_png_to_func(append, &encoded, target_width, target_height, RGBChannels,
+            scaled_image.data(), target_width * RGBChannels);
+    }
+    else if (extension == "jpg" || extension == "jpeg") {
+        save_result = stbi_write_jpg_to_func(append, &encoded, target_width, target_height, RGBChannels,
+            scaled_image.data(), 90);
+    }
+    else if (extension == "bmp") {
+        save_result = stbi_write_bmp_to_func(append, &encoded, target_width, target_height, RGBChannels,
+            scaled_image.data());
+    }
+    else {
+        log << "Unsupported output format. Using PNG." << std::endl;
+        result.output_path += ".png";
+        save_result = stbi_write_png_to_func(append, &encoded, target_width, target_height, RGBChannels,
+            scaled_image.data(), target_width * RGBChannels);
+    }
+
+    if (!save_result) {
+        throw std::runtime_error("Failed to save output image");
+    }
+    encode_span.reset();
+    stats[Stage::Encode] = { elapsed_ms(encode_started), static_cast<long long>(target_width) * target_height, 0,
+        static_cast<long long>(encoded.size()) };
+    store("Image", result.output_path, encoded);
+
+    stats.milliseconds = elapsed_ms(started);
+    result.width = target_width;
+    result.height = target_height;
+    result.background = reduced.bg_color;
+    result.image = std::move(scaled_image);
+    return result;
+}
+
+ConvertResult convert_image(const std::string& input_path, const std::string& output_path,
+    const ConvertOptions& options, std::ostream& log, ConversionContext& context)
+{
+    // Only the cache needs the file's bytes; otherwise the reader streams it
+    std::vector<uint8_t> input_file;
+    if (!options.cache_dir.empty())
+        input_file = read_file(input_path);
+    return convert_source(input_path, input_file, [&] { return open_image_reader(input_path); },
+        output_path, options, log, context);
+}
+
+ConvertResult convert_image_data(std::span<const uint8_t> input_file, const std::string& input_name,
+    const std::string& output_path, const ConvertOptions& options, std::ostream& log, ConversionContext& context)
+{
+    return convert_source(input_name, input_file, [&] { return open_image_reader(input_file, input_name); },
+        output_path, options, log, context);
+}
@@ -1,4 +1,79 @@
 #pragma once
+#include <iostream>
+#include <span>
+#include <stdint.h>
 #include <string>
+#include <vector>
+#include "artifactwriter.h"
+#include "blockreducer.h"
+#include "dither.h"
+#include "scale.h"
+#include "stats.h"
+
 std::string get_filename(const std::string& output_path, const std::string& ext);
 
+// Widen a multicolor image from its fat-pixel grid to screen pixels (each pixel twice);
+// output_width is 2 * input_width, or one more to repeat the last column
+extern void copy_multi_color_bitmap(
+    const uint8_t* input_buffer, int input_width, int input_height,
+    uint8_t* output_buffer, int output_width, int output_height);
+
+struct ConvertOptions {
+    bool use_dithering = false;
+    bool use_hires = false;
+    bool use_multicolor = false;
+    bool preview = false;
+    bool generate_asm = false;
+    bool generate_koala = false;    // multicolor only: also write a Koala Painter .kla file
+    bool generate_prg = false;      // one self-contained runnable PRG
+    bool pack = false;              // with generate_asm or generate_prg: LZ-pack the screen data
+    int output_width = 320;
+    int output_height = 200;
+    int threads = 1;
+    ScaleFilter scale_filter = ScaleFilter::Area;
+    DitherKernel dither_kernel = DitherKernel::FloydSteinberg;
+    BlockSolver block_solver = BlockSolver::Exhaustive;
+    ColorMetric color_metric = ColorMetric::RGB;    // how color differences are measured throughout
+    int solver_budget_ms = 0;
+    int background = C64_BLACK;     // multicolor $D021 color
+    bool search_background = false; // multicolor: pick the least-error background instead
+    int cell_reuse_tolerance = -1;  // frame sequences: a cell whose pixels all moved at most this
+                                    // much per channel since the last frame keeps its conversion (-1 = off)
+    std::string archive_path;       // --archive: store every output in this tar file instead
+    std::string cache_dir;          // --cache: reuse (and keep) conversions of unchanged inputs here
+    StatsFormat stats = StatsFormat::None;  // --stats: how the host should report ConvertResult::stats
+    std::string trace_path;         // --trace: where the host should write the trace recorded through trace
+    CellColorCache* cell_cache = nullptr;       // memo of exhaustive cell solves, shared by every image
+    ArtifactWriter* artifact_writer = nullptr;  // where outputs go; nullptr writes plain files
+    TraceRecorder* trace = nullptr;             // records every stage as a trace event; nullptr records nothing
+};
+
+struct ConvertResult {
+    std::string output_path;        // may differ from the requested path if the format fell back to PNG
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> image;     // final RGB pixels
+    int background = C64_BLACK;     // multicolor background color used
+    std::vector<ArtifactStats> artifacts;   // every file written, in order
+    ConversionStats stats;          // where the time went, stage by stage
+};
+
+// Parse the [options] part of the command line into options.
+// Returns false (after printing why to errors) on an unknown or incomplete argument.
+extern bool parse_convert_options(int argc, char** argv, int first, ConvertOptions& options,
+    std::ostream& errors = std::cerr);
+
+class ConversionContext;
+
+// Run the whole pipeline for one image: load, scale, reduce, dither/quantize, write outputs.
+// Progress goes to log; failures throw std::runtime_error.
+extern ConvertResult convert_image(const std::string& input_path, const std::string& output_path,
+    const ConvertOptions& options, std::ostream& log);
+
+// Same, reusing the scratch buffers of context (its options are replaced by options)
+extern ConvertResult convert_image(const std::string& input_path, const std::string& output_path,
+    const ConvertOptions& options, std::ostream& log, ConversionContext& context);
+
+// Same for an image file already in memory; input_name is only used in messages
+extern ConvertResult convert_image_data(std::span<const uint8_t> input_file, const std::string& input_name,
+    const std::string& output_path, const ConvertOptions& options, std::ostream& log, ConversionContext& context);
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <stdexcept>
+
+#include "conversioncache.h"
+
+namespace fs = std::filesystem;
+
+// Entry layout, host byte order: magic, version, options text (length + bytes), input size,
+// width, height, background, searched, 16 background costs, index count, indices
+static const char cache_magic[8] = { 'C', '6', '4', 'C', 'A', 'C', 'H', 'E' };
+static const uint32_t cache_version = 1;
+
+// 64-bit hash over 8-byte words; fast enough that hashing an input costs less than decoding it
+static uint64_t hash_bytes(std::span<const uint8_t> data, uint64_t seed)
+{
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = seed ^ (data.size() * multiplier);
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, &data[i], 8);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    if (i < data.size())
+        std::memcpy(&tail, data.data() + i, data.size() - i);
+    hash = (hash ^ tail) * multiplier;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Every option that changes the converted pixels; threads and output choices do not
+static std::string describe_options(const ConvertOptions& options)
+{
+    return std::string(options.use_multicolor ? "multicolor" : "hires")
+        + " dither=" + (options.use_dithering ? std::to_string(static_cast<int>(options.dither_kernel)) : "off")
+        + " size=" + std::to_string(options.output_width) + "x" + std::to_string(options.output_height)
+        + " scale=" + std::to_string(static_cast<int>(options.scale_filter))
+        + " solver=" + std::to_string(static_cast<int>(options.block_solver))
+        + " metric=" + std::to_string(static_cast<int>(options.color_metric))
+        + " background=" + (options.search_background ? "auto" : std::to_string(options.background));
+}
+
+static std::string entry_path(const std::string& directory, const std::string& key)
+{
+    return (fs::path(directory) / (key + ".c64cache")).string();
+}
+
+std::string conversion_cache_key(std::span<const uint8_t> input_file, const ConvertOptions& options)
+{
+    if (options.solver_budget_ms > 0)
+        return "";
+
+    auto description = describe_options(options);
+    uint64_t hashes[2] = {
+        hash_bytes(input_file, 0),
+        hash_bytes(std::span(reinterpret_cast<const uint8_t*>(description.data()), description.size()), 1),
+    };
+    char key[33];
+    std::snprintf(key, sizeof key, "%016llx%016llx",
+        static_cast<unsigned long long>(hashes[0]), static_cast<unsigned long long>(hashes[1]));
+    return key;
+}
+
+bool load_cached_conversion(const std::string& directory, const std::string& key,
+    std::span<const uint8_t> input_file, const ConvertOptions& options, CachedConversion& entry)
+{
+    std::ifstream in(entry_path(directory, key), std::ios::binary);
+    if (!in)
+        return false;
+
+    auto read = [&](void* value, size_t size) {
+        return static_cast<bool>(in.read(static_cast<char*>(value), static_cast<std::streamsize>(size)));
+    };
+
+    char magic[8];
+    uint32_t version, description_size;
+    if (!read(magic, sizeof magic) || std::memcmp(magic, cache_magic, sizeof magic) != 0
+        || !read(&version, sizeof version) || version != cache_version || !read(&description_size, sizeof description_size))
+        return false;
+
+    auto description = describe_options(options);
+    std::string stored(description_size, '\0');
+    uint64_t input_size;
+    if (description_size != description.size() || !read(stored.data(), stored.size()) || stored != description
+        || !read(&input_size, sizeof input_size) || input_size != input_file.size())
+        return false;
+
+    int32_t width, height, background;
+    uint8_t searched;
+    uint64_t index_count;
+    if (!read(&width, sizeof width) || !read(&height, sizeof height) || !read(&background, sizeof background)
+        || !read(&searched, sizeof searched) || !read(entry.reduce.background_cost.data(), sizeof entry.reduce.background_cost)
+        || !read(&index_count, sizeof index_count))
+        return false;
+
+    // The index count has to match the size, or a damaged entry could claim any amount
+    const int native_width = options.use_multicolor ? width / 2 : width;
+    if (width <= 0 || height <= 0 || index_count != static_cast<uint64_t>(native_width) * height)
+        return false;
+    if (background < 0 || background > 15)
+        return false;
+    entry.indices.resize(index_count);
+    if (!read(entry.indices.data(), entry.indices.size()))
+        return false;
+    // Indices go straight into palette lookups; one out of range would read past c64_palette
+    if (std::any_of(entry.indices.begin(), entry.indices.end(), [](uint8_t index) { return index > 15; }))
+        return false;
+
+    entry.width = width;
+    entry.height = height;
+    entry.reduce.bg_color = background;
+    entry.reduce.searched = searched != 0;
+    return true;
+}
+
+// Create a temporary file next to path that no other thread or process can also be using:
+// the name is random per process plus a counter, and creation fails rather than opening a
+// file that already exists ("x"), in which case the next name is tried
+static FILE* create_temp_file(const std::string& path, std::string& temp_path)
+{
+    static const uint64_t process_tag = (static_cast<uint64_t>(std::random_device{}()) << 32) ^ std::random_device{}();
+    static std::atomic<uint64_t> counter{ 0 };
+    for (auto attempt = 0; attempt < 16; ++attempt) {
+        char suffix[48];
+        std::snprintf(suffix, sizeof suffix, ".%016llx.%llu.tmp", static_cast<unsigned long long>(process_tag),
+            static_cast<unsigned long long>(counter++));
+        temp_path = path + suffix;
+        if (FILE* file = std::fopen(temp_path.c_str(), "wbx"))
+            return file;
+        if (errno != EEXIST)
+            return nullptr;
+    }
+    return nullptr;
+}
+
+void store_cached_conversion(const std::string& directory, const std::string& key,
+    std::span<const uint8_t> input_file, const ConvertOptions& options, const CachedConversion& entry)
+{
+    auto description = describe_options(options);
+    std::vector<uint8_t> data;
+    data.reserve(128 + description.size() + entry.indices.size());
+    auto append = [&](const void* value, size_t size) {
+        auto* bytes = static_cast<const uint8_t*>(value);
+        data.insert(data.end(), bytes, bytes + size);
+    };
+
+    uint32_t description_size = static_cast<uint32_t>(description.size());
+    uint64_t input_size = input_file.size();
+    int32_t width = entry.width, height = entry.height, background = entry.reduce.bg_color;
+    uint8_t searched = entry.reduce.searched ? 1 : 0;
+    uint64_t index_count = entry.indices.size();
+    append(cache_magic, sizeof cache_magic);
+    append(&cache_version, sizeof cache_version);
+    append(&description_size, sizeof description_size);
+    append(description.data(), description.size());
+    append(&input_size, sizeof input_size);
+    append(&width, sizeof width);
+    append(&height, sizeof height);
+    append(&background, sizeof background);
+    append(&searched, sizeof searched);
+    append(entry.reduce.background_cost.data(), sizeof entry.reduce.background_cost);
+    append(&index_count, sizeof index_count);
+    append(entry.indices.data(), entry.indices.size());
+
+    std::error_code error;
+    fs::create_directories(directory, error);
+    auto path = entry_path(directory, key);
+    std::string temp_path;
+    FILE* out = create_temp_file(path, temp_path);
+    if (!out)
+        throw std::runtime_error("Cannot create a temporary file for cache entry " + path);
+    bool written = std::fwrite(data.data(), 1, data.size(), out) == data.size();
+    written = std::fclose(out) == 0 && written;
+    if (!written) {
+        fs::remove(temp_path, error);
+        throw std::runtime_error("Cannot write cache entry " + temp_path);
+    }
+    fs::rename(temp_path, path, error);
+    if (error) {
+        fs::remove(temp_path, error);
+        throw std::runtime_error("Cannot store cache entry " + path);
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <span>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "blockreducer.h"
+#include "c64converter.h"
+
+// One conversion as kept in the on-disk cache: enough to write every output again
+// without decoding, scaling or reducing the input
+struct CachedConversion {
+    int width = 0;                  // target (screen) size
+    int height = 0;
+    BlockReduceResult reduce;
+    std::vector<uint8_t> indices;   // palette index per native pixel (fat-pixel grid for multicolor)
+};
+
+// Cache key for an input file's bytes converted with options: a hash of the file and one of
+// the options that change the result. Empty when the result is not reproducible (a solver
+// time budget makes it depend on timing), in which case nothing should be cached.
+extern std::string conversion_cache_key(std::span<const uint8_t> input_file, const ConvertOptions& options);
+
+// Read the entry for key from directory. Returns false if there is none, or if it is
+// damaged or was written for different options or a different input size.
+extern bool load_cached_conversion(const std::string& directory, const std::string& key,
+    std::span<const uint8_t> input_file, const ConvertOptions& options, CachedConversion& entry);
+
+// Write entry for key into directory, creating it if needed. The file appears atomically
+// (written under a temporary name, then renamed), so concurrent batch workers never see
+// half an entry. Throws std::runtime_error if it cannot be written.
+extern void store_cached_conversion(const std::string& directory, const std::string& key,
+    std::span<const uint8_t> input_file, const ConvertOptions& options, const CachedConversion& entry);
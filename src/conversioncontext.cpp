@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "c64converter.h"
+#include "conversioncontext.h"
+#include "dither.h"
+#include "pallet.h"
+#include "scale.h"
+
+// Put the previous frame's indices back into every kept cell
+static void restore_kept_indices(uint8_t* indices, const uint8_t* previous, int width, int height,
+    const uint8_t* kept_cells, int cell_width)
+{
+    const int cols = (width + cell_width - 1) / cell_width;
+    for (auto y = 0; y < height; ++y) {
+        const uint8_t* kept_row = &kept_cells[static_cast<size_t>(y / 8) * cols];
+        for (auto x = 0; x < width; ++x) {
+            if (kept_row[x / cell_width])
+                indices[static_cast<size_t>(y) * width + x] = previous[static_cast<size_t>(y) * width + x];
+        }
+    }
+}
+
+// Pixels covered by the kept cells; the last column and row of cells may be cut off
+static long long kept_pixels(const uint8_t* kept_cells, int width, int height, int cell_width)
+{
+    const int cols = (width + cell_width - 1) / cell_width;
+    const int rows = (height + 7) / 8;
+    long long pixels = 0;
+    for (auto row = 0; row < rows; ++row) {
+        for (auto col = 0; col < cols; ++col) {
+            if (kept_cells[static_cast<size_t>(row) * cols + col])
+                pixels += static_cast<long long>(std::min(cell_width, width - col * cell_width)) * std::min(8, height - row * 8);
+        }
+    }
+    return pixels;
+}
+
+void ConversionContext::target_size(int width, int height, const ConvertOptions& options,
+    int& target_width, int& target_height)
+{
+    float aspect = static_cast<float>(width) / height;
+
+    if (aspect > (static_cast<float>(options.output_width) / options.output_height)) {
+        target_width = options.output_width;
+        target_height = static_cast<int>(options.output_width / aspect);
+    }
+    else {
+        target_height = options.output_height;
+        target_width = static_cast<int>(options.output_height * aspect);
+    }
+    // A very wide or tall source must not round its short side down to nothing; multicolor
+    // needs two screen pixels for one fat pixel
+    target_width = std::max(options.use_multicolor ? 2 : 1, target_width);
+    target_height = std::max(1, target_height);
+}
+
+void ConversionContext::convert(std::span<const uint8_t> input, int width, int height,
+    std::span<uint8_t> output, int target_width, int target_height)
+{
+    if (input.size() < static_cast<size_t>(width) * height * 3)
+        throw std::invalid_argument("Input buffer smaller than width * height * 3");
+
+    begin(width, height, output, target_width, target_height);
+    {
+        TraceSpan span(options.trace, stage_name(Stage::Scale));
+        for (auto y = 0; y < height; ++y)
+            push_row(&input[static_cast<size_t>(y) * width * 3]);
+    }
+    finish();
+}
+
+void ConversionContext::begin(int width, int height, std::span<uint8_t> output, int target_width, int target_height)
+{
+    if (output.size() < static_cast<size_t>(target_width) * target_height * 3)
+        throw std::invalid_argument("Output buffer smaller than target_width * target_height * 3");
+
+    this->output = output;
+    stage_stats = ConversionStats();
+    this->target_width = target_width;
+    this->target_height = target_height;
+
+    // Multicolor runs on the fat-pixel grid at half width; finish() widens the result into output
+    if (options.use_multicolor) {
+        native = std::span<uint8_t>();
+        native_pixels.resize(static_cast<size_t>(target_width / 2) * target_height * 3);
+        scaler.reset(width, height, target_width / 2, target_height, 3, native_pixels.data(), options.scale_filter);
+    }
+    else {
+        scaler.reset(width, height, target_width, target_height, 3, output.data(), options.scale_filter);
+    }
+}
+
+void ConversionContext::push_row(const uint8_t* row)
+{
+    StageTimer timer(stage_stats[Stage::Scale]);
+    scaler.push_row(row);
+}
+
+void ConversionContext::finish()
+{
+    if (scaler.rows_written() < target_height)
+        throw std::invalid_argument("Not every source row was pushed before finish()");
+
+    auto& scale = stage_stats[Stage::Scale];
+    scale.pixels = static_cast<long long>(native_width()) * target_height;
+    scale.bytes = scale.pixels * 3;
+
+    if (options.use_multicolor) {
+        native = std::span<uint8_t>(native_pixels.data(), static_cast<size_t>(target_width / 2) * target_height * 3);
+        process(native, target_width / 2, target_height);
+        copy_multi_color_bitmap(native.data(), target_width / 2, target_height, output.data(), target_width, target_height);
+    }
+    else {
+        native = output.first(static_cast<size_t>(target_width) * target_height * 3);
+        process(native, target_width, target_height);
+    }
+}
+
+// Compare image cell by cell with the pixels each cell was last converted from and flag the
+// cells within tolerance; returns false (nothing kept) when there is no comparable previous frame
+bool ConversionContext::update_kept_cells(const uint8_t* image, int width, int height)
+{
+    reused_cells = 0;
+    const bool comparable = has_previous && previous_width == width && previous_height == height
+        && previous_multicolor == options.use_multicolor;
+    const int cell_width = options.use_multicolor ? 4 : 8;
+    const int cols = (width + cell_width - 1) / cell_width;
+    const int rows = (height + 7) / 8;
+    kept_cells.assign(static_cast<size_t>(cols) * rows, comparable ? 1 : 0);
+
+    if (comparable) {
+        const int tolerance = options.cell_reuse_tolerance;
+        for (auto y = 0; y < height; ++y) {
+            uint8_t* kept_row = &kept_cells[static_cast<size_t>(y / 8) * cols];
+            const uint8_t* row = &image[static_cast<size_t>(y) * width * 3];
+            const uint8_t* previous_row = &previous_source[static_cast<size_t>(y) * width * 3];
+            for (auto x = 0; x < width * 3; ++x) {
+                if (std::abs(row[x] - previous_row[x]) > tolerance)
+                    kept_row[x / 3 / cell_width] = 0;
+            }
+        }
+        for (auto kept : kept_cells)
+            reused_cells += kept;
+
+        // Kept cells go on comparing against the pixels they were converted from, so drift
+        // within tolerance per frame still adds up to a reconversion
+        for (auto y = 0; y < height; ++y) {
+            const uint8_t* kept_row = &kept_cells[static_cast<size_t>(y / 8) * cols];
+            const uint8_t* row = &image[static_cast<size_t>(y) * width * 3];
+            uint8_t* previous_row = &previous_source[static_cast<size_t>(y) * width * 3];
+            for (auto col = 0; col < cols; ++col) {
+                if (kept_row[col])
+                    continue;
+                auto first = col * cell_width * 3;
+                auto last = std::min(width, (col + 1) * cell_width) * 3;
+                std::copy(row + first, row + last, previous_row + first);
+            }
+        }
+    }
+    else {
+        previous_source.assign(image, image + static_cast<size_t>(width) * height * 3);
+    }
+
+    has_previous = true;
+    previous_width = width;
+    previous_height = height;
+    previous_multicolor = options.use_multicolor;
+    return comparable;
+}
+
+void ConversionContext::process(std::span<uint8_t> image_span, int width, int height)
+{
+    uint8_t* image = image_span.data();
+    pixel_indices.resize(static_cast<size_t>(width) * height);
+    uint8_t* indices = pixel_indices.data();
+    const long long pixels = static_cast<long long>(width) * height;
+    auto& dither_stats = stage_stats[Stage::Dither];
+    auto& reduce_stats = stage_stats[Stage::Reduce];
+    auto& quantize_stats = stage_stats[Stage::Quantize];
+    dither_stats = reduce_stats = quantize_stats = StageStats();
+
+    BlockReduceOptions reduce;
+    reduce.threads = options.threads;
+    reduce.solver = options.block_solver;
+    reduce.time_budget_ms = options.solver_budget_ms;
+    reduce.bg_color = options.background;
+    reduce.search_background = options.search_background;
+    reduce.metric = options.color_metric;
+    reduce.cell_cache = options.cell_cache;
+    reduce.trace = options.trace;
+    reduce_result = BlockReduceResult();
+
+    // Kept cells only mean something against the previous frame's colors, so its background stays
+    const bool reuse = options.cell_reuse_tolerance >= 0 && update_kept_cells(image, width, height);
+    const int cell_width = options.use_multicolor ? 4 : 8;
+    long long solved_pixels = pixels;
+    if (reuse) {
+        reduce.keep_cells = kept_cells.data();
+        reduce.bg_color = previous_background;
+        reduce.search_background = false;
+        solved_pixels -= kept_pixels(kept_cells.data(), width, height, cell_width);
+    }
+
+    if (options.use_dithering) {
+        // Dither onto the palette before reduction so the per-cell color limits still hold
+        // afterwards. From here on the image is one palette index per pixel.
+        {
+            StageTimer timer(dither_stats, options.trace, stage_name(Stage::Dither));
+            if (is_ordered_dither(options.dither_kernel))
+                apply_ordered_dither(image, width, height, 3, c64_palette, options.dither_kernel, indices, &dither, options.threads,
+                    options.color_metric);
+            else
+                diffuse_error(image, width, height, 3, c64_palette, options.dither_kernel, indices, &dither, options.threads,
+                    options.color_metric);
+        }
+        dither_stats.pixels = dither_stats.lookups = pixels;
+        dither_stats.bytes = pixels;
+
+        // Kept cells take the previous frame's pixels again, which the reducers then leave alone
+        if (reuse)
+            restore_kept_indices(indices, previous_indices.data(), width, height, kept_cells.data(), cell_width);
+
+        if (options.use_hires || options.use_multicolor) {
+            StageTimer timer(reduce_stats, options.trace, stage_name(Stage::Reduce));
+            if (options.use_hires) {
+                reduce_indexed_hires(indices, width, height, reduce, &reducer);
+            }
+            else {
+                reduce_result = reduce_indexed_multicolor(indices, width, height, reduce, &reducer);
+            }
+        }
+    }
+    else if (options.use_hires || options.use_multicolor) {
+        // Snapping every pixel to one of its cell's colors quantizes it as well
+        StageTimer timer(reduce_stats, options.trace, stage_name(Stage::Reduce));
+        if (options.use_hires) {
+            convert_to_c64_hires(image, width, height, reduce, &reducer, indices);
+        }
+        else {
+            reduce_result = convert_to_c64_multicolor(image, width, height, reduce, &reducer, indices);
+        }
+    }
+    else {
+        // Simple color quantization, one row at a time
+        {
+            StageTimer timer(quantize_stats, options.trace, stage_name(Stage::Quantize));
+            for (auto y = 0; y < height; ++y)
+                find_closest_colors(&image[y * width * 3], width, &indices[y * width], c64_palette, options.color_metric);
+        }
+        quantize_stats.pixels = quantize_stats.lookups = quantize_stats.bytes = pixels;
+    }
+    if (options.use_hires || options.use_multicolor) {
+        // Every pixel of a cell that was not kept is mapped to the nearest of its cell's colors
+        reduce_stats.pixels = reduce_stats.bytes = pixels;
+        reduce_stats.lookups = solved_pixels;
+    }
+
+    if (options.cell_reuse_tolerance >= 0) {
+        previous_indices = pixel_indices;
+        previous_background = options.use_multicolor ? reduce_result.bg_color : 0;
+    }
+
+    // RGB only exists again from here, for the caller
+    for (size_t i = 0; i < pixel_indices.size(); ++i) {
+        auto& color = c64_palette[indices[i]];
+        image[i * 3] = color[0];
+        image[i * 3 + 1] = color[1];
+        image[i * 3 + 2] = color[2];
+    }
+}
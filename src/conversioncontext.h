@@ -0,0 +1,92 @@
+#pragma once
+#include <span>
+#include <stdint.h>
+#include <vector>
+#include "blockreducer.h"
+#include "c64converter.h"
+#include "dither.h"
+#include "scale.h"
+#include "stats.h"
+
+// Reusable conversion state for hosts that convert many images in one process.
+// The context owns every scratch buffer the pipeline needs; buffers only grow, so once
+// it has seen the largest image size, single-threaded conversions allocate nothing.
+// (With options.threads > 1 the worker hand-off still allocates a few small objects.)
+// A context is not thread-safe; use one per thread.
+class ConversionContext {
+public:
+    ConversionContext() = default;
+    explicit ConversionContext(const ConvertOptions& options) : options(options) {}
+
+    // Output size for a width x height source, keeping its aspect ratio
+    static void target_size(int width, int height, const ConvertOptions& options, int& target_width, int& target_height);
+
+    // Scale, reduce and dither/quantize width x height RGB input into output, which must hold
+    // target_width * target_height * 3 bytes (see target_size). Throws std::invalid_argument
+    // if either span is too small.
+    void convert(std::span<const uint8_t> input, int width, int height,
+        std::span<uint8_t> output, int target_width, int target_height);
+
+    // Streaming form of convert(): call begin(), push all height source rows top to bottom,
+    // then finish(). Only the scaler's row accumulators are held besides output (and, for
+    // multicolor, the half-width image), so the source never has to be resident in full.
+    void begin(int width, int height, std::span<uint8_t> output, int target_width, int target_height);
+    void push_row(const uint8_t* row);
+    void finish();
+
+    // Reduce and dither/quantize an image that is already at its target size, in place.
+    // Multicolor images are on the fat-pixel grid: half the screen width.
+    void process(std::span<uint8_t> image, int width, int height);
+
+    // The converted image as the C64 stores it, valid after finish() until the next begin():
+    // the fat-pixel grid (target_width / 2 wide) for multicolor, output itself for hires.
+    // native_indices() holds the same pixels as palette indices, which is how the pipeline
+    // carries them after quantization; RGB is only written out at the end of process().
+    std::span<const uint8_t> native_image() const { return native; }
+    std::span<const uint8_t> native_indices() const { return pixel_indices; }
+    int native_width() const { return options.use_multicolor ? target_width / 2 : target_width; }
+
+    // Background choice (and search costs, if searched) of the last multicolor conversion
+    const BlockReduceResult& last_reduce() const { return reduce_result; }
+
+    // Frame sequences (options.cell_reuse_tolerance >= 0): each image is compared cell by cell
+    // with the previous one of the same size and mode, and cells within tolerance keep their
+    // colors and pixels instead of being converted again. A kept cell is measured against the
+    // pixels it was last converted from, not the previous frame, so slow drift still counts. A multicolor sequence keeps the
+    // first frame's background throughout. reuse_count() is how many cells the last image kept.
+    int reuse_count() const { return reused_cells; }
+    void reset_sequence() { has_previous = false; }
+
+    // Scale, dither, reduce and quantize timings and counters of the last conversion
+    // (begin() clears them); the stages it does not run stay zero
+    const ConversionStats& stats() const { return stage_stats; }
+
+    ConvertOptions options;
+
+private:
+    std::span<uint8_t> output;
+    int target_width = 0;
+    int target_height = 0;
+
+    StreamingScaler scaler;
+    std::span<uint8_t> native;
+    std::vector<uint8_t> native_pixels; // multicolor image on the fat-pixel grid
+    std::vector<uint8_t> pixel_indices; // palette index per native pixel
+    BlockReducerScratch reducer;
+    DitherScratch dither;
+    BlockReduceResult reduce_result;
+    ConversionStats stage_stats;
+
+    // Frame sequence state: per cell, the pixels it was last converted from (before reduction);
+    // the previous result and which cells kept theirs
+    bool update_kept_cells(const uint8_t* image, int width, int height);
+    bool has_previous = false;
+    int previous_width = 0;
+    int previous_height = 0;
+    bool previous_multicolor = false;
+    int previous_background = 0;
+    std::vector<uint8_t> previous_source;
+    std::vector<uint8_t> previous_indices;
+    std::vector<uint8_t> kept_cells;
+    int reused_cells = 0;
+};
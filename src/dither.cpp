@@ -1,7 +1,12 @@
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
 
 #include "dither.h"
 #include "pallet.h"
+#include "threadpool.h"
 
 void apply_floyd_steinberg(uint8_t* image, int width, int height)
 {
@@ -57,44 +62,345 @@ void apply_floyd_steinberg(uint8_t* image, int width, int height)
 void apply_dithering(uint8_t* image, int width, int height, int channels, 
     const std::vector<std::array<uint8_t, 3>>& palette)
 {
-    for (int y = 0; y < height; ++y) {
+    diffuse_error(image, width, height, channels, palette, DitherKernel::FloydSteinberg);
+}
+
+struct DiffusionTap {
+    int dx;
+    int dy;
+    int weight;     // in 1/16ths of the error
+};
+
+struct FloydSteinbergKernel {
+    static constexpr int rows = 2;
+    static constexpr DiffusionTap taps[] = { { 1, 0, 7 }, { -1, 1, 3 }, { 0, 1, 5 }, { 1, 1, 1 } };
+};
+
+struct AtkinsonKernel {
+    static constexpr int rows = 3;
+    static constexpr DiffusionTap taps[] = { { 1, 0, 2 }, { 2, 0, 2 }, { -1, 1, 2 }, { 0, 1, 2 }, { 1, 1, 2 }, { 0, 2, 2 } };
+};
+
+struct SierraLiteKernel {
+    static constexpr int rows = 2;
+    static constexpr DiffusionTap taps[] = { { 1, 0, 8 }, { -1, 1, 4 }, { 0, 1, 4 } };
+};
+
+// Error rows are padded by two pixels on each side so taps never need bounds checks.
+// Pad cells absorb the error that falls off the image edges and are never read.
+static const int error_pad = 2;
+
+// A row may process pixel x once the row above has finished pixel x + 3. Taps reach one
+// cell left and two right, so this keeps the two rows' updates on disjoint error cells.
+static const int wavefront_lag = 4;
+
+// Pixels between progress updates published to the row below
+static const int progress_step = 32;
+
+template <typename Kernel>
+struct DiffusionState {
+    uint8_t* image;
+    int width;
+    int height;
+    int channels;
+    const std::vector<std::array<uint8_t, 3>>& palette;
+    const PaletteLut& lut;
+    uint8_t* indices;
+    int16_t* error_rows;
+    int ring;                               // error rows in the ring buffer
+    int row_stride;
+    // Per ring slot, y * (width + 1) + pixels finished of the last row using it. Values only
+    // grow, so a stale entry from an earlier row can never look like progress. Null when serial.
+    std::atomic<long long>* progress;
+
+    int16_t* error_row(int y) { return &error_rows[(y % ring) * row_stride + error_pad * 3]; }
+
+    void diffuse_row(int y)
+    {
+        int16_t* rows[Kernel::rows];
+        for (int r = 0; r < Kernel::rows; ++r)
+            rows[r] = error_row(y + r);
+
+        std::atomic<long long>* above = (progress && y > 0) ? &progress[(y - 1) % ring] : nullptr;
+        std::atomic<long long>* own = progress ? &progress[y % ring] : nullptr;
+        long long above_base = static_cast<long long>(y - 1) * (width + 1);
+        long long own_base = static_cast<long long>(y) * (width + 1);
+        long long above_done = above ? above->load(std::memory_order_acquire) : above_base + width;
+
         for (int x = 0; x < width; ++x) {
-            int idx = (y * width + x) * channels;
+            // Wait for the row above to get far enough ahead
+            long long needed = above_base + std::min(x + wavefront_lag, width);
+            while (above_done < needed) {
+                std::this_thread::yield();
+                above_done = above->load(std::memory_order_acquire);
+            }
 
-            uint8_t palette_idx = find_closest_color(&image[idx], palette);
-            int error_r = image[idx] - palette[palette_idx][0];
-            int error_g = image[idx + 1] - palette[palette_idx][1];
-            int error_b = image[idx + 2] - palette[palette_idx][2];
+            int idx = (y * width + x) * channels;
+            int16_t* error = &rows[0][x * 3];
 
-            image[idx] = palette[palette_idx][0];
-            image[idx + 1] = palette[palette_idx][1];
-            image[idx + 2] = palette[palette_idx][2];
+            // Source plus accumulated error, rounded from 1/16 units. The error cell is
+            // cleared once read so the ring slot is clean when it comes round again.
+            uint8_t wanted[3];
+            for (int c = 0; c < 3; ++c) {
+                wanted[c] = static_cast<uint8_t>(std::clamp(image[idx + c] + ((error[c] + 8) >> 4), 0, 255));
+                error[c] = 0;
+            }
 
-            // Distribute error to neighboring pixels
-            if (x + 1 < width) {
-                for (int c = 0; c < 3; ++c) {
-                    int neighbor_idx = idx + channels + c;
-                    image[neighbor_idx] = std::clamp(image[neighbor_idx] + error_r * 7 / 16, 0, 255);
-                }
+            uint8_t palette_idx = lut.lookup(wanted);
+            auto& color = palette[palette_idx];
+            for (int c = 0; c < 3; ++c) {
+                int diff = wanted[c] - color[c];
+                for (auto& tap : Kernel::taps)
+                    rows[tap.dy][(x + tap.dx) * 3 + c] += static_cast<int16_t>(diff * tap.weight);
+                image[idx + c] = color[c];
             }
-            if (y + 1 < height) {
-                if (x > 0) {
-                    for (int c = 0; c < 3; ++c) {
-                        int neighbor_idx = idx + (width - 1) * channels + c;
-                        image[neighbor_idx] = std::clamp(image[neighbor_idx] + error_r * 3 / 16, 0, 255);
-                    }
-                }
-                for (int c = 0; c < 3; ++c) {
-                    int neighbor_idx = idx + width * channels + c;
-                    image[neighbor_idx] = std::clamp(image[neighbor_idx] + error_r * 5 / 16, 0, 255);
-                }
-                if (x + 1 < width) {
-                    for (int c = 0; c < 3; ++c) {
-                        int neighbor_idx = idx + (width + 1) * channels + c;
-                        image[neighbor_idx] = std::clamp(image[neighbor_idx] + error_r * 1 / 16, 0, 255);
-                    }
-                }
+            if (indices)
+                indices[y * width + x] = palette_idx;
+
+            if (own && ((x + 1) % progress_step == 0 || x + 1 == width))
+                own->store(own_base + x + 1, std::memory_order_release);
+        }
+    }
+};
+
+template <typename Kernel>
+static void diffuse_error_kernel(uint8_t* image, int width, int height, int channels,
+    const std::vector<std::array<uint8_t, 3>>& palette, uint8_t* indices, std::vector<int16_t>& error_rows, int threads,
+    ColorMetric metric)
+{
+    threads = std::max(1, std::min(resolve_thread_count(threads), height));
+
+    // Rows in flight plus the rows below them that receive error
+    const int ring = threads + Kernel::rows - 1;
+    const int row_stride = (width + 2 * error_pad) * 3;
+    error_rows.assign(static_cast<size_t>(row_stride) * ring, 0);
+
+    DiffusionState<Kernel> state{ image, width, height, channels, palette, get_palette_lut(palette, metric), indices,
+        error_rows.data(), ring, row_stride, nullptr };
+
+    if (threads == 1) {
+        for (int y = 0; y < height; ++y)
+            state.diffuse_row(y);
+        return;
+    }
+
+    // Wavefront: rows are claimed in order, and each one trails the row above by
+    // wavefront_lag pixels, so every error cell sees the same additions as in the serial
+    // kernel and the result is bit-identical. A thread only ever waits on a row that is
+    // already running.
+    std::vector<std::atomic<long long>> progress(ring);
+    for (auto& done : progress)
+        done.store(-1);
+    state.progress = progress.data();
+
+    std::atomic<int> next_row{ 0 };
+    parallel_for(threads, threads, [&](int) {
+        for (int y = next_row++; y < height; y = next_row++)
+            state.diffuse_row(y);
+    });
+}
+
+void diffuse_error(uint8_t* image, int width, int height, int channels,
+    const std::vector<std::array<uint8_t, 3>>& palette, DitherKernel kernel,
+    uint8_t* indices, DitherScratch* scratch, int threads, ColorMetric metric)
+{
+    DitherScratch local;
+    auto& error_rows = (scratch ? *scratch : local).error_rows;
+
+    switch (kernel) {
+        case DitherKernel::FloydSteinberg:
+            diffuse_error_kernel<FloydSteinbergKernel>(image, width, height, channels, palette, indices, error_rows, threads, metric);
+            break;
+        case DitherKernel::Atkinson:
+            diffuse_error_kernel<AtkinsonKernel>(image, width, height, channels, palette, indices, error_rows, threads, metric);
+            break;
+        case DitherKernel::SierraLite:
+            diffuse_error_kernel<SierraLiteKernel>(image, width, height, channels, palette, indices, error_rows, threads, metric);
+            break;
+        default:
+            throw std::invalid_argument("Ordered dither kernels are applied with apply_ordered_dither");
+    }
+}
+
+// Levels the ordered threshold is spread over; roughly the gap between neighbouring
+// C64 greys, so flat areas mix the two nearest palette colors
+static const int ordered_spread = 64;
+
+static const int blue_noise_size = 64;
+
+// Square threshold matrix as per-pixel channel bias, row-major
+struct ThresholdMatrix {
+    int size;
+    std::vector<int8_t> bias;
+};
+
+// Map ranks 0 .. size*size-1 evenly onto biases centred on zero
+static ThresholdMatrix ranks_to_matrix(int size, const std::vector<int>& ranks)
+{
+    ThresholdMatrix matrix{ size, std::vector<int8_t>(ranks.size()) };
+    const int cells = size * size;
+    for (size_t i = 0; i < ranks.size(); ++i)
+        matrix.bias[i] = static_cast<int8_t>((2 * ranks[i] + 1 - cells) * ordered_spread / (2 * cells));
+    return matrix;
+}
+
+// Recursive Bayer matrix: M(2n) = [4M, 4M+2; 4M+3, 4M+1]
+static ThresholdMatrix make_bayer_matrix(int size)
+{
+    int n = 1;
+    std::vector<int> ranks = { 0 };
+    while (n < size) {
+        std::vector<int> next(n * n * 4);
+        for (auto y = 0; y < n; ++y) {
+            for (auto x = 0; x < n; ++x) {
+                int rank = ranks[y * n + x] * 4;
+                next[y * 2 * n + x] = rank;
+                next[y * 2 * n + x + n] = rank + 2;
+                next[(y + n) * 2 * n + x] = rank + 3;
+                next[(y + n) * 2 * n + x + n] = rank + 1;
             }
         }
+        ranks.swap(next);
+        n *= 2;
     }
+    return ranks_to_matrix(size, ranks);
+}
+
+// Blue noise by void-and-cluster (Ulichney 1993) on a torus. Energy is a Gaussian
+// (sigma 1.5) sum over set pixels; the tightest cluster is the set pixel with the most
+// energy, the largest void the empty pixel with the least. The seed pattern is fixed,
+// so the tile is the same on every run.
+static ThresholdMatrix make_blue_noise_matrix()
+{
+    const int n = blue_noise_size;
+    const int mask = n - 1;
+    const int cells = n * n;
+
+    std::vector<float> gauss(cells);
+    for (auto dy = 0; dy < n; ++dy) {
+        for (auto dx = 0; dx < n; ++dx) {
+            int wy = std::min(dy, n - dy);
+            int wx = std::min(dx, n - dx);
+            gauss[dy * n + dx] = std::exp(-(wx * wx + wy * wy) / (2.0f * 1.5f * 1.5f));
+        }
+    }
+
+    std::vector<uint8_t> set(cells, 0);
+    std::vector<float> energy(cells, 0.0f);
+    auto toggle = [&](int p) {
+        set[p] = !set[p];
+        float sign = set[p] ? 1.0f : -1.0f;
+        int py = p / n, px = p % n;
+        for (auto y = 0; y < n; ++y) {
+            const float* g = &gauss[((y - py) & mask) * n];
+            float* e = &energy[y * n];
+            for (auto x = 0; x < n; ++x)
+                e[x] += sign * g[(x - px) & mask];
+        }
+    };
+    auto tightest_cluster = [&] {
+        int best = -1;
+        for (auto p = 0; p < cells; ++p)
+            if (set[p] && (best < 0 || energy[p] > energy[best]))
+                best = p;
+        return best;
+    };
+    auto largest_void = [&] {
+        int best = -1;
+        for (auto p = 0; p < cells; ++p)
+            if (!set[p] && (best < 0 || energy[p] < energy[best]))
+                best = p;
+        return best;
+    };
+
+    // Seed a tenth of the pixels, then swap clusters into voids until stable
+    uint32_t seed = 0x2545F491u;
+    int ones = 0;
+    while (ones < cells / 10) {
+        seed = seed * 1664525u + 1013904223u;
+        int p = (seed >> 8) % cells;
+        if (!set[p]) {
+            toggle(p);
+            ++ones;
+        }
+    }
+    for (auto i = 0; i < cells; ++i) {
+        int cluster = tightest_cluster();
+        toggle(cluster);
+        int gap = largest_void();
+        toggle(gap);
+        if (gap == cluster)
+            break;
+    }
+
+    std::vector<int> ranks(cells);
+    auto prototype = set;
+    auto prototype_energy = energy;
+
+    // Ranks below the seed: peel off tightest clusters
+    for (auto rank = ones - 1; rank >= 0; --rank) {
+        int cluster = tightest_cluster();
+        toggle(cluster);
+        ranks[cluster] = rank;
+    }
+
+    // Ranks above the seed: fill largest voids
+    set = prototype;
+    energy = prototype_energy;
+    for (auto rank = ones; rank < cells; ++rank) {
+        int gap = largest_void();
+        toggle(gap);
+        ranks[gap] = rank;
+    }
+    return ranks_to_matrix(n, ranks);
+}
+
+static const ThresholdMatrix& threshold_matrix(DitherKernel kernel)
+{
+    static const ThresholdMatrix bayer4 = make_bayer_matrix(4);
+    static const ThresholdMatrix bayer8 = make_bayer_matrix(8);
+    if (kernel == DitherKernel::Bayer4)
+        return bayer4;
+    if (kernel == DitherKernel::Bayer8)
+        return bayer8;
+    if (kernel == DitherKernel::BlueNoise) {
+        static const ThresholdMatrix blue_noise = make_blue_noise_matrix();
+        return blue_noise;
+    }
+    throw std::invalid_argument("Error diffusion kernels are applied with diffuse_error");
+}
+
+void apply_ordered_dither(uint8_t* image, int width, int height, int channels,
+    const std::vector<std::array<uint8_t, 3>>& palette, DitherKernel kernel,
+    uint8_t* indices, DitherScratch* scratch, int threads, ColorMetric metric)
+{
+    if (channels != 3)
+        throw std::invalid_argument("Ordered dithering needs packed RGB pixels");
+
+    auto& matrix = threshold_matrix(kernel);
+    DitherScratch local;
+    auto& buffers = scratch ? *scratch : local;
+
+    // Tile each matrix row out to the image width once so rows can pass it straight in
+    buffers.bias_rows.resize(static_cast<size_t>(matrix.size) * width);
+    for (auto my = 0; my < matrix.size; ++my) {
+        for (auto x = 0; x < width; ++x)
+            buffers.bias_rows[my * width + x] = matrix.bias[my * matrix.size + x % matrix.size];
+    }
+    if (!indices) {
+        buffers.indices.resize(static_cast<size_t>(width) * height);
+        indices = buffers.indices.data();
+    }
+
+    parallel_for(height, threads, [&](int y) {
+        uint8_t* row = &image[y * width * 3];
+        uint8_t* row_indices = &indices[y * width];
+        find_closest_colors_biased(row, &buffers.bias_rows[(y % matrix.size) * width], width, row_indices, palette, metric);
+        for (auto x = 0; x < width; ++x) {
+            auto& color = palette[row_indices[x]];
+            row[x * 3] = color[0];
+            row[x * 3 + 1] = color[1];
+            row[x * 3 + 2] = color[2];
+        }
+    });
 }
@@ -1,8 +1,57 @@
 #pragma once
 #include <stdint.h>
+#include <array>
 #include <vector>
+#include "pallet.h"
 
 extern void apply_dithering(uint8_t* image, int width, int height, int channels, 
     const std::vector<std::array<uint8_t, 3>>& palette);
 
 extern void apply_floyd_steinberg(uint8_t* image, int width, int height);
+
+enum class DitherKernel {
+    FloydSteinberg,     // 7 3 5 1 / 16
+    Atkinson,           // 1/8 to six neighbours over two rows (3/4 of the error is kept)
+    SierraLite,         // 2 1 1 / 4
+    Bayer4,             // ordered, 4x4 Bayer matrix
+    Bayer8,             // ordered, 8x8 Bayer matrix
+    BlueNoise           // ordered, 64x64 void-and-cluster blue noise tile
+};
+
+// Ordered kernels go through apply_ordered_dither, the rest through diffuse_error
+inline bool is_ordered_dither(DitherKernel kernel)
+{
+    return kernel == DitherKernel::Bayer4 || kernel == DitherKernel::Bayer8 || kernel == DitherKernel::BlueNoise;
+}
+
+// Working buffers for diffuse_error and apply_ordered_dither; reuse one to avoid reallocating
+struct DitherScratch {
+    std::vector<int16_t> error_rows;    // rolling per-channel error rows
+    std::vector<int8_t> bias_rows;      // threshold matrix rows tiled to the image width
+    std::vector<uint8_t> indices;       // palette indices when the caller doesn't want them
+};
+
+// Error-diffuse image onto palette with the given kernel, all three channels independently.
+// Errors are carried in 1/16 units in int16 rows, only as many rows as the kernel reaches
+// (two for Floyd-Steinberg and Sierra-lite, three for Atkinson), so memory is O(width)
+// and the image itself is never used as an error store. Pixels are snapped to palette
+// colors through the palette LUT for metric; if indices is non-null the chosen index of
+// every pixel is written there as well.
+// threads > 1 (0 = all cores) runs rows as a diagonal wavefront across threads, each row
+// trailing the one above by four pixels; the output is bit-identical to the serial run.
+// Throws std::invalid_argument for ordered kernels.
+extern void diffuse_error(uint8_t* image, int width, int height, int channels,
+    const std::vector<std::array<uint8_t, 3>>& palette, DitherKernel kernel,
+    uint8_t* indices = nullptr, DitherScratch* scratch = nullptr, int threads = 1,
+    ColorMetric metric = ColorMetric::RGB);
+
+// Ordered-dither packed RGB image (channels must be 3) onto palette. Each pixel gets the
+// threshold at its position in the kernel's matrix, centred on zero and spread over 64
+// levels, added to all three channels before the nearest-palette lookup.
+// No error is carried between pixels, so rows run in parallel on threads threads
+// (0 = all cores), the result doesn't depend on neighbouring content and the bias is
+// fused into the SIMD palette kernels. Indices are written as in diffuse_error.
+extern void apply_ordered_dither(uint8_t* image, int width, int height, int channels,
+    const std::vector<std::array<uint8_t, 3>>& palette, DitherKernel kernel,
+    uint8_t* indices = nullptr, DitherScratch* scratch = nullptr, int threads = 1,
+    ColorMetric metric = ColorMetric::RGB);
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <cctype>
+#include <csetjmp>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <streambuf>
+#include <stdexcept>
+#include <vector>
+
+#include "imagereader.h"
+
+#ifdef USE_LIBPNG
+#include <png.h>
+#endif
+
+// STB headers
+#include "stb_image.h"
+
+// Read-only stream over bytes already in memory, without copying them
+class MemoryStreamBuf : public std::streambuf {
+public:
+    explicit MemoryStreamBuf(std::span<const uint8_t> data)
+    {
+        auto* begin = const_cast<char*>(reinterpret_cast<const char*>(data.data()));
+        setg(begin, begin, begin + data.size());
+    }
+};
+
+// Binary PGM (P5) / PPM (P6) with 8-bit samples, from a file or from memory
+class PnmReader : public ImageReader {
+public:
+    PnmReader(std::unique_ptr<std::streambuf> buffer, int width, int height, bool gray)
+        : buffer(std::move(buffer)), file(this->buffer.get()), gray(gray)
+    {
+        this->width = width;
+        this->height = height;
+        if (gray)
+            samples.resize(width);
+    }
+
+    bool read_row(uint8_t* row) override
+    {
+        if (!gray)
+            return static_cast<bool>(file.read(reinterpret_cast<char*>(row), static_cast<std::streamsize>(width) * 3));
+
+        if (!file.read(reinterpret_cast<char*>(samples.data()), width))
+            return false;
+        for (auto x = 0; x < width; ++x)
+            row[x * 3] = row[x * 3 + 1] = row[x * 3 + 2] = samples[x];
+        return true;
+    }
+
+    // Reads "P5"/"P6" width height maxval; returns null if the file is not a binary 8-bit PNM
+    static std::unique_ptr<ImageReader> open(const std::string& path)
+    {
+        auto buffer = std::make_unique<std::filebuf>();
+        if (!buffer->open(path, std::ios::in | std::ios::binary))
+            return nullptr;
+        return open(std::move(buffer));
+    }
+
+    static std::unique_ptr<ImageReader> open(std::span<const uint8_t> data)
+    {
+        return open(std::make_unique<MemoryStreamBuf>(data));
+    }
+
+private:
+    static std::unique_ptr<ImageReader> open(std::unique_ptr<std::streambuf> buffer)
+    {
+        std::istream file(buffer.get());
+        char magic[2];
+        if (!file.read(magic, 2) || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6'))
+            return nullptr;
+
+        int values[3];
+        for (auto& value : values) {
+            if (!read_header_number(file, value))
+                return nullptr;
+        }
+        if (values[0] <= 0 || values[1] <= 0 || values[2] <= 0 || values[2] > 255)
+            return nullptr;
+        file.get();     // single whitespace before the raster
+
+        // The raster continues from the buffer's read position
+        return std::make_unique<PnmReader>(std::move(buffer), values[0], values[1], magic[1] == '5');
+    }
+
+    static bool read_header_number(std::istream& file, int& value)
+    {
+        int ch = file.get();
+        while (ch != EOF && (std::isspace(ch) || ch == '#')) {
+            if (ch == '#') {
+                while (ch != EOF && ch != '\n')
+                    ch = file.get();
+            }
+            ch = file.get();
+        }
+        if (ch == EOF || !std::isdigit(ch))
+            return false;
+        value = 0;
+        while (ch != EOF && std::isdigit(ch)) {
+            value = value * 10 + (ch - '0');
+            ch = file.get();
+        }
+        file.unget();
+        return true;
+    }
+
+    std::unique_ptr<std::streambuf> buffer;
+    std::istream file;
+    bool gray;
+    std::vector<uint8_t> samples;
+};
+
+#ifdef USE_LIBPNG
+// Non-interlaced PNG through libpng, converted to 8-bit RGB the way stb_image would
+class PngReader : public ImageReader {
+public:
+    ~PngReader() override
+    {
+        png_destroy_read_struct(&png, &info, nullptr);
+        if (file)
+            fclose(file);
+    }
+
+    bool read_row(uint8_t* row) override
+    {
+        if (setjmp(png_jmpbuf(png)))
+            return false;
+        png_read_row(png, row, nullptr);
+        return true;
+    }
+
+    // Returns null if the file is not a PNG or is interlaced (interlaced rows need the whole image)
+    static std::unique_ptr<ImageReader> open(const std::string& path)
+    {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file)
+            return nullptr;
+
+        png_byte signature[8];
+        if (fread(signature, 1, 8, file) != 8 || png_sig_cmp(signature, 0, 8) != 0) {
+            fclose(file);
+            return nullptr;
+        }
+
+        auto reader = std::unique_ptr<PngReader>(new PngReader());
+        reader->file = file;
+        reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        reader->info = reader->png ? png_create_info_struct(reader->png) : nullptr;
+        if (!reader->info)
+            return nullptr;
+        if (setjmp(png_jmpbuf(reader->png)))
+            return nullptr;
+
+        png_init_io(reader->png, file);
+        png_set_sig_bytes(reader->png, 8);
+        png_read_info(reader->png, reader->info);
+        if (png_get_interlace_type(reader->png, reader->info) != PNG_INTERLACE_NONE)
+            return nullptr;
+
+        auto color_type = png_get_color_type(reader->png, reader->info);
+        png_set_strip_16(reader->png);
+        png_set_packing(reader->png);
+        if (color_type == PNG_COLOR_TYPE_PALETTE)
+            png_set_palette_to_rgb(reader->png);
+        if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+            png_set_expand_gray_1_2_4_to_8(reader->png);
+            png_set_gray_to_rgb(reader->png);
+        }
+        png_set_strip_alpha(reader->png);
+        png_read_update_info(reader->png, reader->info);
+
+        reader->width = static_cast<int>(png_get_image_width(reader->png, reader->info));
+        reader->height = static_cast<int>(png_get_image_height(reader->png, reader->info));
+        if (png_get_rowbytes(reader->png, reader->info) != static_cast<size_t>(reader->width) * 3)
+            return nullptr;
+        return reader;
+    }
+
+private:
+    PngReader() = default;
+
+    FILE* file = nullptr;
+    png_structp png = nullptr;
+    png_infop info = nullptr;
+};
+#endif
+
+// Any format stb_image can load, decoded up front
+class StbReader : public ImageReader {
+public:
+    explicit StbReader(const std::string& path)
+    {
+        int channels;
+        pixels = stbi_load(path.c_str(), &width, &height, &channels, 3);
+        if (!pixels) {
+            throw std::runtime_error("Error loading image: " + path + "\n"
+                + "Reason: " + stbi_failure_reason());
+        }
+    }
+
+    StbReader(std::span<const uint8_t> data, const std::string& name)
+    {
+        int channels;
+        pixels = stbi_load_from_memory(data.data(), static_cast<int>(data.size()), &width, &height, &channels, 3);
+        if (!pixels) {
+            throw std::runtime_error("Error loading image: " + name + "\n"
+                + "Reason: " + stbi_failure_reason());
+        }
+    }
+
+    ~StbReader() override { stbi_image_free(pixels); }
+
+    bool read_row(uint8_t* row) override
+    {
+        if (next_row >= height)
+            return false;
+        std::copy_n(&pixels[static_cast<size_t>(next_row) * width * 3], width * 3, row);
+        ++next_row;
+        return true;
+    }
+
+private:
+    uint8_t* pixels = nullptr;
+    int next_row = 0;
+};
+
+std::unique_ptr<ImageReader> open_image_reader(const std::string& path)
+{
+    if (auto reader = PnmReader::open(path))
+        return reader;
+#ifdef USE_LIBPNG
+    if (auto reader = PngReader::open(path))
+        return reader;
+#endif
+    return std::make_unique<StbReader>(path);
+}
+
+std::unique_ptr<ImageReader> open_image_reader(std::span<const uint8_t> data, const std::string& name)
+{
+    if (auto reader = PnmReader::open(data))
+        return reader;
+    return std::make_unique<StbReader>(data, name);
+}
+
+// One frame of an animated GIF; the frames share one decoded buffer
+class GifFrameReader : public ImageReader {
+public:
+    GifFrameReader(std::shared_ptr<uint8_t> frames, int frame, int width, int height) : frames(std::move(frames)), frame(frame)
+    {
+        this->width = width;
+        this->height = height;
+    }
+
+    bool read_row(uint8_t* row) override
+    {
+        if (next_row >= height)
+            return false;
+        size_t frame_size = static_cast<size_t>(width) * height * 3;
+        std::copy_n(&frames.get()[frame * frame_size + static_cast<size_t>(next_row) * width * 3], width * 3, row);
+        ++next_row;
+        return true;
+    }
+
+private:
+    std::shared_ptr<uint8_t> frames;
+    int frame;
+    int next_row = 0;
+};
+
+std::vector<std::unique_ptr<ImageReader>> open_gif_frames(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Error loading image: " + path + "\nReason: cannot open file");
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    int width, height, count, channels;
+    int* delays = nullptr;
+    uint8_t* pixels = stbi_load_gif_from_memory(data.data(), static_cast<int>(data.size()), &delays,
+        &width, &height, &count, &channels, 3);
+    if (!pixels) {
+        throw std::runtime_error("Error loading image: " + path + "\n"
+            + "Reason: " + stbi_failure_reason());
+    }
+    stbi_image_free(delays);
+
+    std::shared_ptr<uint8_t> frames(pixels, stbi_image_free);
+    std::vector<std::unique_ptr<ImageReader>> readers;
+    for (auto frame = 0; frame < count; ++frame)
+        readers.push_back(std::make_unique<GifFrameReader>(frames, frame, width, height));
+    return readers;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <memory>
+#include <span>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Source image delivered one RGB row at a time, top to bottom.
+// Binary PNM (P5/P6) and, when built with libpng, non-interlaced PNG are decoded
+// incrementally; every other format stb_image understands is decoded in one go
+// and then handed out row by row.
+class ImageReader {
+public:
+    virtual ~ImageReader() = default;
+
+    // Copy the next row (width * 3 bytes) into row. Returns false if the data is truncated or corrupt.
+    virtual bool read_row(uint8_t* row) = 0;
+
+    // Why the last read failed
+    virtual std::string error() const { return "corrupt or truncated image data"; }
+
+    int width = 0;
+    int height = 0;
+};
+
+// Open path for row reading; throws std::runtime_error if it cannot be decoded
+extern std::unique_ptr<ImageReader> open_image_reader(const std::string& path);
+
+// Same for an image file already in memory; data must outlive the reader, and name is
+// only used in error messages
+extern std::unique_ptr<ImageReader> open_image_reader(std::span<const uint8_t> data, const std::string& name);
+
+// Every frame of an animated GIF (a still GIF gives one), decoded up front, as one reader
+// per frame. Throws std::runtime_error if path cannot be decoded.
+extern std::vector<std::unique_ptr<ImageReader>> open_gif_frames(const std::string& path);
@@ -1,282 +1,298 @@
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
-#include <vector>
-#include <array>
-#include <algorithm>
-#include <cmath>
+#include <memory>
 #include <string>
-#include <limits>
-#include <fstream>
-#include <sstream>
-#include <iomanip>
+#include <stdexcept>
 
-#include "dither.h"
-#include "pallet.h"
-#include "scale.h"
-#include "blockreducer.h"
 #include "preview.h"
 #include "c64converter.h"
-#include "asmgenerator.h"  // New header for ASM generation
+#include "batch.h"
+#include "sequence.h"
+#include "server.h"
 
-// STB headers
-#include "stb_image.h"
-#include "stb_image_write.h"
-
-const int RGBChannels = 3;
-
-typedef std::array<uint8_t, 3>Color;
-
-Color getpixel(std::vector<uint8_t>& input_buffer, int width, int height, int x, int y)
+static void print_usage(const char* program)
 {
-    auto idx = (y * width + x) * 3;
-    Color color{ input_buffer[idx], input_buffer[idx + 1], input_buffer[idx + 2] };
-    return color;
+    std::cerr << "Usage: " << program << " <input_image> <output_image> [options]\n"
+        << "       " << program << " --batch <input_dir|glob|manifest> <output_dir> [options]\n"
+        << "       " << program << " --sequence <frames.gif|input_dir|glob|manifest> <output_file> [options]\n"
+        << "       " << program << " --serve [--socket PATH] [--threads N] [--max-bytes N]\n"
+        << "Options:\n"
+        << "  --dither       Apply Floyd-Steinberg dithering\n"
+        << "  --dither=K     Error diffusion kernel: floyd, atkinson or sierra-lite\n"
+        << "                 or ordered dither matrix: bayer4, bayer8 or bluenoise\n"
+        << "  --hires        Convert to C64 hires mode\n"
+        << "  --multicolor   Convert to C64 multicolor mode\n"
+        << "  --preview      Show SFML preview window\n"
+        << "  --width N      Set output width\n"
+        << "  --height N     Set output height\n"
+        << "  --scale F      Downscale filter: area (default) or nearest\n"
+        << "  --solver S     Cell color choice: exhaustive (least error, default) or frequency\n"
+        << "  --metric M     Color difference: rgb (default), redmean, lab (CIELAB) or yuv\n"
+        << "  --solver-budget MS\n"
+        << "                 Time limit for the exhaustive solver; cells left over use frequency\n"
+        << "  --background C Multicolor background color 0-15 (default 0), or auto to try all 16\n"
+        << "                 and keep the one with the least error\n"
+        << "  --asm          Generate 6502 assembly file\n"
+        << "  --prg          Write one runnable PRG (loader, bitmap and colors): LOAD, then RUN\n"
+        << "  --pack         With --asm: write one compressed PRG that the loader depacks\n"
+        << "                 With --prg: compress the data inside the runnable PRG\n"
+        << "  --koala        Also write a Koala Painter (.kla) file (multicolor only)\n"
+        << "  --archive FILE Store every output file in one tar archive instead\n"
+        << "  --cache DIR    Keep conversions in DIR; unchanged inputs with the same options\n"
+        << "                 are not converted again\n"
+        << "  --tolerance N  In sequence mode: cells whose pixels changed by at most N (0-255, default 0)\n"
+        << "                 per channel since the last frame keep their conversion\n"
+        << "  --stats        Print where the time went, stage by stage; in batch and sequence mode\n"
+        << "                 p50/p95/p99/max per stage over all images\n"
+        << "  --stats=json   The same as one line of JSON, printed last\n"
+        << "  --trace FILE   Record every stage, per image and per thread, as a Chrome trace\n"
+        << "                 (open in chrome://tracing or ui.perfetto.dev)\n"
+        << "  --threads N    Worker threads for color reduction (0 = all cores)\n"
+        << "                 In batch mode: images converted at once (default all cores)\n"
+        << "                 In server mode: requests converted at once (default all cores)\n"
+        << "Server mode reads requests \"<id> <input> <output> [options]\" from stdin (or PATH,\n"
+        << "a Unix domain socket) and answers on stdout; see server.h for the protocol.\n"
+        << "--max-bytes caps the image a request may send inline (default 64 MiB).\n"
+        << "Example: " << program << " input.png output.png --dither --multicolor --asm" << std::endl;
 }
 
-void setpixel(std::vector<uint8_t>& output_buffer, int width, int height, int x, int y, Color color)
+// --trace: a recorder for options to record into, or none
+static std::unique_ptr<TraceRecorder> start_trace(ConvertOptions& options)
 {
-    int idx = (y * width + x) * 3;
-    output_buffer[idx + 0] = color[0];
-    output_buffer[idx + 1] = color[1];
-    output_buffer[idx + 2] = color[2];
+    if (options.trace_path.empty())
+        return nullptr;
+    auto trace = std::make_unique<TraceRecorder>();
+    options.trace = trace.get();
+    return trace;
 }
 
-
-void copy_multi_color_bitmap(
-    std::vector<uint8_t>& input_buffer, int input_width, int input_height,
-    std::vector<uint8_t>& output_buffer, int output_width, int output_height)
+// Write the recorded trace, if any; false (after printing why) if it cannot be written
+static bool finish_trace(const TraceRecorder* trace, const std::string& path)
 {
-
-    for (int y = 0; y < input_height; ++y) {
-        for (int x = 0; x < input_width; ++x) {
-            Color color = getpixel(input_buffer, input_width, input_height, x, y); // lookup from bitmap/ram
-
-            setpixel(output_buffer, output_width, output_height, 2 * x + 0, y, color); // double-width
-            setpixel(output_buffer, output_width, output_height, 2 * x + 1, y, color);
-        }
+    if (!trace)
+        return true;
+    try {
+        trace->write_file(path);
     }
-}
-
-// Function to generate ASM filename based on output path
-std::string get_filename(const std::string& output_path, const std::string& ext)
-{
-    size_t last_dot = output_path.find_last_of(".");
-    if (last_dot == std::string::npos) {
-        return output_path + ext;
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return false;
     }
-    return output_path.substr(0, last_dot) + ext;
+    // stderr: with --stats=json the stats must stay the last line on stdout
+    std::cerr << "Trace written to: " << path << std::endl;
+    return true;
 }
 
-int main(int argc, char** argv)
+static int run_batch_mode(int argc, char** argv)
 {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <input_image> <output_image> [options]\n"
-            << "Options:\n"
-            << "  --dither       Apply Floyd-Steinberg dithering\n"
-            << "  --hires        Convert to C64 hires mode\n"
-            << "  --multicolor   Convert to C64 multicolor mode\n"
-            << "  --preview      Show SFML preview window\n"
-            << "  --width N      Set output width\n"
-            << "  --height N     Set output height\n"
-            << "  --asm          Generate 6502 assembly file\n"
-            << "Example: " << argv[0] << " input.png output.png --dither --multicolor --asm" << std::endl;
+    if (argc < 4) {
+        print_usage(argv[0]);
         return 1;
     }
 
-    bool use_dithering = false, use_hires = false, use_multicolor = false;
-    bool preview = false, generate_asm = false;
-
-    int output_width = 320;
-    int output_height = 200;
-    
-    // Parse command line arguments
-    auto skipArg = false;
-    for (auto arg = 3; arg < argc; ++arg) {
-        if (skipArg) {
-            skipArg = false;
-            continue;
-        }
+    ConvertOptions options;
+    options.threads = 0;
+    if (!parse_convert_options(argc, argv, 4, options))
+        return 1;
+    if (options.preview) {
+        std::cerr << "Preview is not available in batch mode" << std::endl;
+        return 1;
+    }
 
-        std::string arg_str = argv[arg];
-        if (arg_str == "--dither") {
-            use_dithering = true;
-        }
-        else if (arg_str == "--hires") {
-            use_hires = true;
-        }
-        else if (arg_str == "--multicolor") {
-            use_multicolor = true;
-        }
-        else if (arg_str == "--preview") {
-            preview = true;
-        }
-        else if (arg_str == "--asm") {
-            generate_asm = true;
-        }
-        else if (arg_str == "--width") {
-            if (arg + 1 < argc) {
-                output_width = std::stoi(argv[arg + 1]);
-                skipArg = true;
-            }
-            else {
-                std::cerr << "No value specified for width" << std::endl;
-                return 1;
-            }
-        }
-        else if (arg_str == "--height") {
-            if (arg + 1 < argc) {
-                output_height = std::stoi(argv[arg + 1]);
-                skipArg = true;
-            }
-            else {
-                std::cerr << "No value specified for height" << std::endl;
-                return 1;
-            }
-        }
-        else {
-            std::cerr << "Unknown argument: " << arg_str << std::endl;
-            return 1;
+    // One memo of cell solves for every worker, so tiles repeated across images are solved once
+    CellColorCache cell_cache;
+    options.cell_cache = &cell_cache;
+
+    std::vector<BatchJob> jobs;
+    std::unique_ptr<ArtifactWriter> archive;
+    try {
+        jobs = collect_batch_jobs(argv[2], argv[3]);
+        if (!options.archive_path.empty()) {
+            archive = open_archive_writer(options.archive_path);
+            options.artifact_writer = archive.get();
         }
     }
-
-    // Validate mode selection
-    if (use_hires && use_multicolor) {
-        std::cerr << "Cannot specify both multicolor and hires" << std::endl;
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
         return 1;
     }
-    if (!use_hires && !use_multicolor) {
-        std::cerr << "Must specify either --hires or --multicolor" << std::endl;
+
+    auto trace = start_trace(options);
+    std::vector<ConversionStats> stats;
+    auto started = std::chrono::steady_clock::now();
+    auto failures = run_batch(jobs, options, options.stats != StatsFormat::None ? &stats : nullptr);
+    auto wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    try {
+        if (archive)
+            archive->finish();
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
         return 1;
     }
 
-    // Load input image
-    int width, height, channels;
-    uint8_t* image = stbi_load(argv[1], &width, &height, &channels, RGBChannels);
-    if (!image) {
-        std::cerr << "Error loading image: " << argv[1] << "\n"
-            << "Reason: " << stbi_failure_reason() << std::endl;
+    std::cout << "Converted " << jobs.size() - failures.size() << " of " << jobs.size() << " images" << std::endl;
+    if (options.stats != StatsFormat::None)
+        print_stats_summary(stats, wall_ms, options.stats, std::cout);
+    if (!finish_trace(trace.get(), options.trace_path))
+        return 1;
+    if (!failures.empty()) {
+        std::cerr << failures.size() << " failed:\n";
+        for (auto& failure : failures)
+            std::cerr << "  " << failure.input_path << ": " << failure.reason << "\n";
+        std::cerr << std::flush;
         return 1;
     }
+    return 0;
+}
 
-    // Calculate target dimensions maintaining aspect ratio
-    int target_width, target_height;
-    float aspect = static_cast<float>(width) / height;
-
-    if (aspect > (static_cast<float>(output_width) / output_height)) {
-        target_width = output_width;
-        target_height = static_cast<int>(output_width / aspect);
+static int run_sequence_mode(int argc, char** argv)
+{
+    if (argc < 4) {
+        print_usage(argv[0]);
+        return 1;
     }
-    else {
-        target_height = output_height;
-        target_width = static_cast<int>(output_height * aspect);
+
+    ConvertOptions options;
+    if (!parse_convert_options(argc, argv, 4, options))
+        return 1;
+    if (options.preview) {
+        std::cerr << "Preview is not available in sequence mode" << std::endl;
+        return 1;
     }
 
-    // Scale image down
-    std::vector<uint8_t> scaled_image(target_width * target_height * 3);
+    CellColorCache cell_cache;
+    options.cell_cache = &cell_cache;
 
-    if (use_multicolor) {
-        auto multi_color_width = target_width / 2;
-        std::vector<uint8_t> multi_color_scaled_image(multi_color_width * target_height * 3);
-        scale_to_c64(image, width, height, multi_color_scaled_image.data(), multi_color_width, target_height, 3);
-        scale_to_c64(multi_color_scaled_image.data(), multi_color_width, target_height, scaled_image.data(), target_width, target_height, 3);
+    auto trace = start_trace(options);
+    SequenceResult result;
+    std::unique_ptr<ArtifactWriter> archive;
+    try {
+        if (!options.archive_path.empty()) {
+            archive = open_archive_writer(options.archive_path);
+            options.artifact_writer = archive.get();
+        }
+        result = convert_sequence(argv[2], argv[3], options, std::cout);
+        if (archive)
+            archive->finish();
     }
-    else {
-        scale_to_c64(image, width, height, scaled_image.data(), target_width, target_height, 3);
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
 
-    // Apply color conversion
-    if (use_hires) {
-        convert_to_c64_hires(scaled_image.data(), target_width, target_height);
-    }
-    else if (use_multicolor) {
-        convert_to_c64_multicolor(scaled_image.data(), target_width, target_height);
-    }
+    std::cout << "Converted " << result.frames << " frames into " << result.delta_bytes << " delta bytes";
+    if (result.cells > 0)
+        std::cout << "; " << result.reused_cells << " of " << result.cells << " cells reused after the first frame";
+    std::cout << std::endl;
+    if (options.stats != StatsFormat::None)
+        print_stats_summary(result.frame_stats, result.milliseconds, options.stats, std::cout);
+    return finish_trace(trace.get(), options.trace_path) ? 0 : 1;
+}
 
-    // Apply dithering if requested
-    if (use_dithering) {
-        apply_floyd_steinberg(scaled_image.data(), target_width, target_height);
-    }
-    else {
-        // Simple color quantization
-        for (size_t i = 0; i < scaled_image.size(); i += 3) {
-            uint8_t palette_idx = find_closest_color(&scaled_image[i], c64_palette);
-            scaled_image[i] = c64_palette[palette_idx][0];
-            scaled_image[i + 1] = c64_palette[palette_idx][1];
-            scaled_image[i + 2] = c64_palette[palette_idx][2];
+static int run_server_mode(int argc, char** argv)
+{
+    std::string socket_path;
+    int threads = 0;
+    size_t max_input_bytes = default_max_input_bytes;
+    for (auto arg = 2; arg < argc; ++arg) {
+        std::string arg_str = argv[arg];
+        if (arg_str == "--socket" && arg + 1 < argc) {
+            socket_path = argv[++arg];
+        }
+        else if (arg_str == "--threads" || arg_str == "--max-bytes") {
+            std::string value_str = (arg + 1 < argc) ? argv[++arg] : "";
+            char* end = nullptr;
+            long long value = std::strtoll(value_str.c_str(), &end, 10);
+            if (value_str.empty() || *end != '\0' || value < 0 || (arg_str == "--threads" && value > 1024)) {
+                std::cerr << (arg_str == "--threads" ? "Threads must be 0-1024" : "Max bytes must be a byte count")
+                    << std::endl;
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (arg_str == "--threads")
+                threads = static_cast<int>(value);
+            else
+                max_input_bytes = static_cast<size_t>(value);
+        }
+        else {
+            print_usage(argv[0]);
+            return 1;
         }
     }
 
-    // Generate ASM if requested
-    if (generate_asm) {
-        std::string asm_code = generate_6502_asm(argv[2]);
-        std::string asm_filename = get_filename(argv[2], ".asm");
-        std::ofstream asm_file(asm_filename);
-        if (asm_file) {
-            asm_file << asm_code;
-            std::cout << "Assembly code generated: " << asm_filename << std::endl;
-
-            C64ImageData c64_data = convert_to_c64_memory(scaled_image.data(), target_width, target_height, use_multicolor);
-            std::string bitmap_filename = get_filename(argv[2], "image") + ".prg";
-            std::ofstream bitmap_file(bitmap_filename, std::ios::binary);
-
-            std::string color_filename = get_filename(argv[2], "color") + ".prg";
-            std::ofstream color_file(color_filename, std::ios::binary);
-
-            std::cout << "bitmap generated: " << bitmap_filename << std::endl;
-            std::cout << "color generated: " << color_filename << std::endl;
-
-            generate_6502_image(c64_data, bitmap_file, color_file);
+    try {
+        if (socket_path.empty()) {
+            // stdout carries the responses, so nothing else may print there
+            std::ios::sync_with_stdio(false);
+            std::cin.tie(nullptr);
+            serve_stream(std::cin, std::cout, threads, max_input_bytes);
         }
         else {
-            std::cerr << "Failed to create ASM file: " << asm_filename << std::endl;
+            std::cerr << "Listening on " << socket_path << std::endl;
+            serve_unix_socket(socket_path, threads, max_input_bytes);
         }
     }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
 
-    // Save output image
-    std::string output_path = argv[2];
-    std::string extension = output_path.substr(output_path.find_last_of(".") + 1);
+int main(int argc, char** argv)
+{
+    if (argc >= 2 && std::string(argv[1]) == "--batch")
+        return run_batch_mode(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "--sequence")
+        return run_sequence_mode(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "--serve")
+        return run_server_mode(argc, argv);
 
-    bool save_result = false;
-    if (extension == "png") {
-        save_result = stbi_write_png(output_path.c_str(), target_width, target_height, RGBChannels,
-            scaled_image.data(), target_width * RGBChannels);
-    }
-    else if (extension == "jpg" || extension == "jpeg") {
-        save_result = stbi_write_jpg(output_path.c_str(), target_width, target_height, RGBChannels,
-            scaled_image.data(), 90);
-    }
-    else if (extension == "bmp") {
-        save_result = stbi_write_bmp(output_path.c_str(), target_width, target_height, RGBChannels,
-            scaled_image.data());
-    }
-    else {
-        std::cerr << "Unsupported output format. Using PNG." << std::endl;
-        output_path += ".png";
-        save_result = stbi_write_png(output_path.c_str(), target_width, target_height, RGBChannels,
-            scaled_image.data(), target_width * RGBChannels);
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
     }
 
-    if (!save_result) {
-        std::cerr << "Failed to save output image" << std::endl;
+    ConvertOptions options;
+    if (!parse_convert_options(argc, argv, 3, options))
+        return 1;
+
+    CellColorCache cell_cache;
+    options.cell_cache = &cell_cache;
+
+    auto trace = start_trace(options);
+    ConvertResult result;
+    std::unique_ptr<ArtifactWriter> archive;
+    try {
+        if (!options.archive_path.empty()) {
+            archive = open_archive_writer(options.archive_path);
+            options.artifact_writer = archive.get();
+        }
+        result = convert_image(argv[1], argv[2], options, std::cout);
+        if (archive)
+            archive->finish();
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
 
     // Show preview if enabled
-    if (preview) {
+    if (options.preview) {
 #ifdef USE_SFML
-        show_preview(scaled_image.data(), target_width, target_height);
+        show_preview(result.image.data(), result.width, result.height);
 #else
         std::cerr << "Preview not available - SFML support not compiled in" << std::endl;
 #endif
     }
 
-    // Cleanup
-    stbi_image_free(image);
-
-    if (save_result) {
-        std::cout << "Successfully converted image to " << target_width << "x" << target_height
-            << " with C64 colors.\nSaved to: " << output_path << std::endl;
-        return 0;
-    }
-    else {
+    std::cout << "Successfully converted image to " << result.width << "x" << result.height
+        << " with C64 colors.\nSaved to: " << result.output_path << std::endl;
+    if (options.stats != StatsFormat::None)
+        print_stats(result.stats, options.stats, std::cout);
+    if (!finish_trace(trace.get(), options.trace_path))
         return 1;
-    }
-}
\ No newline at end of file
+    return 0;
+}
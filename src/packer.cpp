@@ -0,0 +1,168 @@
+#include <algorithm>
+
+#include "packer.h"
+
+static const int max_literals = 0x7F;
+static const int min_match = 4;         // a match costs 3 bytes, so shorter ones never pay
+static const int max_match = 0x7F;
+static const int hash_bits = 12;
+static const int max_chain = 128;       // candidates tried per position
+
+struct Match {
+    int length = 0;
+    int offset = 0;
+};
+
+// Hash chains over 3-byte prefixes; positions must be inserted in order
+class MatchFinder {
+public:
+    explicit MatchFinder(std::span<const uint8_t> data)
+        : data(data), size(static_cast<int>(data.size())), head(1 << hash_bits, -1), prev(data.size(), -1)
+    {
+    }
+
+    // Insert every position before pos
+    void advance_to(int pos)
+    {
+        for (; inserted < pos && inserted + 2 < size; ++inserted) {
+            auto h = hash(inserted);
+            prev[inserted] = head[h];
+            head[h] = inserted;
+        }
+        inserted = std::max(inserted, pos);
+    }
+
+    // Longest earlier occurrence of the bytes at pos (nearest on ties), or length 0
+    Match find(int pos)
+    {
+        Match best;
+        int limit = std::min(max_match, size - pos);
+        if (limit < min_match)
+            return best;
+
+        advance_to(pos);
+        auto chain = 0;
+        for (auto candidate = head[hash(pos)]; candidate >= 0 && chain < max_chain; candidate = prev[candidate], ++chain) {
+            if (data[candidate + best.length] != data[pos + best.length])
+                continue;
+            auto length = 0;
+            while (length < limit && data[candidate + length] == data[pos + length])
+                ++length;
+            if (length > best.length) {
+                best = { length, pos - candidate };
+                if (length == limit)
+                    break;
+            }
+        }
+        if (best.length < min_match)
+            best = Match();
+        return best;
+    }
+
+private:
+    int hash(int pos) const
+    {
+        uint32_t key = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+        return static_cast<int>((key * 2654435761u) >> (32 - hash_bits));
+    }
+
+    std::span<const uint8_t> data;
+    int size;
+    int inserted = 0;
+    std::vector<int> head;
+    std::vector<int> prev;
+};
+
+static void emit_literals(std::span<const uint8_t> data, int begin, int end, std::vector<uint8_t>& packed)
+{
+    while (begin < end) {
+        auto count = std::min(end - begin, max_literals);
+        packed.push_back(static_cast<uint8_t>(count));
+        packed.insert(packed.end(), data.begin() + begin, data.begin() + begin + count);
+        begin += count;
+    }
+}
+
+void pack_stream(std::span<const uint8_t> data, uint16_t address, std::vector<uint8_t>& packed)
+{
+    packed.push_back(static_cast<uint8_t>(address & 0xFF));
+    packed.push_back(static_cast<uint8_t>(address >> 8));
+
+    MatchFinder finder(data);
+    auto size = static_cast<int>(data.size());
+    auto literal_start = 0;
+    auto pos = 0;
+    while (pos < size) {
+        auto match = finder.find(pos);
+        // Lazy matching: a literal first is better if the next position matches further
+        if (match.length == 0 || (match.length < max_match && finder.find(pos + 1).length > match.length)) {
+            ++pos;
+            continue;
+        }
+
+        emit_literals(data, literal_start, pos, packed);
+        uint16_t offset = static_cast<uint16_t>(-match.offset);
+        packed.push_back(static_cast<uint8_t>(0x80 | match.length));
+        packed.push_back(static_cast<uint8_t>(offset & 0xFF));
+        packed.push_back(static_cast<uint8_t>(offset >> 8));
+        pos += match.length;
+        literal_start = pos;
+    }
+    emit_literals(data, literal_start, size, packed);
+    packed.push_back(0);
+}
+
+void end_packed_streams(std::vector<uint8_t>& packed)
+{
+    packed.push_back(0);
+    packed.push_back(0);
+}
+
+bool unpack_streams(std::span<const uint8_t> packed, std::span<uint8_t> memory)
+{
+    size_t in = 0;
+    auto next = [&](int& value) {
+        if (in >= packed.size())
+            return false;
+        value = packed[in++];
+        return true;
+    };
+
+    for (;;) {
+        int low, high;
+        if (!next(low) || !next(high))
+            return false;
+        if (high == 0)
+            return true;
+
+        size_t out = low | (high << 8);
+        for (;;) {
+            int token;
+            if (!next(token))
+                return false;
+            if (token == 0)
+                break;
+
+            auto count = token & 0x7F;
+            if (out + count > memory.size())
+                return false;
+            if (token < 0x80) {
+                if (in + count > packed.size())
+                    return false;
+                std::copy_n(packed.begin() + in, count, memory.begin() + out);
+                in += count;
+            }
+            else {
+                int offset_low, offset_high;
+                if (!next(offset_low) || !next(offset_high))
+                    return false;
+                size_t offset = 0x10000 - (offset_low | (offset_high << 8));
+                if (offset > out)
+                    return false;
+                for (auto i = 0; i < count; ++i)
+                    memory[out + i] = memory[out - offset + i];
+            }
+            out += count;
+        }
+    }
+}
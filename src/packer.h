@@ -0,0 +1,27 @@
+#pragma once
+#include <span>
+#include <stdint.h>
+#include <vector>
+
+// LZ packer for C64 memory images, with a format small enough to depack from the
+// generated loader. A packed file is a list of streams, each
+//
+//   address (2 bytes, little endian)   where the stream's data goes; 0 ends the list
+//   tokens:
+//     $01-$7F   that many literal bytes follow
+//     $84-$FF   copy (token & $7F) bytes starting offset bytes back in the output,
+//               offset follows as a 16-bit little-endian negative number; the copy
+//               runs forward a byte at a time, so it may overlap what it writes
+//     $00       end of stream
+//
+// Matches never reach outside their own stream.
+
+// Append data as one stream depacking to address
+extern void pack_stream(std::span<const uint8_t> data, uint16_t address, std::vector<uint8_t>& packed);
+
+// Append the end of the stream list
+extern void end_packed_streams(std::vector<uint8_t>& packed);
+
+// Host-side depacker, same as the 6502 one: writes every stream into memory (64K).
+// Returns false if packed is truncated or malformed.
+extern bool unpack_streams(std::span<const uint8_t> packed, std::span<uint8_t> memory);
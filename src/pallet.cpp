@@ -1,6 +1,10 @@
+#include <algorithm>
 #include <limits>
 #include <cmath>
 #include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
 #include "pallet.h"
 #include <string>
 
@@ -53,22 +57,464 @@ float color_distance(const uint8_t* color1, int index)
     return std::sqrt(r_diff * r_diff + g_diff * g_diff + b_diff * b_diff);
 }
 
-// Find closest C64 palette color
-uint8_t find_closest_color(const uint8_t* color, const std::vector<std::array<uint8_t, 3>>& pallette) {
+// CIELAB f(t) on [0, 1] at lab_steps + 1 points, interpolated between them
+static const int lab_steps = 4096;
+
+static std::vector<float> make_lab_f_table()
+{
+    std::vector<float> table(lab_steps + 1);
+    for (auto i = 0; i <= lab_steps; ++i) {
+        double t = static_cast<double>(i) / lab_steps;
+        table[i] = static_cast<float>(t > 216.0 / 24389.0 ? std::cbrt(t) : (24389.0 / 27.0 * t + 16.0) / 116.0);
+    }
+    return table;
+}
+
+static inline float lab_f(float t)
+{
+    static const std::vector<float> table = make_lab_f_table();
+    float position = std::clamp(t, 0.0f, 1.0f) * lab_steps;
+    int i = std::min(static_cast<int>(position), lab_steps - 1);
+    return table[i] + (table[i + 1] - table[i]) * (position - i);
+}
+
+// sRGB component to linear light
+static std::array<float, 256> make_linear_table()
+{
+    std::array<float, 256> table;
+    for (auto i = 0; i < 256; ++i) {
+        double c = i / 255.0;
+        table[i] = static_cast<float>(c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+    }
+    return table;
+}
+
+// Nearest integer, halves away from zero, without a library call
+static inline int32_t round_coord(float value)
+{
+    return value >= 0 ? static_cast<int32_t>(value + 0.5f) : -static_cast<int32_t>(0.5f - value);
+}
+
+static const std::array<float, 256>& linear_light()
+{
+    static const std::array<float, 256> table = make_linear_table();
+    return table;
+}
+
+// CIE XYZ relative to the D65 white
+static std::array<float, 3> lab_xyz(const uint8_t* color)
+{
+    auto& linear = linear_light();
+    float r = linear[color[0]], g = linear[color[1]], b = linear[color[2]];
+    return { (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / 0.95047f,
+        0.2126729f * r + 0.7151522f * g + 0.0721750f * b,
+        (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / 1.08883f };
+}
+
+// Slope of the exact CIELAB f at t; it only falls as t grows
+static double lab_f_slope(double t)
+{
+    if (t <= 216.0 / 24389.0)
+        return 24389.0 / 27.0 / 116.0;
+    double root = std::cbrt(t);
+    return 1 / (3 * root * root);
+}
+
+std::array<int32_t, 3> metric_coords(const uint8_t* color, ColorMetric metric)
+{
+    switch (metric) {
+    case ColorMetric::Lab: {
+        auto xyz = lab_xyz(color);
+        float fx = lab_f(xyz[0]), fy = lab_f(xyz[1]), fz = lab_f(xyz[2]);
+        return { round_coord(8 * (116 * fy - 16)),
+            round_coord(8 * 500 * (fx - fy)),
+            round_coord(8 * 200 * (fy - fz)) };
+    }
+    case ColorMetric::YUV: {
+        float y = 0.299f * color[0] + 0.587f * color[1] + 0.114f * color[2];
+        return { round_coord(8 * y),
+            round_coord(4 * 0.492f * (color[2] - y)),
+            round_coord(4 * 0.877f * (color[0] - y)) };
+    }
+    default:
+        return { color[0], color[1], color[2] };
+    }
+}
+
+// Find closest palette color by scanning every entry.
+// For RGB, squared integer distances order the same way as the sqrt'd float distances
+// in color_distance, so ties and results match the original scan exactly.
+uint8_t find_closest_color_exact(const uint8_t* color, const std::vector<std::array<uint8_t, 3>>& pallette,
+    ColorMetric metric)
+{
+    if (metric != ColorMetric::RGB) {
+        auto wanted = metric_coords(color, metric);
+        uint8_t closest = 0;
+        uint32_t min_dist = std::numeric_limits<uint32_t>::max();
+        for (uint8_t i = 0; i < pallette.size(); ++i) {
+            auto entry = metric_coords(pallette[i].data(), metric);
+            uint32_t dist = metric_distance(wanted.data(), entry.data(), metric);
+            if (dist < min_dist) {
+                min_dist = dist;
+                closest = i;
+            }
+        }
+        return closest;
+    }
+
     uint8_t closest = 0;
-    float min_dist = std::numeric_limits<float>::max();
-    
+    int min_dist = std::numeric_limits<int>::max();
+
     for (uint8_t i = 0; i < pallette.size(); ++i) {
-        float dist = color_distance(color, pallette[i].data());
+        int r_diff = color[0] - pallette[i][0];
+        int g_diff = color[1] - pallette[i][1];
+        int b_diff = color[2] - pallette[i][2];
+        int dist = r_diff * r_diff + g_diff * g_diff + b_diff * b_diff;
         if (dist < min_dist) {
             min_dist = dist;
             closest = i;
         }
     }
-    
+
     return closest;
 }
 
+// Nearest entry of coords to wanted under metric; ties go to the lowest index
+static uint8_t closest_coords(const std::array<int32_t, 3>& wanted, const std::vector<std::array<int32_t, 3>>& coords,
+    ColorMetric metric)
+{
+    uint8_t closest = 0;
+    uint32_t min_dist = std::numeric_limits<uint32_t>::max();
+    for (size_t i = 0; i < coords.size(); ++i) {
+        uint32_t dist = metric_distance(wanted.data(), coords[i].data(), metric);
+        if (dist < min_dist) {
+            min_dist = dist;
+            closest = static_cast<uint8_t>(i);
+        }
+    }
+    return closest;
+}
+
+uint8_t PaletteLut::refine(const uint8_t* color) const
+{
+    if (metric == ColorMetric::RGB)
+        return find_closest_color_exact(color, palette);
+    return closest_coords(metric_coords(color, metric), coords, metric);
+}
+
+// How metric_coords moves over the box of colors from lo to hi under Lab and YUV: the
+// unrounded coordinates at lo, how far each component moves, and the rate at which each
+// coordinate follows each component (per linear light unit for Lab) as the middle and half
+// width of the rates it can take
+struct CoordChange {
+    double base[3];
+    double range[3];
+    double rate[3][3];          // [component][coordinate]
+    double rate_spread[3][3];
+};
+
+static CoordChange coord_change(const uint8_t* lo, const uint8_t* hi, ColorMetric metric)
+{
+    CoordChange change;
+    if (metric == ColorMetric::YUV) {
+        const double rates[3][3] = { { 8 * 0.299, 8 * 0.587, 8 * 0.114 },
+            { 4 * 0.492 * -0.299, 4 * 0.492 * -0.587, 4 * 0.492 * 0.886 },
+            { 4 * 0.877 * 0.701, 4 * 0.877 * -0.587, 4 * 0.877 * -0.114 } };
+        for (auto axis = 0; axis < 3; ++axis) {
+            change.base[axis] = rates[axis][0] * lo[0] + rates[axis][1] * lo[1] + rates[axis][2] * lo[2];
+            for (auto c = 0; c < 3; ++c) {
+                change.rate[c][axis] = rates[axis][c];
+                change.rate_spread[c][axis] = 0;
+            }
+        }
+        for (auto c = 0; c < 3; ++c)
+            change.range[c] = hi[c] - lo[c];
+        return change;
+    }
+
+    // L, a and b scale f(Y), f(X) - f(Y) and f(Y) - f(Z), and X, Y and Z are linear in linear
+    // light. f's table moves between its points at the exact f's slope somewhere in that
+    // step, up to rounding, so over the box each f's slope lies between the exact slopes a
+    // step below the lowest and above the highest X, Y or Z.
+    const double weights[3][3] = { { 0.4124564 / 0.95047, 0.3575761 / 0.95047, 0.1804375 / 0.95047 },
+        { 0.2126729, 0.7151522, 0.0721750 },
+        { 0.0193339 / 1.08883, 0.1191920 / 1.08883, 0.9503041 / 1.08883 } };
+    auto& linear = linear_light();
+    auto low = lab_xyz(lo), high = lab_xyz(hi);
+    double f[3], steepest[3], flattest[3];
+    for (auto i = 0; i < 3; ++i) {
+        double end = high[i] + 1.0 / lab_steps;
+        f[i] = lab_f(low[i]);
+        steepest[i] = lab_f_slope(low[i] - 1.0 / lab_steps) + 0.001;
+        flattest[i] = end >= 1 ? 0 : std::max(0.0, lab_f_slope(end) - 0.001);
+    }
+    change.base[0] = 8 * (116 * f[1] - 16);
+    change.base[1] = 8 * 500 * (f[0] - f[1]);
+    change.base[2] = 8 * 200 * (f[1] - f[2]);
+    for (auto c = 0; c < 3; ++c) {
+        change.range[c] = linear[hi[c]] - linear[lo[c]];
+        double least[3] = { 8 * 116 * flattest[1] * weights[1][c],
+            8 * 500 * (flattest[0] * weights[0][c] - steepest[1] * weights[1][c]),
+            8 * 200 * (flattest[1] * weights[1][c] - steepest[2] * weights[2][c]) };
+        double most[3] = { 8 * 116 * steepest[1] * weights[1][c],
+            8 * 500 * (steepest[0] * weights[0][c] - flattest[1] * weights[1][c]),
+            8 * 200 * (steepest[1] * weights[1][c] - flattest[2] * weights[2][c]) };
+        for (auto axis = 0; axis < 3; ++axis) {
+            change.rate[c][axis] = (least[axis] + most[axis]) / 2;
+            change.rate_spread[c][axis] = (most[axis] - least[axis]) / 2;
+        }
+    }
+    return change;
+}
+
+// One palette entry, other, set against another, winner, in metric coordinates. Under a
+// Euclidean metric the difference of their squared distances from c is linear in c: c is at
+// least as close to winner as to other while 2 c.direction <= limit.
+struct Rival {
+    int direction[3];       // other - winner
+    int64_t limit;          // |other|^2 - |winner|^2
+    bool wins_ties;         // other has the lower index
+};
+
+static Rival make_rival(const std::array<int32_t, 3>& winner, const std::array<int32_t, 3>& other, bool wins_ties)
+{
+    Rival rival{ {}, 0, wins_ties };
+    for (auto axis = 0; axis < 3; ++axis) {
+        rival.direction[axis] = other[axis] - winner[axis];
+        rival.limit += static_cast<int64_t>(other[axis]) * other[axis] - static_cast<int64_t>(winner[axis]) * winner[axis];
+    }
+    return rival;
+}
+
+// Whether every color in the box of change is at least as close to the winner as to the
+// rival, and closer if ties go to the rival. Rounding moves each coordinate up to half a
+// unit from its value, plus a little float error.
+static bool beats(const CoordChange& change, const Rival& rival)
+{
+    auto& direction = rival.direction;
+    double most = 0;
+    for (auto axis = 0; axis < 3; ++axis)
+        most += direction[axis] * change.base[axis] + std::abs(direction[axis]) * (0.5 + 1.0 / 16);
+    for (auto c = 0; c < 3; ++c) {
+        double rate = 0;
+        for (auto axis = 0; axis < 3; ++axis)
+            rate += direction[axis] * change.rate[c][axis] + std::abs(direction[axis]) * change.rate_spread[c][axis];
+        most += change.range[c] * std::max(0.0, rate);
+    }
+    auto twice = 2 * static_cast<int64_t>(std::floor(most));
+    return rival.wins_ties ? twice < rival.limit : twice <= rival.limit;
+}
+
+// Least and greatest redmean distance from entry to any color in the box from lo to hi.
+// Its coordinates are RGB itself, but its weights follow the pair's mean red.
+static void redmean_distance_bounds(const uint8_t* lo, const uint8_t* hi, const std::array<int32_t, 3>& entry,
+    uint32_t& nearest, uint32_t& farthest)
+{
+    int near_sq[3], far_sq[3];
+    for (auto axis = 0; axis < 3; ++axis) {
+        int low = lo[axis] - entry[axis];
+        int high = hi[axis] - entry[axis];
+        near_sq[axis] = low > 0 ? low * low : high < 0 ? high * high : 0;
+        far_sq[axis] = std::max(low * low, high * high);
+    }
+    int low_mean = (lo[0] + entry[0]) >> 1;
+    int high_mean = (hi[0] + entry[0]) >> 1;
+    nearest = static_cast<uint32_t>((((512 + low_mean) * near_sq[0]) >> 8) + 4 * near_sq[1]
+        + (((767 - high_mean) * near_sq[2]) >> 8));
+    farthest = static_cast<uint32_t>((((512 + high_mean) * far_sq[0]) >> 8) + 4 * far_sq[1]
+        + (((767 - low_mean) * far_sq[2]) >> 8));
+}
+
+// The exact match of every color in the box from lo to hi, or lut_refine if that cannot be
+// shown: the match at lo has to beat every other entry over the whole box. rivals holds
+// every ordered pair of entries, winner-major.
+static uint8_t box_closest(const PaletteLut& lut, const std::vector<Rival>& rivals, const uint8_t* lo, const uint8_t* hi)
+{
+    const auto palette_size = lut.coords.size();
+    auto winner = closest_coords(metric_coords(lo, lut.metric), lut.coords, lut.metric);
+    if (lut.metric == ColorMetric::Redmean) {
+        uint32_t nearest, farthest, winner_farthest;
+        redmean_distance_bounds(lo, hi, lut.coords[winner], nearest, winner_farthest);
+        for (size_t i = 0; i < palette_size; ++i) {
+            redmean_distance_bounds(lo, hi, lut.coords[i], nearest, farthest);
+            if (i != winner && !(i < winner ? winner_farthest < nearest : winner_farthest <= nearest))
+                return PaletteLut::lut_refine;
+        }
+        return winner;
+    }
+    auto change = coord_change(lo, hi, lut.metric);
+    for (size_t i = 0; i < palette_size; ++i) {
+        if (i != winner && !beats(change, rivals[winner * palette_size + i]))
+            return PaletteLut::lut_refine;
+    }
+    return winner;
+}
+
+// Fill the cells of the box of size colors a side from lo: all at once where one entry is
+// proven for the whole box, else by halving it down to single cells
+static void fill_metric_box(PaletteLut& lut, const std::vector<Rival>& rivals, const uint8_t* lo, int size)
+{
+    const int cells_per_axis = 1 << PaletteLut::bits;
+    const int cell_size = 1 << PaletteLut::shift;
+
+    uint8_t hi[3] = { static_cast<uint8_t>(lo[0] + size - 1), static_cast<uint8_t>(lo[1] + size - 1),
+        static_cast<uint8_t>(lo[2] + size - 1) };
+    auto index = box_closest(lut, rivals, lo, hi);
+    if (index != PaletteLut::lut_refine || size == cell_size) {
+        for (auto r = lo[0] / cell_size; r <= hi[0] / cell_size; ++r) {
+            for (auto g = lo[1] / cell_size; g <= hi[1] / cell_size; ++g) {
+                for (auto b = lo[2] / cell_size; b <= hi[2] / cell_size; ++b)
+                    lut.cells[(r * cells_per_axis + g) * cells_per_axis + b] = index;
+            }
+        }
+        return;
+    }
+
+    auto half = size / 2;
+    for (auto part = 0; part < 8; ++part) {
+        uint8_t part_lo[3] = { static_cast<uint8_t>(lo[0] + (part >> 2) * half),
+            static_cast<uint8_t>(lo[1] + ((part >> 1) & 1) * half), static_cast<uint8_t>(lo[2] + (part & 1) * half) };
+        fill_metric_box(lut, rivals, part_lo, half);
+    }
+}
+
+// Cell table for the metrics other than RGB
+static void fill_metric_cells(PaletteLut& lut)
+{
+    std::vector<Rival> rivals;
+    for (size_t winner = 0; winner < lut.coords.size(); ++winner) {
+        for (size_t other = 0; other < lut.coords.size(); ++other)
+            rivals.push_back(make_rival(lut.coords[winner], lut.coords[other], other < winner));
+    }
+
+    // Larger boxes than this rarely lie inside one region
+    const int box_size = 16;
+    for (auto r = 0; r < 256; r += box_size) {
+        for (auto g = 0; g < 256; g += box_size) {
+            for (auto b = 0; b < 256; b += box_size) {
+                uint8_t lo[3] = { static_cast<uint8_t>(r), static_cast<uint8_t>(g), static_cast<uint8_t>(b) };
+                fill_metric_box(lut, rivals, lo, box_size);
+            }
+        }
+    }
+}
+
+PaletteLut build_palette_lut(const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric)
+{
+    const int cells_per_axis = 1 << PaletteLut::bits;
+    const int corners_per_axis = cells_per_axis + 1;
+
+    PaletteLut lut;
+    lut.palette = palette;
+    lut.metric = metric;
+    for (auto& entry : palette)
+        lut.coords.push_back(metric_coords(entry.data(), metric));
+    lut.cells.resize(cells_per_axis * cells_per_axis * cells_per_axis, PaletteLut::lut_refine);
+    if (palette.empty() || palette.size() >= PaletteLut::lut_refine)
+        return lut;
+    if (metric != ColorMetric::RGB) {
+        fill_metric_cells(lut);
+        return lut;
+    }
+
+    // Nearest index on the lattice of cell corners. Neighbouring cells share corners;
+    // the top corner (256) lies just outside RGB space, which only makes the test stricter.
+    std::vector<int> corner_values(corners_per_axis);
+    for (auto i = 0; i < corners_per_axis; ++i)
+        corner_values[i] = i << PaletteLut::shift;
+
+    // Per-entry red/green partial distances are hoisted out of the blue loop
+    const int palette_size = static_cast<int>(palette.size());
+    std::vector<uint8_t> corners(corners_per_axis * corners_per_axis * corners_per_axis);
+    std::vector<int> rg_dist(palette_size);
+    for (auto r = 0; r < corners_per_axis; ++r) {
+        for (auto g = 0; g < corners_per_axis; ++g) {
+            for (auto i = 0; i < palette_size; ++i) {
+                int r_diff = corner_values[r] - palette[i][0];
+                int g_diff = corner_values[g] - palette[i][1];
+                rg_dist[i] = r_diff * r_diff + g_diff * g_diff;
+            }
+            for (auto b = 0; b < corners_per_axis; ++b) {
+                uint8_t closest = 0;
+                int min_dist = std::numeric_limits<int>::max();
+                for (auto i = 0; i < palette_size; ++i) {
+                    int b_diff = corner_values[b] - palette[i][2];
+                    int dist = rg_dist[i] + b_diff * b_diff;
+                    if (dist < min_dist) {
+                        min_dist = dist;
+                        closest = static_cast<uint8_t>(i);
+                    }
+                }
+                corners[(r * corners_per_axis + g) * corners_per_axis + b] = closest;
+            }
+        }
+    }
+
+    // Palette regions are convex, so a cell whose 8 corners agree is entirely inside one region
+    for (auto r = 0; r < cells_per_axis; ++r) {
+        for (auto g = 0; g < cells_per_axis; ++g) {
+            for (auto b = 0; b < cells_per_axis; ++b) {
+                auto first = corners[(r * corners_per_axis + g) * corners_per_axis + b];
+                auto uniform = true;
+                for (auto corner = 1; corner < 8 && uniform; ++corner) {
+                    auto cr = r + ((corner >> 2) & 1);
+                    auto cg = g + ((corner >> 1) & 1);
+                    auto cb = b + (corner & 1);
+                    uniform = corners[(cr * corners_per_axis + cg) * corners_per_axis + cb] == first;
+                }
+                if (uniform)
+                    lut.cells[(r * cells_per_axis + g) * cells_per_axis + b] = first;
+            }
+        }
+    }
+
+    return lut;
+}
+
+// The C64 palette's tables, each built the first time its metric is asked for
+static const PaletteLut& c64_palette_lut(ColorMetric metric)
+{
+    switch (metric) {
+    case ColorMetric::Redmean: {
+        static const PaletteLut lut = build_palette_lut(c64_palette, ColorMetric::Redmean);
+        return lut;
+    }
+    case ColorMetric::Lab: {
+        static const PaletteLut lut = build_palette_lut(c64_palette, ColorMetric::Lab);
+        return lut;
+    }
+    case ColorMetric::YUV: {
+        static const PaletteLut lut = build_palette_lut(c64_palette, ColorMetric::YUV);
+        return lut;
+    }
+    default: {
+        static const PaletteLut lut = build_palette_lut(c64_palette, ColorMetric::RGB);
+        return lut;
+    }
+    }
+}
+
+const PaletteLut& get_palette_lut(const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric)
+{
+    if (&palette == &c64_palette || palette == c64_palette)
+        return c64_palette_lut(metric);
+
+    static std::mutex lut_mutex;
+    static std::map<std::pair<std::vector<std::array<uint8_t, 3>>, ColorMetric>, std::unique_ptr<PaletteLut>> luts;
+
+    std::lock_guard<std::mutex> lock(lut_mutex);
+    auto& lut = luts[{ palette, metric }];
+    if (!lut)
+        lut = std::make_unique<PaletteLut>(build_palette_lut(palette, metric));
+    return *lut;
+}
+
+// Find closest C64 palette color
+uint8_t find_closest_color(const uint8_t* color, const std::vector<std::array<uint8_t, 3>>& pallette, ColorMetric metric)
+{
+    return get_palette_lut(pallette, metric).lookup(color);
+}
+
 uint8_t find_color_index(const uint8_t* color, const std::vector<std::array<uint8_t, 3>>& pallette)
 {
     for (uint8_t i = 0; i < pallette.size(); ++i) {
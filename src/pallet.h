@@ -11,9 +11,95 @@ extern float color_distance(const uint8_t* color1, const uint8_t* color2);
 extern uint8_t find_color_index(const uint8_t* color, const std::vector<std::array<uint8_t, 3>>& pallette);
 extern float color_distance(const uint8_t* color1, int index);
 
+// Squared Euclidean distance; orders colors the same way as color_distance without the sqrt
+inline int color_distance_squared(const uint8_t* color1, const uint8_t* color2)
+{
+    int r_diff = color1[0] - color2[0];
+    int g_diff = color1[1] - color2[1];
+    int b_diff = color1[2] - color2[2];
+    return r_diff * r_diff + g_diff * g_diff + b_diff * b_diff;
+}
+
+// How color differences are measured wherever a nearest or least-error color is chosen
+enum class ColorMetric {
+    RGB,        // Euclidean RGB
+    Redmean,    // RGB with red and blue weighted by the pair's mean red
+    Lab,        // Euclidean CIELAB (CIE76, D65 white)
+    YUV         // Euclidean YUV with luma counted double
+};
+
+// Color in the metric's space, fixed point: RGB itself for RGB and redmean, 8 units per
+// CIELAB unit, 4 per YUV unit (8 for luma)
+extern std::array<int32_t, 3> metric_coords(const uint8_t* color, ColorMetric metric);
+
+// Squared difference of two colors given as metric_coords. Every metric is Euclidean in its
+// coordinates except redmean, whose weights depend on the pair. Values stay below 2^23, so
+// sums over a 64-pixel cell fit in 32 bits.
+inline uint32_t metric_distance(const int32_t* a, const int32_t* b, ColorMetric metric)
+{
+    int d0 = a[0] - b[0];
+    int d1 = a[1] - b[1];
+    int d2 = a[2] - b[2];
+    if (metric == ColorMetric::Redmean) {
+        int red_mean = (a[0] + b[0]) >> 1;
+        return static_cast<uint32_t>((((512 + red_mean) * d0 * d0) >> 8) + 4 * d1 * d1 + (((767 - red_mean) * d2 * d2) >> 8));
+    }
+    return static_cast<uint32_t>(d0 * d0 + d1 * d1 + d2 * d2);
+}
+
+// Quantized RGB -> nearest palette index table for one metric.
+// Each cell covers a (1 << (8 - bits))^3 box of RGB space. Cells that lie entirely
+// inside one palette entry's region store that index; cells straddling a decision
+// boundary store lut_refine and are resolved with an exact scan, so lookups always
+// match find_closest_color_exact.
+// RGB regions are convex, so agreeing cell corners prove a cell uniform. Under the other
+// metrics a cell's entry has to beat every other one by more than the distances can
+// change across the cell, rounding of the fixed-point coordinates included.
+struct PaletteLut {
+    static constexpr int bits = 6;
+    static constexpr int shift = 8 - bits;
+    static constexpr uint8_t lut_refine = 0xFF;
+
+    std::vector<std::array<uint8_t, 3>> palette;
+    ColorMetric metric = ColorMetric::RGB;
+    std::vector<std::array<int32_t, 3>> coords;     // metric_coords of every palette entry
+    std::vector<uint8_t> cells;
+
+    uint8_t lookup(const uint8_t* color) const
+    {
+        auto cell = ((color[0] >> shift) << (2 * bits)) | ((color[1] >> shift) << bits) | (color[2] >> shift);
+        auto index = cells[cell];
+        return (index != lut_refine) ? index : refine(color);
+    }
+
+    uint8_t refine(const uint8_t* color) const;
+};
+
+extern PaletteLut build_palette_lut(const std::vector<std::array<uint8_t, 3>>& palette,
+    ColorMetric metric = ColorMetric::RGB);
+
+// Lookup table for a palette and metric, built on first use and shared afterwards
+extern const PaletteLut& get_palette_lut(const std::vector<std::array<uint8_t, 3>>& palette,
+    ColorMetric metric = ColorMetric::RGB);
+
+// Find closest palette color by scanning every entry
+extern uint8_t find_closest_color_exact(const uint8_t* color,
+    const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric = ColorMetric::RGB);
+
 // Find closest C64 palette color
 extern uint8_t find_closest_color(const uint8_t* color, 
-    const std::vector<std::array<uint8_t, 3>>& palette);
+    const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric = ColorMetric::RGB);
+
+// Find closest palette color for each of count packed RGB pixels.
+// Uses AVX2/SSE4.1 kernels for RGB when the CPU supports them; other metrics go through
+// their lookup table.
+extern void find_closest_colors(const uint8_t* colors, int count, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric = ColorMetric::RGB);
+
+// find_closest_colors on colors with bias[i] added to all three channels of pixel i
+// (clamped to 0..255), fused into the same kernels; used by ordered dithering.
+extern void find_closest_colors_biased(const uint8_t* colors, const int8_t* bias, int count, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric = ColorMetric::RGB);
 
 enum C64Color {
     C64_BLACK, C64_WHITE, C64_RED, C64_CYAN,
@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <vector>
+#include "pallet.h"
+#include "simd.h"
+
+// Palette entries the vector kernels keep resident; larger palettes use the scalar path
+static const int simd_max_palette = 16;
+
+// Kernels take an optional per-pixel bias added to all three channels (clamped to 0..255)
+// before the search; ordered dithering passes its threshold row here.
+static void closest_colors_scalar(const uint8_t* colors, const int8_t* bias, int count, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric = ColorMetric::RGB)
+{
+    auto& lut = get_palette_lut(palette, metric);
+    if (!bias) {
+        for (auto i = 0; i < count; ++i)
+            indices[i] = lut.lookup(&colors[i * 3]);
+        return;
+    }
+    for (auto i = 0; i < count; ++i) {
+        uint8_t biased[3];
+        for (auto c = 0; c < 3; ++c)
+            biased[c] = static_cast<uint8_t>(std::clamp(colors[i * 3 + c] + bias[i], 0, 255));
+        indices[i] = lut.lookup(biased);
+    }
+}
+
+#ifdef SIMD_X86
+
+// Split 8 packed RGB pixels (24 bytes) into 8 red, green and blue bytes
+TARGET_SSE41 static inline void deinterleave_8(const uint8_t* colors, __m128i& r, __m128i& g, __m128i& b)
+{
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(colors));
+    __m128i hi = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(colors + 16));
+
+    r = _mm_or_si128(
+        _mm_shuffle_epi8(lo, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1)));
+    g = _mm_or_si128(
+        _mm_shuffle_epi8(lo, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, -1, -1, -1, -1, -1, -1, -1, -1)));
+    b = _mm_or_si128(
+        _mm_shuffle_epi8(lo, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+}
+
+// Squared distances in 32-bit lanes; strict compare keeps the lowest index on ties like the scalar scan
+TARGET_SSE41 static inline __m128i closest_4_sse41(__m128i r, __m128i g, __m128i b,
+    const __m128i* pr, const __m128i* pg, const __m128i* pb, int palette_size)
+{
+    __m128i best = _mm_set1_epi32(std::numeric_limits<int>::max());
+    __m128i best_idx = _mm_setzero_si128();
+    for (auto i = 0; i < palette_size; ++i) {
+        __m128i dr = _mm_sub_epi32(r, pr[i]);
+        __m128i dg = _mm_sub_epi32(g, pg[i]);
+        __m128i db = _mm_sub_epi32(b, pb[i]);
+        __m128i dist = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg)), _mm_mullo_epi32(db, db));
+        __m128i closer = _mm_cmpgt_epi32(best, dist);
+        best = _mm_min_epi32(best, dist);
+        best_idx = _mm_blendv_epi8(best_idx, _mm_set1_epi32(i), closer);
+    }
+    return best_idx;
+}
+
+TARGET_SSE41 static void closest_colors_sse41(const uint8_t* colors, const int8_t* bias, int count, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette)
+{
+    const int palette_size = static_cast<int>(palette.size());
+    __m128i pr[simd_max_palette], pg[simd_max_palette], pb[simd_max_palette];
+    for (auto i = 0; i < palette_size; ++i) {
+        pr[i] = _mm_set1_epi32(palette[i][0]);
+        pg[i] = _mm_set1_epi32(palette[i][1]);
+        pb[i] = _mm_set1_epi32(palette[i][2]);
+    }
+
+    const __m128i pack = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max_value = _mm_set1_epi32(255);
+    auto x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m128i r, g, b;
+        deinterleave_8(&colors[x * 3], r, g, b);
+        __m128i o = bias ? _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&bias[x])) : zero;
+
+        for (auto half = 0; half < 2; ++half) {
+            __m128i r32 = _mm_cvtepu8_epi32(r);
+            __m128i g32 = _mm_cvtepu8_epi32(g);
+            __m128i b32 = _mm_cvtepu8_epi32(b);
+            if (bias) {
+                __m128i o32 = _mm_cvtepi8_epi32(o);
+                r32 = _mm_min_epi32(_mm_max_epi32(_mm_add_epi32(r32, o32), zero), max_value);
+                g32 = _mm_min_epi32(_mm_max_epi32(_mm_add_epi32(g32, o32), zero), max_value);
+                b32 = _mm_min_epi32(_mm_max_epi32(_mm_add_epi32(b32, o32), zero), max_value);
+                o = _mm_srli_si128(o, 4);
+            }
+            __m128i idx = closest_4_sse41(r32, g32, b32, pr, pg, pb, palette_size);
+            int packed = _mm_cvtsi128_si32(_mm_shuffle_epi8(idx, pack));
+            std::memcpy(&indices[x + half * 4], &packed, 4);
+            r = _mm_srli_si128(r, 4);
+            g = _mm_srli_si128(g, 4);
+            b = _mm_srli_si128(b, 4);
+        }
+    }
+    closest_colors_scalar(&colors[x * 3], bias ? &bias[x] : nullptr, count - x, &indices[x], palette);
+}
+
+TARGET_AVX2 static void closest_colors_avx2(const uint8_t* colors, const int8_t* bias, int count, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette)
+{
+    const int palette_size = static_cast<int>(palette.size());
+    __m256i pr[simd_max_palette], pg[simd_max_palette], pb[simd_max_palette];
+    for (auto i = 0; i < palette_size; ++i) {
+        pr[i] = _mm256_set1_epi32(palette[i][0]);
+        pg[i] = _mm256_set1_epi32(palette[i][1]);
+        pb[i] = _mm256_set1_epi32(palette[i][2]);
+    }
+
+    const __m256i pack = _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    auto x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m128i r8, g8, b8;
+        deinterleave_8(&colors[x * 3], r8, g8, b8);
+        __m256i r = _mm256_cvtepu8_epi32(r8);
+        __m256i g = _mm256_cvtepu8_epi32(g8);
+        __m256i b = _mm256_cvtepu8_epi32(b8);
+        if (bias) {
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i max_value = _mm256_set1_epi32(255);
+            __m256i o = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&bias[x])));
+            r = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(r, o), zero), max_value);
+            g = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(g, o), zero), max_value);
+            b = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(b, o), zero), max_value);
+        }
+
+        __m256i best = _mm256_set1_epi32(std::numeric_limits<int>::max());
+        __m256i best_idx = _mm256_setzero_si256();
+        for (auto i = 0; i < palette_size; ++i) {
+            __m256i dr = _mm256_sub_epi32(r, pr[i]);
+            __m256i dg = _mm256_sub_epi32(g, pg[i]);
+            __m256i db = _mm256_sub_epi32(b, pb[i]);
+            __m256i dist = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)),
+                _mm256_mullo_epi32(db, db));
+            __m256i closer = _mm256_cmpgt_epi32(best, dist);
+            best = _mm256_min_epi32(best, dist);
+            best_idx = _mm256_blendv_epi8(best_idx, _mm256_set1_epi32(i), closer);
+        }
+
+        __m256i packed = _mm256_shuffle_epi8(best_idx, pack);
+        int lo = _mm256_cvtsi256_si32(packed);
+        int hi = _mm256_extract_epi32(packed, 4);
+        std::memcpy(&indices[x], &lo, 4);
+        std::memcpy(&indices[x + 4], &hi, 4);
+    }
+    closest_colors_scalar(&colors[x * 3], bias ? &bias[x] : nullptr, count - x, &indices[x], palette);
+}
+
+static SimdLevel detect_simd_level()
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SimdLevel::SSE41;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool sse41 = (info[2] & (1 << 19)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (osxsave && max_leaf >= 7) {
+        bool ymm_enabled = (_xgetbv(0) & 0x6) == 0x6;
+        __cpuidex(info, 7, 0);
+        if (ymm_enabled && (info[1] & (1 << 5)))
+            return SimdLevel::AVX2;
+    }
+    if (sse41)
+        return SimdLevel::SSE41;
+#endif
+    return SimdLevel::Scalar;
+}
+
+#endif
+
+SimdLevel cpu_simd_level()
+{
+#ifdef SIMD_X86
+    static const SimdLevel level = detect_simd_level();
+    return level;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+static void closest_colors(const uint8_t* colors, const int8_t* bias, int count, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric)
+{
+#ifdef SIMD_X86
+    // The vector kernels measure RGB distance; other metrics always use their table
+    const SimdLevel level = cpu_simd_level();
+    if (metric == ColorMetric::RGB && palette.size() <= simd_max_palette) {
+        if (level == SimdLevel::AVX2) {
+            closest_colors_avx2(colors, bias, count, indices, palette);
+            return;
+        }
+        if (level == SimdLevel::SSE41) {
+            closest_colors_sse41(colors, bias, count, indices, palette);
+            return;
+        }
+    }
+#endif
+    closest_colors_scalar(colors, bias, count, indices, palette, metric);
+}
+
+// Find closest palette color for a run of packed RGB pixels
+void find_closest_colors(const uint8_t* colors, int count, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric)
+{
+    closest_colors(colors, nullptr, count, indices, palette, metric);
+}
+
+// Same, after adding bias[i] to every channel of pixel i
+void find_closest_colors_biased(const uint8_t* colors, const int8_t* bias, int count, uint8_t* indices,
+    const std::vector<std::array<uint8_t, 3>>& palette, ColorMetric metric)
+{
+    closest_colors(colors, bias, count, indices, palette, metric);
+}
@@ -1,3 +1,5 @@
+#include <iostream>
+#include <vector>
 #include "preview.h"
 
 #ifdef USE_SFML
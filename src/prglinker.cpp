@@ -0,0 +1,263 @@
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include "prglinker.h"
+
+static const uint16_t basic_start = 0x0801;
+
+// 10 SYS 2061, then the end-of-program link
+static const uint8_t basic_stub[] = { 0x0B, 0x08, 10, 0, 0x9E, '2', '0', '6', '1', 0, 0, 0 };
+static_assert(basic_start + sizeof(basic_stub) == runnable_start_address, "SYS must jump right after the stub");
+
+// Zero page used by the loader (free while BASIC is not running)
+static const uint8_t zp_src = 0xFB;
+static const uint8_t zp_dst = 0xFD;
+static const uint8_t zp_ref = 0xF7;
+
+// 6502 opcodes the loader uses
+enum Opcode : uint8_t {
+    ADC_ZP = 0x65, AND_IMM = 0x29, BCC = 0x90, BEQ = 0xF0, BMI = 0x30, BNE = 0xD0, CLC = 0x18,
+    CMP_IMM = 0xC9, CPY_IMM = 0xC0, DEC_ZP = 0xC6, DEX = 0xCA, DEY = 0x88, INC_ZP = 0xE6,
+    INY = 0xC8, JMP_ABS = 0x4C, JSR_ABS = 0x20, LDA_ABS = 0xAD, LDA_IMM = 0xA9, LDA_IND_Y = 0xB1,
+    LDA_ZP = 0xA5, LDX_IMM = 0xA2, LDY_IMM = 0xA0, ORA_IMM = 0x09, RTS = 0x60, STA_ABS = 0x8D,
+    STA_IND_Y = 0x91, STA_ZP = 0x85, TAX = 0xAA, TYA = 0x98,
+};
+
+// Two-pass machine code emitter: the first pass records where labels land (forward
+// references read as the current address), the second emits with every address known.
+// The code is the same length in both passes, so pass one's labels stay valid.
+class Emitter {
+public:
+    Emitter(uint16_t origin, const std::map<std::string, uint16_t>& labels, bool final_pass)
+        : origin(origin), labels(labels), final_pass(final_pass)
+    {
+    }
+
+    uint16_t here() const { return static_cast<uint16_t>(origin + code.size()); }
+    void mark(const std::string& name) { labels[name] = here(); }
+
+    uint16_t address(const std::string& name) const
+    {
+        auto it = labels.find(name);
+        if (it != labels.end())
+            return it->second;
+        if (final_pass)
+            throw std::logic_error("Undefined label " + name);
+        return here();
+    }
+
+    void op(Opcode opcode) { code.push_back(opcode); }
+
+    void op(Opcode opcode, uint8_t operand)
+    {
+        code.push_back(opcode);
+        code.push_back(operand);
+    }
+
+    void op16(Opcode opcode, uint16_t operand)
+    {
+        code.push_back(opcode);
+        code.push_back(static_cast<uint8_t>(operand & 0xFF));
+        code.push_back(static_cast<uint8_t>(operand >> 8));
+    }
+
+    void op16(Opcode opcode, const std::string& label) { op16(opcode, address(label)); }
+
+    void branch(Opcode opcode, const std::string& label)
+    {
+        int offset = address(label) - (here() + 2);
+        if (final_pass && (offset < -128 || offset > 127))
+            throw std::logic_error("Branch to " + label + " out of range");
+        op(opcode, static_cast<uint8_t>(final_pass ? offset : 0));
+    }
+
+    // Point a zero page pointer at address
+    void set_pointer(uint8_t zp, uint16_t value)
+    {
+        op(LDA_IMM, static_cast<uint8_t>(value & 0xFF));
+        op(STA_ZP, zp);
+        op(LDA_IMM, static_cast<uint8_t>(value >> 8));
+        op(STA_ZP, static_cast<uint8_t>(zp + 1));
+    }
+
+    uint16_t origin;
+    std::vector<uint8_t> code;
+    std::map<std::string, uint16_t> labels;
+    bool final_pass;
+};
+
+// Copy pages whole 256-byte pages from source to destination, last byte first, so the
+// destination may overlap the source from above. Reads and writes whole pages, so up to
+// 255 bytes past the data are copied too.
+static void emit_copy(Emitter& e, uint16_t source, uint16_t destination, int pages)
+{
+    e.set_pointer(zp_src, static_cast<uint16_t>(source + (pages - 1) * 256));
+    e.set_pointer(zp_dst, static_cast<uint16_t>(destination + (pages - 1) * 256));
+    e.op(LDX_IMM, static_cast<uint8_t>(pages));
+    e.op16(JSR_ABS, "COPY");
+}
+
+static void emit_copy_routine(Emitter& e)
+{
+    e.mark("COPY");
+    e.op(LDY_IMM, 0);
+    e.mark("COPYBYTE");
+    e.op(DEY);
+    e.op(LDA_IND_Y, zp_src);
+    e.op(STA_IND_Y, zp_dst);
+    e.op(CPY_IMM, 0);
+    e.branch(BNE, "COPYBYTE");
+    e.op(DEC_ZP, zp_src + 1);
+    e.op(DEC_ZP, zp_dst + 1);
+    e.op(DEX);
+    e.branch(BNE, "COPYBYTE");
+    e.op(RTS);
+}
+
+// Same depacker as the loader from generate_6502_asm(packed = true); see packer.h
+static void emit_depacker(Emitter& e)
+{
+    e.set_pointer(zp_src, packed_load_address);
+    e.mark("DSTREAM");
+    e.op16(JSR_ABS, "GETBYTE");
+    e.op(STA_ZP, zp_dst);
+    e.op16(JSR_ABS, "GETBYTE");
+    e.branch(BEQ, "DDONE");
+    e.op(STA_ZP, zp_dst + 1);
+    e.mark("DTOKEN");
+    e.op16(JSR_ABS, "GETBYTE");
+    e.branch(BEQ, "DSTREAM");
+    e.branch(BMI, "DMATCH");
+    e.op(TAX);
+    e.mark("DLIT");
+    e.op(LDA_IND_Y, zp_src);
+    e.op(STA_IND_Y, zp_dst);
+    e.op(INY);
+    e.op(DEX);
+    e.branch(BNE, "DLIT");
+    e.op(TYA);
+    e.op(CLC);
+    e.op(ADC_ZP, zp_src);
+    e.op(STA_ZP, zp_src);
+    e.branch(BCC, "DADVANCE");
+    e.op(INC_ZP, zp_src + 1);
+    e.op16(JMP_ABS, "DADVANCE");
+    e.mark("DMATCH");
+    e.op(AND_IMM, 0x7F);
+    e.op(TAX);
+    e.op16(JSR_ABS, "GETBYTE");
+    e.op(STA_ZP, zp_ref);
+    e.op16(JSR_ABS, "GETBYTE");
+    e.op(STA_ZP, zp_ref + 1);
+    e.op(LDA_ZP, zp_ref);
+    e.op(CLC);
+    e.op(ADC_ZP, zp_dst);
+    e.op(STA_ZP, zp_ref);
+    e.op(LDA_ZP, zp_ref + 1);
+    e.op(ADC_ZP, zp_dst + 1);
+    e.op(STA_ZP, zp_ref + 1);
+    e.mark("DCOPY");
+    e.op(LDA_IND_Y, zp_ref);
+    e.op(STA_IND_Y, zp_dst);
+    e.op(INY);
+    e.op(DEX);
+    e.branch(BNE, "DCOPY");
+    e.mark("DADVANCE");
+    e.op(TYA);
+    e.op(CLC);
+    e.op(ADC_ZP, zp_dst);
+    e.op(STA_ZP, zp_dst);
+    e.branch(BCC, "DTOKEN");
+    e.op(INC_ZP, zp_dst + 1);
+    e.op16(JMP_ABS, "DTOKEN");
+
+    e.mark("GETBYTE");
+    e.op(LDY_IMM, 0);
+    e.op(LDA_IND_Y, zp_src);
+    e.op(INC_ZP, zp_src);
+    e.branch(BNE, "GETBYTE1");
+    e.op(INC_ZP, zp_src + 1);
+    e.mark("GETBYTE1");
+    e.op(CMP_IMM, 0);
+    e.op(RTS);
+    e.mark("DDONE");
+}
+
+static void emit_loader(Emitter& e, const C64ImageData& img, bool packed, size_t data_size)
+{
+    auto data = e.address("DATA");
+    auto pages = [](size_t bytes) { return static_cast<int>((bytes + 255) / 256); };
+
+    if (packed) {
+        emit_copy(e, data, packed_load_address, pages(data_size));
+        emit_depacker(e);
+    }
+    else {
+        // Data holds screen RAM, color RAM (multicolor), then the bitmap, which moves up to
+        // $2000 over its own tail; the other two go well clear of the data
+        uint16_t source = data;
+        emit_copy(e, source, screen_load_address, pages(img.screen_ram.size()));
+        source = static_cast<uint16_t>(source + img.screen_ram.size());
+        if (img.multicolor) {
+            emit_copy(e, source, color_ram_load_address, pages(img.color_ram.size()));
+            source = static_cast<uint16_t>(source + img.color_ram.size());
+        }
+        emit_copy(e, source, bitmap_load_address, pages(img.bitmap_data.size()));
+    }
+
+    // Show the picture only once it is in place
+    e.op16(LDA_ABS, 0xD018);
+    e.op(ORA_IMM, 0x08);
+    e.op16(STA_ABS, 0xD018);
+    e.op16(LDA_ABS, 0xD011);
+    e.op(ORA_IMM, 0x20);
+    e.op16(STA_ABS, 0xD011);
+    if (img.multicolor) {
+        e.op16(LDA_ABS, 0xD016);
+        e.op(ORA_IMM, 0x10);
+        e.op16(STA_ABS, 0xD016);
+        e.op(LDA_IMM, static_cast<uint8_t>(img.background & 0x0F));
+        e.op16(STA_ABS, 0xD021);
+    }
+    e.mark("FOREVER");
+    e.op16(JMP_ABS, "FOREVER");
+
+    emit_copy_routine(e);
+    e.mark("DATA");
+}
+
+std::vector<uint8_t> make_runnable_prg(const C64ImageData& img, bool packed)
+{
+    std::vector<uint8_t> data;
+    if (packed) {
+        auto streams = make_packed_prg(img);
+        data.assign(streams.begin() + 2, streams.end());
+    }
+    else {
+        data.reserve(img.screen_ram.size() + img.color_ram.size() + img.bitmap_data.size());
+        data.insert(data.end(), img.screen_ram.begin(), img.screen_ram.end());
+        if (img.multicolor)
+            data.insert(data.end(), img.color_ram.begin(), img.color_ram.end());
+        data.insert(data.end(), img.bitmap_data.begin(), img.bitmap_data.end());
+    }
+
+    Emitter first(runnable_start_address, {}, false);
+    emit_loader(first, img, packed, data.size());
+    Emitter second(runnable_start_address, first.labels, true);
+    emit_loader(second, img, packed, data.size());
+
+    // Raw data has to end by the bitmap's destination end, so the bitmap moves up onto its
+    // own tail; packed data has to end below packed_load_address, where it is moved to
+    auto data_end = second.here() + data.size();
+    auto limit = packed ? packed_load_address : bitmap_load_address + img.bitmap_data.size();
+    if (data_end > limit)
+        throw std::runtime_error("Image data too large for a runnable PRG");
+
+    std::vector<uint8_t> program(std::begin(basic_stub), std::end(basic_stub));
+    program.reserve(program.size() + second.code.size() + data.size());
+    program.insert(program.end(), second.code.begin(), second.code.end());
+    program.insert(program.end(), data.begin(), data.end());
+    return make_prg(basic_start, program);
+}
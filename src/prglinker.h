@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include "asmgenerator.h"
+
+// Address the BASIC stub's SYS jumps to (right after the one-line program at $0801)
+const uint16_t runnable_start_address = 0x080D;
+
+// One ready-to-run PRG for LOAD "NAME",8 and RUN: a 10 SYS 2061 BASIC line at $0801, machine
+// code that moves the screen data into place and switches the VIC to bitmap mode, then the
+// data itself. With packed, the data is make_packed_prg's streams, relocated to
+// packed_load_address and depacked there; otherwise the raw screen RAM, color RAM and bitmap.
+// The code is emitted directly, no assembler needed.
+extern std::vector<uint8_t> make_runnable_prg(const C64ImageData& img, bool packed = false);
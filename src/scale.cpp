@@ -18,3 +18,125 @@ void scale_to_c64(const uint8_t* input, int in_width, int in_height,
         }
     }
 }
+
+StreamingScaler::StreamingScaler(int in_width, int in_height, int out_width, int out_height, int channels,
+    uint8_t* output, ScaleFilter filter)
+{
+    reset(in_width, in_height, out_width, out_height, channels, output, filter);
+}
+
+void StreamingScaler::reset(int in_width, int in_height, int out_width, int out_height, int channels,
+    uint8_t* output, ScaleFilter filter)
+{
+    this->in_width = in_width;
+    this->in_height = in_height;
+    this->out_width = out_width;
+    this->out_height = out_height;
+    this->channels = channels;
+    this->output = output;
+    this->filter = filter;
+    src_y = 0;
+    out_y = 0;
+
+    if (filter != ScaleFilter::Area || out_width <= 0 || out_height <= 0)
+        return;
+
+    // Work in units of 1 / (in_width * out_width): source column x spans [x * out_width, (x + 1) * out_width)
+    // and output column ox spans [ox * in_width, (ox + 1) * in_width), so overlaps are exact integers.
+    tap_start.resize(out_width + 1);
+    taps.clear();
+    for (auto ox = 0; ox < out_width; ++ox) {
+        tap_start[ox] = static_cast<int>(taps.size());
+        long long o0 = static_cast<long long>(ox) * in_width;
+        long long o1 = o0 + in_width;
+        auto first = static_cast<int>(o0 / out_width);
+        for (auto x = first; x < in_width; ++x) {
+            long long s0 = static_cast<long long>(x) * out_width;
+            long long s1 = s0 + out_width;
+            if (s0 >= o1)
+                break;
+            auto overlap = std::min(s1, o1) - std::max(s0, o0);
+            if (overlap > 0)
+                taps.push_back({ x, static_cast<float>(overlap) / in_width });
+        }
+    }
+    tap_start[out_width] = static_cast<int>(taps.size());
+
+    row_sum.resize(static_cast<size_t>(out_width) * channels);
+    accum.assign(static_cast<size_t>(out_width) * channels, 0.0f);
+}
+
+void StreamingScaler::push_row(const uint8_t* row)
+{
+    if (src_y >= in_height)
+        return;
+    if (filter == ScaleFilter::Nearest)
+        push_row_nearest(row);
+    else
+        push_row_area(row);
+    ++src_y;
+}
+
+// Same arithmetic as scale_to_c64 so both produce identical pixels
+void StreamingScaler::push_row_nearest(const uint8_t* row)
+{
+    float scale_x = static_cast<float>(in_width) / out_width;
+    float scale_y = static_cast<float>(in_height) / out_height;
+
+    while (out_y < out_height && static_cast<int>(out_y * scale_y) == src_y) {
+        for (int x = 0; x < out_width; ++x) {
+            int src_x = static_cast<int>(x * scale_x);
+            std::copy_n(&row[src_x * channels], channels, &output[(out_y * out_width + x) * channels]);
+        }
+        ++out_y;
+    }
+}
+
+void StreamingScaler::push_row_area(const uint8_t* row)
+{
+    if (out_y >= out_height)
+        return;
+
+    // Horizontal pass: filter the source row down to out_width pixels
+    for (auto ox = 0; ox < out_width; ++ox) {
+        float* sum = &row_sum[ox * channels];
+        std::fill_n(sum, channels, 0.0f);
+        for (auto t = tap_start[ox]; t < tap_start[ox + 1]; ++t) {
+            const uint8_t* src = &row[taps[t].src_x * channels];
+            for (auto c = 0; c < channels; ++c)
+                sum[c] += src[c] * taps[t].weight;
+        }
+    }
+
+    // Vertical pass: add this row to every output row it overlaps, emitting the ones it completes
+    long long s0 = static_cast<long long>(src_y) * out_height;
+    long long s1 = s0 + out_height;
+    while (out_y < out_height) {
+        long long o0 = static_cast<long long>(out_y) * in_height;
+        long long o1 = o0 + in_height;
+        auto overlap = std::min(s1, o1) - std::max(s0, o0);
+        if (overlap <= 0)
+            break;
+
+        float weight = static_cast<float>(overlap) / in_height;
+        for (size_t i = 0; i < accum.size(); ++i)
+            accum[i] += row_sum[i] * weight;
+
+        if (o1 > s1)
+            break;  // output row continues into the next source row
+
+        uint8_t* dst = &output[static_cast<size_t>(out_y) * out_width * channels];
+        for (size_t i = 0; i < accum.size(); ++i)
+            dst[i] = static_cast<uint8_t>(std::clamp(accum[i] + 0.5f, 0.0f, 255.0f));
+        std::fill(accum.begin(), accum.end(), 0.0f);
+        ++out_y;
+    }
+}
+
+void scale_area(const uint8_t* input, int in_width, int in_height,
+    uint8_t* output, int out_width, int out_height, int channels)
+{
+    StreamingScaler scaler(in_width, in_height, out_width, out_height, channels, output, ScaleFilter::Area);
+    for (auto y = 0; y < in_height; ++y)
+        scaler.push_row(&input[static_cast<size_t>(y) * in_width * channels]);
+}
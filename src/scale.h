@@ -1,6 +1,54 @@
 #pragma once
 #include <stdint.h>
+#include <vector>
 
 // Scale image down to fit within C64 resolution while maintaining aspect ratio
 void scale_to_c64(const uint8_t* input, int in_width, int in_height, 
-                 uint8_t* output, int out_width, int out_height, int channels) ;
\ No newline at end of file
+                 uint8_t* output, int out_width, int out_height, int channels) ;
+
+enum class ScaleFilter {
+    Nearest,    // point sampling, same pixels as scale_to_c64
+    Area        // box filter: every output pixel is the exact area average of the source it covers
+};
+
+// Scaler fed one source row at a time, top to bottom. Output rows are written as soon as
+// every source row they cover has been pushed, and only one row of accumulators is kept,
+// so memory is O(in_width + out_width) no matter how tall the source is.
+// reset() reuses the existing buffers when they are already large enough.
+class StreamingScaler {
+public:
+    StreamingScaler() = default;
+    StreamingScaler(int in_width, int in_height, int out_width, int out_height, int channels,
+        uint8_t* output, ScaleFilter filter = ScaleFilter::Area);
+
+    void reset(int in_width, int in_height, int out_width, int out_height, int channels,
+        uint8_t* output, ScaleFilter filter = ScaleFilter::Area);
+    void push_row(const uint8_t* row);
+
+    int rows_pushed() const { return src_y; }
+    int rows_written() const { return out_y; }
+
+private:
+    struct Tap {
+        int src_x;
+        float weight;
+    };
+
+    void push_row_nearest(const uint8_t* row);
+    void push_row_area(const uint8_t* row);
+
+    int in_width = 0, in_height = 0, out_width = 0, out_height = 0, channels = 0;
+    uint8_t* output = nullptr;
+    ScaleFilter filter = ScaleFilter::Area;
+    int src_y = 0;      // next source row expected
+    int out_y = 0;      // next output row to finish
+
+    std::vector<int> tap_start;     // out_width + 1 offsets into taps
+    std::vector<Tap> taps;          // horizontal source coverage of each output column
+    std::vector<float> row_sum;     // current source row filtered horizontally
+    std::vector<float> accum;       // current output row being accumulated vertically
+};
+
+// Area-average a whole in-memory image
+void scale_area(const uint8_t* input, int in_width, int in_height,
+    uint8_t* output, int out_width, int out_height, int channels);
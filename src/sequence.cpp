@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <stdexcept>
+
+#include "batch.h"
+#include "conversioncontext.h"
+#include "imagereader.h"
+#include "sequence.h"
+
+namespace fs = std::filesystem;
+
+// Append runs for one memory area; unchanged gaps shorter than a run header are carried along
+static void append_area_delta(const std::vector<uint8_t>& previous, const std::vector<uint8_t>& current,
+    uint16_t address, std::vector<uint8_t>& delta)
+{
+    const size_t run_header = 3;
+    const size_t max_run = 255;
+    size_t i = 0;
+    while (i < current.size()) {
+        if (current[i] == previous[i]) {
+            ++i;
+            continue;
+        }
+
+        auto last_changed = i;
+        for (auto end = i + 1; end < current.size() && end - i < max_run; ++end) {
+            if (current[end] != previous[end])
+                last_changed = end;
+            else if (end - last_changed > run_header)
+                break;
+        }
+
+        auto run_address = static_cast<uint16_t>(address + i);
+        auto count = last_changed + 1 - i;
+        delta.push_back(static_cast<uint8_t>(run_address & 0xFF));
+        delta.push_back(static_cast<uint8_t>(run_address >> 8));
+        delta.push_back(static_cast<uint8_t>(count));
+        delta.insert(delta.end(), current.begin() + i, current.begin() + i + count);
+        i += count;
+    }
+}
+
+void append_frame_delta(const C64ImageData& previous, const C64ImageData& current, std::vector<uint8_t>& delta)
+{
+    append_area_delta(previous.bitmap_data, current.bitmap_data, bitmap_load_address, delta);
+    append_area_delta(previous.screen_ram, current.screen_ram, screen_load_address, delta);
+    if (current.multicolor)
+        append_area_delta(previous.color_ram, current.color_ram, color_ram_load_address, delta);
+    delta.push_back(0);
+    delta.push_back(0);
+}
+
+static bool is_gif(const std::string& path)
+{
+    std::string ext = fs::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char ch) { return std::tolower(ch); });
+    return ext == ".gif" && fs::is_regular_file(path);
+}
+
+struct DecodedFrame {
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> pixels;
+    StageStats decode;
+};
+
+SequenceResult convert_sequence(const std::string& input_spec, const std::string& output_path,
+    const ConvertOptions& options, std::ostream& log)
+{
+    std::vector<std::unique_ptr<ImageReader>> gif_frames;
+    std::vector<std::string> frame_paths;
+    if (is_gif(input_spec))
+        gif_frames = open_gif_frames(input_spec);
+    else
+        frame_paths = collect_image_inputs(input_spec);
+
+    const bool from_gif = !gif_frames.empty();
+    const int count = static_cast<int>(from_gif ? gif_frames.size() : frame_paths.size());
+    if (count == 0)
+        throw std::runtime_error("No frames found in " + input_spec);
+    if (count > 0xFFFF)
+        throw std::runtime_error("Too many frames in " + input_spec + " (at most 65535)");
+
+    auto frame_name = [&](int i) {
+        return from_gif ? input_spec + " frame " + std::to_string(i) : frame_paths[i];
+    };
+    auto decode = [&](int i) {
+        DecodedFrame frame;
+        StageTimer timer(frame.decode, options.trace, stage_name(Stage::Decode));
+        auto reader = from_gif ? std::move(gif_frames[i]) : open_image_reader(frame_paths[i]);
+        frame.width = reader->width;
+        frame.height = reader->height;
+        frame.pixels.resize(static_cast<size_t>(reader->width) * reader->height * 3);
+        for (auto y = 0; y < frame.height; ++y) {
+            if (!reader->read_row(&frame.pixels[static_cast<size_t>(y) * frame.width * 3])) {
+                throw std::runtime_error("Error loading image: " + frame_name(i) + "\n"
+                    + "Reason: " + reader->error());
+            }
+        }
+        frame.decode.pixels = static_cast<long long>(frame.width) * frame.height;
+        frame.decode.bytes = static_cast<long long>(frame.pixels.size());
+        return frame;
+    };
+
+    ConvertOptions frame_options = options;
+    frame_options.cell_reuse_tolerance = std::max(0, options.cell_reuse_tolerance);
+    ConversionContext context(frame_options);
+
+    SequenceResult result;
+    auto started = std::chrono::steady_clock::now();
+    std::vector<uint8_t> delta(4, 0);   // header, filled in once the background is known
+    C64ImageData previous;
+    int target_width = 0, target_height = 0;
+    std::vector<uint8_t> output;
+
+    // Decoding runs one frame ahead of conversion
+    auto next = std::async(std::launch::async, decode, 0);
+    for (auto i = 0; i < count; ++i) {
+        DecodedFrame frame = next.get();
+        if (i + 1 < count)
+            next = std::async(std::launch::async, decode, i + 1);
+        auto frame_started = std::chrono::steady_clock::now();
+        TraceSpan frame_span(options.trace, "frame", "frame", i);
+
+        int width, height;
+        ConversionContext::target_size(frame.width, frame.height, frame_options, width, height);
+        if (i == 0) {
+            target_width = width;
+            target_height = height;
+            output.resize(static_cast<size_t>(width) * height * 3);
+        }
+        else if (width != target_width || height != target_height) {
+            throw std::runtime_error(frame_name(i) + " converts to " + std::to_string(width) + "x" + std::to_string(height)
+                + ", the first frame to " + std::to_string(target_width) + "x" + std::to_string(target_height));
+        }
+
+        context.convert(frame.pixels, frame.width, frame.height, output, target_width, target_height);
+        ConversionStats stats = context.stats();
+        stats[Stage::Decode] = frame.decode;
+        C64ImageData current;
+        {
+            StageTimer timer(stats[Stage::C64Memory], options.trace, stage_name(Stage::C64Memory));
+            current = convert_indexed_to_c64_memory(context.native_indices().data(), context.native_width(),
+                target_height, frame_options.use_multicolor, context.last_reduce().bg_color);
+        }
+        stats[Stage::C64Memory].pixels = static_cast<long long>(context.native_width()) * target_height;
+        stats[Stage::C64Memory].bytes = static_cast<long long>(current.bitmap_data.size() + current.screen_ram.size()
+            + (frame_options.use_multicolor ? current.color_ram.size() : 0));
+        if (i == 0) {
+            previous.bitmap_data.assign(current.bitmap_data.size(), 0);
+            previous.screen_ram.assign(current.screen_ram.size(), 0);
+            previous.color_ram.assign(current.color_ram.size(), 0);
+        }
+
+        auto before = delta.size();
+        {
+            StageTimer timer(stats[Stage::Outputs], options.trace, "delta");
+            append_frame_delta(previous, current, delta);
+        }
+        stats[Stage::Outputs].bytes = static_cast<long long>(delta.size() - before);
+        // Decoding ran ahead on its own thread; a frame's latency still includes it
+        stats.milliseconds = frame.decode.milliseconds
+            + std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_started).count();
+        result.frame_stats.push_back(stats);
+        log << "Frame " << i << " (" << frame_name(i) << "): ";
+        if (i > 0) {
+            const int cell_width = frame_options.use_multicolor ? 4 : 8;
+            const long long cells = static_cast<long long>((context.native_width() + cell_width - 1) / cell_width)
+                * ((target_height + 7) / 8);
+            result.cells += cells;
+            result.reused_cells += context.reuse_count();
+            log << context.reuse_count() << " of " << cells << " cells reused, ";
+        }
+        log << delta.size() - before << " delta bytes" << std::endl;
+        previous = std::move(current);
+    }
+
+    delta[0] = static_cast<uint8_t>(count & 0xFF);
+    delta[1] = static_cast<uint8_t>(count >> 8);
+    delta[2] = frame_options.use_multicolor ? 1 : 0;
+    delta[3] = previous.background;
+
+    ArtifactWriter& writer = options.artifact_writer ? *options.artifact_writer : file_artifact_writer();
+    auto stats = writer.write(output_path, delta);
+    log << "Delta stream generated: " << stats.path << " (" << stats.bytes << " bytes, "
+        << stats.milliseconds << " ms)" << std::endl;
+
+    result.frames = count;
+    result.delta_bytes = delta.size();
+    result.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    return result;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "asmgenerator.h"
+#include "c64converter.h"
+
+// Delta file of a frame sequence: what a player has to write into C64 memory per frame.
+//
+//   frame count (2 bytes, little endian)
+//   mode (1 byte): 0 hires, 1 multicolor
+//   background (1 byte): $D021 for the whole sequence
+//   per frame, runs of
+//     address (2 bytes, little endian), count (1 byte, 1-255), count bytes to store there
+//   and $00 $00 to end the frame
+//
+// Runs cover the bitmap ($2000), screen RAM ($0400) and, for multicolor, color RAM ($D800).
+// The first frame is a delta against all-zero memory, so it carries the whole picture.
+
+// Append the runs taking previous to current, and the frame end
+extern void append_frame_delta(const C64ImageData& previous, const C64ImageData& current, std::vector<uint8_t>& delta);
+
+struct SequenceResult {
+    int frames = 0;
+    size_t delta_bytes = 0;         // size of the delta file
+    long long cells = 0;            // cells over every frame after the first
+    long long reused_cells = 0;     // of those, kept from the previous frame
+    std::vector<ConversionStats> frame_stats;   // per frame: decode, conversion, C64 memory and delta stages
+    double milliseconds = 0;        // the whole sequence, writing the delta file included
+};
+
+// Convert the frames of input_spec in order and write their delta file to output_path.
+// input_spec is an animated GIF, or a directory, glob or manifest as for batch mode
+// (see collect_image_inputs). The next frame is decoded while the current one converts.
+// Cells within options.cell_reuse_tolerance (0 if unset) of the previous frame keep their
+// conversion. Every frame must come out the same size. Failures throw std::runtime_error.
+extern SequenceResult convert_sequence(const std::string& input_spec, const std::string& output_path,
+    const ConvertOptions& options, std::ostream& log);
@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "blockreducer.h"
+#include "c64converter.h"
+#include "conversioncontext.h"
+#include "pallet.h"
+#include "server.h"
+#include "threadpool.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Two-way byte stream to one client
+class Connection {
+public:
+    virtual ~Connection() = default;
+
+    // Next line without its line end; false at end of input
+    virtual bool read_line(std::string& line) = 0;
+    virtual bool read_bytes(uint8_t* data, size_t size) = 0;
+    virtual void write(const std::string& data) = 0;
+};
+
+class StreamConnection : public Connection {
+public:
+    StreamConnection(std::istream& in, std::ostream& out) : in(in), out(out) {}
+
+    bool read_line(std::string& line) override
+    {
+        if (!std::getline(in, line))
+            return false;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        return true;
+    }
+
+    bool read_bytes(uint8_t* data, size_t size) override
+    {
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(size)));
+    }
+
+    void write(const std::string& data) override
+    {
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        out.flush();
+    }
+
+private:
+    std::istream& in;
+    std::ostream& out;
+};
+
+#ifndef _WIN32
+class SocketConnection : public Connection {
+public:
+    explicit SocketConnection(int fd) : fd(fd), buffer(64 * 1024) {}
+    ~SocketConnection() override { close(fd); }
+
+    bool read_line(std::string& line) override
+    {
+        line.clear();
+        for (;;) {
+            auto* begin = &buffer[start];
+            auto* newline = static_cast<uint8_t*>(std::memchr(begin, '\n', end - start));
+            if (newline) {
+                line.append(reinterpret_cast<char*>(begin), newline - begin);
+                start += newline - begin + 1;
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                return true;
+            }
+            line.append(reinterpret_cast<char*>(begin), end - start);
+            start = end;
+            if (!fill())
+                return false;
+        }
+    }
+
+    bool read_bytes(uint8_t* data, size_t size) override
+    {
+        while (size > 0) {
+            if (start == end && !fill())
+                return false;
+            auto count = std::min(size, end - start);
+            std::memcpy(data, &buffer[start], count);
+            start += count;
+            data += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    void write(const std::string& data) override
+    {
+        size_t written = 0;
+        while (written < data.size()) {
+            auto count = ::write(fd, data.data() + written, data.size() - written);
+            if (count <= 0)
+                return;     // the client went away; its remaining responses are dropped
+            written += static_cast<size_t>(count);
+        }
+    }
+
+private:
+    // Refill the empty buffer with whatever has arrived; false once the client closed
+    bool fill()
+    {
+        ssize_t count;
+        do {
+            count = ::read(fd, buffer.data(), buffer.size());
+        } while (count < 0 && errno == EINTR);
+        start = 0;
+        end = count > 0 ? static_cast<size_t>(count) : 0;
+        return count > 0;
+    }
+
+    int fd;
+    std::vector<uint8_t> buffer;
+    size_t start = 0;
+    size_t end = 0;
+};
+#endif
+
+// Keeps a --return request's files for its response instead of storing them
+class ReturnedArtifacts : public ArtifactWriter {
+public:
+    ArtifactStats write(const std::string& path, std::span<const uint8_t> data) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        files.emplace_back(path, std::string(reinterpret_cast<const char*>(data.data()), data.size()));
+        return { path, data.size(), 0 };
+    }
+
+    std::vector<std::pair<std::string, std::string>> files;
+
+private:
+    std::mutex mutex;
+};
+
+// Everything the worker pool and the connections share
+struct ServerState {
+    ServerState(int threads, size_t max_input_bytes)
+        : pool(resolve_thread_count(threads)), max_input_bytes(max_input_bytes)
+    {
+        // Build the lookup tables now rather than during the first request
+        get_palette_lut(c64_palette);
+    }
+
+    ThreadPool pool;
+    CellColorCache cell_cache;
+    size_t max_input_bytes;
+};
+
+struct Request {
+    std::string id;
+    std::vector<std::string> args;  // id, input, output, options (the server's own removed)
+    std::vector<uint8_t> input_data;
+    bool from_memory = false;
+    bool return_files = false;
+    Clock::time_point received;
+};
+
+// Split a request line into fields; false on an unterminated quote
+static bool split_fields(const std::string& line, std::vector<std::string>& fields)
+{
+    fields.clear();
+    size_t i = 0;
+    while (i < line.size()) {
+        if (line[i] == ' ' || line[i] == '\t') {
+            ++i;
+            continue;
+        }
+        std::string field;
+        if (line[i] == '"') {
+            for (++i; i < line.size() && line[i] != '"'; ++i) {
+                if (line[i] == '\\' && i + 1 < line.size())
+                    ++i;
+                field += line[i];
+            }
+            if (i == line.size())
+                return false;
+            ++i;
+        }
+        else {
+            for (; i < line.size() && line[i] != ' ' && line[i] != '\t'; ++i)
+                field += line[i];
+        }
+        fields.push_back(std::move(field));
+    }
+    return true;
+}
+
+// One response line; line breaks in text would split it, so they become "; "
+static void append_response(std::string& response, const std::string& id, const char* kind, const std::string& text)
+{
+    response += id;
+    response += ' ';
+    response += kind;
+    response += ' ';
+    for (auto ch : text) {
+        if (ch == '\n')
+            response += "; ";
+        else if (ch != '\r')
+            response += ch;
+    }
+    response += '\n';
+}
+
+static std::string run_request(Request& request, ServerState& state)
+{
+    // One context per worker thread keeps its buffers warm across requests
+    thread_local ConversionContext context;
+
+    std::string response;
+    std::ostringstream log;
+    try {
+        std::vector<char*> argv;
+        for (auto& arg : request.args)
+            argv.push_back(arg.data());
+        ConvertOptions options;
+        std::ostringstream errors;
+        if (!parse_convert_options(static_cast<int>(argv.size()), argv.data(), 3, options, errors))
+            throw std::runtime_error(errors.str());
+        if (!options.trace_path.empty())
+            throw std::runtime_error("--trace is not available in server mode");
+        options.preview = false;
+        options.cell_reuse_tolerance = -1;  // requests are independent images
+        options.cell_cache = &state.cell_cache;
+
+        ReturnedArtifacts returned;
+        std::unique_ptr<ArtifactWriter> archive;
+        if (request.return_files) {
+            options.artifact_writer = &returned;
+        }
+        else if (!options.archive_path.empty()) {
+            archive = open_archive_writer(options.archive_path);
+            options.artifact_writer = archive.get();
+        }
+
+        const auto& input = request.args[1];
+        const auto& output = request.args[2];
+        auto result = request.from_memory
+            ? convert_image_data(request.input_data, "request " + request.id, output, options, log, context)
+            : convert_image(input, output, options, log, context);
+        if (archive)
+            archive->finish();  // completes the archive before the client hears the request is done
+        archive.reset();
+
+        std::istringstream lines(log.str());
+        for (std::string line; std::getline(lines, line);)
+            append_response(response, request.id, "log", line);
+        if (options.stats != StatsFormat::None) {
+            std::ostringstream stats;
+            print_stats(result.stats, StatsFormat::JSON, stats);
+            auto json = stats.str();
+            json.pop_back();    // the line break
+            append_response(response, request.id, "stats", json);
+        }
+        for (auto& [path, data] : returned.files) {
+            append_response(response, request.id, "artifact", std::to_string(data.size()) + " " + path);
+            response += data;
+        }
+        auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - request.received).count();
+        append_response(response, request.id, "ok", std::to_string(result.width) + "x" + std::to_string(result.height)
+            + " " + std::to_string(microseconds) + " " + result.output_path);
+    }
+    catch (const std::exception& e) {
+        response.clear();
+        std::istringstream lines(log.str());
+        for (std::string line; std::getline(lines, line);)
+            append_response(response, request.id, "log", line);
+        std::string reason = e.what();
+        while (!reason.empty() && reason.back() == '\n')
+            reason.pop_back();
+        append_response(response, request.id, "error", reason);
+    }
+    return response;
+}
+
+// Read one request; returns an error to answer with instead, or "" if it is well formed.
+// The input bytes are consumed even for a bad request, so the next line is found.
+static std::string read_request(Connection& connection, std::vector<std::string>& fields, Request& request,
+    size_t max_input_bytes, bool& connection_lost)
+{
+    request.received = Clock::now();
+    request.id = fields[0];
+
+    long long byte_count = -1;
+    for (size_t i = 1; i < fields.size(); ++i) {
+        if (fields[i] == "--return") {
+            request.return_files = true;
+        }
+        else if (fields[i] == "--bytes" && i + 1 < fields.size()) {
+            char* end = nullptr;
+            byte_count = std::strtoll(fields[i + 1].c_str(), &end, 10);
+            if (fields[i + 1].empty() || *end != '\0' || byte_count < 0)
+                return "--bytes needs a byte count";
+            ++i;
+        }
+        else {
+            request.args.push_back(std::move(fields[i]));
+        }
+    }
+    request.args.insert(request.args.begin(), request.id);
+
+    if (byte_count >= 0) {
+        // Bytes that were never read cannot be skipped to find the next line
+        if (static_cast<unsigned long long>(byte_count) > max_input_bytes) {
+            connection_lost = true;
+            return "--bytes " + std::to_string(byte_count) + " is over the limit of "
+                + std::to_string(max_input_bytes) + " bytes; closing the connection";
+        }
+        request.input_data.resize(static_cast<size_t>(byte_count));
+        if (!connection.read_bytes(request.input_data.data(), request.input_data.size())) {
+            connection_lost = true;
+            return "input ended before " + std::to_string(byte_count) + " bytes";
+        }
+    }
+    if (request.args.size() < 3)
+        return "expected <id> <input> <output> [options]";
+    request.from_memory = request.args[1] == "-";
+    if (request.from_memory != (byte_count >= 0))
+        return request.from_memory ? "input - needs --bytes N" : "--bytes needs input -";
+    return "";
+}
+
+static void serve_connection(Connection& connection, ServerState& state)
+{
+    std::mutex mutex;
+    std::condition_variable done;
+    int pending = 0;
+    auto respond = [&](const std::string& response) {
+        std::lock_guard<std::mutex> lock(mutex);
+        connection.write(response);
+    };
+
+    std::string line;
+    std::vector<std::string> fields;
+    bool connection_lost = false;
+    try {
+        while (!connection_lost && connection.read_line(line)) {
+            if (!split_fields(line, fields)) {
+                respond("- error unterminated quote\n");
+                continue;
+            }
+            if (fields.empty() || fields[0][0] == '#')
+                continue;
+            if (fields.size() == 1 && fields[0] == "quit")
+                break;
+
+            auto request = std::make_shared<Request>();
+            auto error = read_request(connection, fields, *request, state.max_input_bytes, connection_lost);
+            if (!error.empty()) {
+                std::string response;
+                append_response(response, request->id, "error", error);
+                respond(response);
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++pending;
+            }
+            try {
+                state.pool.submit([&, request] {
+                    auto response = run_request(*request, state);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    connection.write(response);
+                    if (--pending == 0)
+                        done.notify_all();
+                });
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                --pending;
+                throw;
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        // Reading is given up (the stream position is unknown), but requests already
+        // running still answer
+        std::string response;
+        append_response(response, "-", "error", e.what());
+        respond(response);
+    }
+
+    // The workers use this frame's connection and lock; wait for them before returning
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return pending == 0; });
+}
+
+void serve_stream(std::istream& in, std::ostream& out, int threads, size_t max_input_bytes)
+{
+    ServerState state(threads, max_input_bytes);
+    StreamConnection connection(in, out);
+    serve_connection(connection, state);
+}
+
+#ifndef _WIN32
+void serve_unix_socket(const std::string& path, int threads, size_t max_input_bytes)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof address.sun_path)
+        throw std::runtime_error("Socket path must be 1-" + std::to_string(sizeof address.sun_path - 1) + " characters: " + path);
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    // A socket file left by an earlier server would make bind fail; anything else stays
+    struct stat info;
+    if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+        unlink(path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        throw std::runtime_error("Cannot create socket: " + std::string(std::strerror(errno)));
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof address) != 0 || listen(listener, 16) != 0) {
+        auto reason = std::string(std::strerror(errno));
+        close(listener);
+        throw std::runtime_error("Cannot listen on " + path + ": " + reason);
+    }
+
+    // A client that disconnects mid-response must not end the server
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // Client threads are detached, so each one shares ownership of the state: the pool and
+    // cell cache outlive this function if it throws while clients are still being served
+    auto state = std::make_shared<ServerState>(threads, max_input_bytes);
+    for (;;) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            auto reason = std::string(std::strerror(errno));
+            close(listener);
+            throw std::runtime_error("Cannot accept on " + path + ": " + reason);
+        }
+        std::thread([client, state] {
+            // One client's failure must not take down the others
+            try {
+                SocketConnection connection(client);
+                serve_connection(connection, *state);
+            }
+            catch (const std::exception& e) {
+                std::cerr << "Client dropped: " << e.what() << std::endl;
+            }
+        }).detach();
+    }
+}
+#else
+void serve_unix_socket(const std::string& path, int threads, size_t max_input_bytes)
+{
+    throw std::runtime_error("Unix domain sockets are not available on this platform; serve over stdin instead");
+}
+#endif
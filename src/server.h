@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <string>
+
+// Resident conversion server: the palette tables, worker threads, per-thread conversion
+// buffers and the cell solve memo are set up once and stay warm across requests, so a
+// request costs its conversion and little else.
+//
+// Protocol, one request per line; fields are separated by spaces, and a field containing
+// spaces goes in double quotes (with \" and \\ inside):
+//   <id> <input_path> <output_path> [options]     convert as on the command line
+//   <id> - <output_path> [options] --bytes N      the input file follows the line as N raw bytes
+//   quit                                          stop reading once pending requests are done
+// Besides the command line options a request may give --return: send the generated files
+// back instead of storing them. Requests run concurrently; each one's response is written
+// in one piece when it completes, so responses arrive in completion order:
+//   <id> log <line>                   what the conversion logged, one line each
+//   <id> stats <json>                 with --stats or --stats=json, the stage stats as one JSON line
+//   <id> artifact <size> <path>       with --return, followed by size raw bytes
+//   <id> ok <width>x<height> <microseconds> <output_path>
+//   <id> error <reason>
+// Empty lines and lines starting with # are ignored. A --bytes count over the server's input
+// limit is answered with an error and ends the connection, since the bytes that follow cannot
+// be skipped reliably.
+
+// Largest --bytes input a request may send unless the server is given another limit
+constexpr size_t default_max_input_bytes = 64 << 20;
+
+// Serve requests from in, responding on out, until quit or end of input.
+// threads is how many requests convert at once (0 = all cores); max_input_bytes caps --bytes.
+extern void serve_stream(std::istream& in, std::ostream& out, int threads,
+    size_t max_input_bytes = default_max_input_bytes);
+
+// Listen on a Unix domain socket at path, replacing a stale socket file there, and serve
+// each connection with the protocol above until the process is stopped. All connections
+// share one pool of threads workers. Throws std::runtime_error if the socket cannot be set
+// up, or where Unix domain sockets are not available.
+extern void serve_unix_socket(const std::string& path, int threads,
+    size_t max_input_bytes = default_max_input_bytes);
@@ -0,0 +1,24 @@
+#pragma once
+
+// Shared pieces of the x86 vector kernels. Kernels carry per-function target attributes,
+// so the rest of the build needs no -mavx2, and are picked at runtime from cpu_simd_level().
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#else
+#define TARGET_AVX2
+#define TARGET_SSE41
+#endif
+
+enum class SimdLevel { Scalar, SSE41, AVX2 };
+
+// Best instruction set this CPU (and OS) supports; detected once
+extern SimdLevel cpu_simd_level();
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+#include "stats.h"
+
+const char* stage_name(Stage stage)
+{
+    static const char* names[stage_count] = {
+        "cache", "decode", "scale", "dither", "reduce", "quantize", "c64-memory", "outputs", "encode", "write"
+    };
+    return names[static_cast<int>(stage)];
+}
+
+void ConversionStats::add(const ConversionStats& other)
+{
+    for (auto i = 0; i < stage_count; ++i) {
+        stages[i].milliseconds += other.stages[i].milliseconds;
+        stages[i].pixels += other.stages[i].pixels;
+        stages[i].lookups += other.stages[i].lookups;
+        stages[i].bytes += other.stages[i].bytes;
+    }
+    milliseconds += other.milliseconds;
+}
+
+static bool stage_ran(const StageStats& stage)
+{
+    return stage.milliseconds > 0 || stage.pixels > 0 || stage.lookups > 0 || stage.bytes > 0;
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    auto rank = static_cast<size_t>(std::ceil(p / 100 * sorted.size()));
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+void print_stats(const ConversionStats& stats, StatsFormat format, std::ostream& out)
+{
+    // Formatted apart so the caller's stream flags are left alone
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(3);
+
+    if (format == StatsFormat::JSON) {
+        text << "{\"milliseconds\": " << stats.milliseconds << ", \"stages\": [";
+        auto first = true;
+        for (auto i = 0; i < stage_count; ++i) {
+            auto& stage = stats.stages[i];
+            if (!stage_ran(stage))
+                continue;
+            text << (first ? "" : ", ") << "{\"stage\": \"" << stage_name(static_cast<Stage>(i))
+                << "\", \"milliseconds\": " << stage.milliseconds << ", \"pixels\": " << stage.pixels
+                << ", \"lookups\": " << stage.lookups << ", \"bytes\": " << stage.bytes << "}";
+            first = false;
+        }
+        text << "]}\n";
+    }
+    else {
+        text << std::left << std::setw(12) << "stage" << std::right << std::setw(10) << "ms" << std::setw(12) << "pixels"
+            << std::setw(12) << "lookups" << std::setw(12) << "bytes" << "\n";
+        for (auto i = 0; i < stage_count; ++i) {
+            auto& stage = stats.stages[i];
+            if (!stage_ran(stage))
+                continue;
+            text << std::left << std::setw(12) << stage_name(static_cast<Stage>(i)) << std::right
+                << std::setw(10) << stage.milliseconds << std::setw(12) << stage.pixels
+                << std::setw(12) << stage.lookups << std::setw(12) << stage.bytes << "\n";
+        }
+        text << std::left << std::setw(12) << "total" << std::right << std::setw(10) << stats.milliseconds << "\n";
+    }
+    out << text.str() << std::flush;
+}
+
+void print_stats_summary(const std::vector<ConversionStats>& runs, double wall_ms, StatsFormat format,
+    std::ostream& out)
+{
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(3);
+
+    struct Row {
+        const char* name;
+        int runs;
+        double p50, p95, p99, max;
+        StageStats sum;
+    };
+    auto summarize = [&](const char* name, auto&& milliseconds_of, auto&& stage_of) {
+        Row row{ name, 0, 0, 0, 0, 0, {} };
+        std::vector<double> times;
+        for (auto& run : runs) {
+            auto stage = stage_of(run);
+            if (!stage_ran(stage))
+                continue;
+            times.push_back(milliseconds_of(run));
+            row.sum.pixels += stage.pixels;
+            row.sum.lookups += stage.lookups;
+            row.sum.bytes += stage.bytes;
+        }
+        row.runs = static_cast<int>(times.size());
+        if (!times.empty()) {
+            std::sort(times.begin(), times.end());
+            row.p50 = percentile(times, 50);
+            row.p95 = percentile(times, 95);
+            row.p99 = percentile(times, 99);
+            row.max = times.back();
+        }
+        return row;
+    };
+
+    std::vector<Row> rows;
+    for (auto i = 0; i < stage_count; ++i) {
+        auto row = summarize(stage_name(static_cast<Stage>(i)),
+            [i](const ConversionStats& run) { return run.stages[i].milliseconds; },
+            [i](const ConversionStats& run) { return run.stages[i]; });
+        if (row.runs > 0)
+            rows.push_back(row);
+    }
+    rows.push_back(summarize("total",
+        [](const ConversionStats& run) { return run.milliseconds; },
+        [](const ConversionStats& run) { return StageStats{ run.milliseconds, 0, 0, 0 }; }));
+    const double per_second = wall_ms > 0 ? runs.size() * 1000.0 / wall_ms : 0;
+
+    if (format == StatsFormat::JSON) {
+        text << "{\"conversions\": " << runs.size() << ", \"wall_milliseconds\": " << wall_ms
+            << ", \"per_second\": " << per_second << ", \"stages\": [";
+        for (size_t i = 0; i < rows.size(); ++i) {
+            auto& row = rows[i];
+            text << (i ? ", " : "") << "{\"stage\": \"" << row.name << "\", \"runs\": " << row.runs
+                << ", \"p50_ms\": " << row.p50 << ", \"p95_ms\": " << row.p95 << ", \"p99_ms\": " << row.p99
+                << ", \"max_ms\": " << row.max << ", \"pixels\": " << row.sum.pixels
+                << ", \"lookups\": " << row.sum.lookups << ", \"bytes\": " << row.sum.bytes << "}";
+        }
+        text << "]}\n";
+    }
+    else {
+        text << runs.size() << " conversions in " << wall_ms << " ms (" << per_second << " per second)\n";
+        text << std::left << std::setw(12) << "stage" << std::right << std::setw(7) << "runs"
+            << std::setw(10) << "p50 ms" << std::setw(10) << "p95 ms" << std::setw(10) << "p99 ms"
+            << std::setw(10) << "max ms" << std::setw(14) << "pixels" << std::setw(14) << "lookups"
+            << std::setw(14) << "bytes" << "\n";
+        for (auto& row : rows) {
+            text << std::left << std::setw(12) << row.name << std::right << std::setw(7) << row.runs
+                << std::setw(10) << row.p50 << std::setw(10) << row.p95 << std::setw(10) << row.p99
+                << std::setw(10) << row.max << std::setw(14) << row.sum.pixels << std::setw(14) << row.sum.lookups
+                << std::setw(14) << row.sum.bytes << "\n";
+        }
+    }
+    out << text.str() << std::flush;
+}
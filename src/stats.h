@@ -0,0 +1,75 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <ostream>
+#include <vector>
+#include "trace.h"
+
+// Conversion pipeline stages, in the order an image passes through them
+enum class Stage {
+    Cache,      // on-disk conversion cache lookup and store
+    Decode,     // reading and decoding the input image
+    Scale,      // downscaling to the target size
+    Dither,     // dithering onto the palette
+    Reduce,     // per-cell color reduction
+    Quantize,   // plain nearest-color mapping (no cell limits)
+    C64Memory,  // laying the image out as C64 bitmap, screen and color RAM
+    Outputs,    // building the ASM, PRG and Koala files
+    Encode,     // encoding the output image (PNG, JPEG or BMP)
+    Write,      // storing every output file
+};
+constexpr int stage_count = static_cast<int>(Stage::Write) + 1;
+
+extern const char* stage_name(Stage stage);
+
+enum class StatsFormat { None, Table, JSON };
+
+struct StageStats {
+    double milliseconds = 0;    // wall time
+    long long pixels = 0;       // pixels processed
+    long long lookups = 0;      // nearest-color decisions made
+    long long bytes = 0;        // bytes produced
+};
+
+// Where the time of one conversion went. Stages that did not run stay zero; milliseconds
+// is the whole conversion, including the little that no stage accounts for.
+struct ConversionStats {
+    std::array<StageStats, stage_count> stages{};
+    double milliseconds = 0;
+
+    StageStats& operator[](Stage stage) { return stages[static_cast<int>(stage)]; }
+    const StageStats& operator[](Stage stage) const { return stages[static_cast<int>(stage)]; }
+    void add(const ConversionStats& other);
+};
+
+// Adds the wall time from construction to destruction to a stage, and records it as a
+// trace event named name if there is a recorder
+class StageTimer {
+public:
+    explicit StageTimer(StageStats& stage, TraceRecorder* trace = nullptr, const char* name = nullptr)
+        : stage(stage), trace(trace), name(name), start(std::chrono::steady_clock::now()) {}
+    ~StageTimer()
+    {
+        auto end = std::chrono::steady_clock::now();
+        stage.milliseconds += std::chrono::duration<double, std::milli>(end - start).count();
+        if (trace)
+            trace->add(name, start, end);
+    }
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    StageStats& stage;
+    TraceRecorder* trace;
+    const char* name;
+    std::chrono::steady_clock::time_point start;
+};
+
+// One conversion's stats as an aligned table, or as one line of JSON
+extern void print_stats(const ConversionStats& stats, StatsFormat format, std::ostream& out);
+
+// Many conversions (a batch, or the frames of a sequence): per stage, the p50/p95/p99/max
+// latency over the conversions that ran it, and the summed counters. wall_ms is the elapsed
+// time of the whole run, used for throughput.
+extern void print_stats_summary(const std::vector<ConversionStats>& runs, double wall_ms, StatsFormat format,
+    std::ostream& out);
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int threads)
+{
+    for (auto i = 0; i < threads; ++i)
+        workers.emplace_back([this] { worker_loop(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push(std::move(task));
+    }
+    cv.notify_one();
+}
+
+void ThreadPool::worker_loop()
+{
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (stopping && tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
+
+int resolve_thread_count(int threads)
+{
+    if (threads > 0)
+        return threads;
+    auto cores = static_cast<int>(std::thread::hardware_concurrency());
+    return cores > 0 ? cores : 1;
+}
+
+ThreadPool& get_thread_pool(int threads)
+{
+    static std::mutex pool_mutex;
+    static std::unique_ptr<ThreadPool> pool;
+
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (!pool || pool->size() < threads - 1) {
+        // Retired pools are kept alive; tasks already queued on them still drain
+        static std::vector<std::unique_ptr<ThreadPool>> retired;
+        if (pool)
+            retired.push_back(std::move(pool));
+        pool = std::make_unique<ThreadPool>(threads - 1);
+    }
+    return *pool;
+}
+
+struct ParallelForState {
+    std::atomic<int> next{ 0 };
+    int count = 0;
+    int done = 0;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+// Claim and run indices until none are left
+static void run_parallel_for(ParallelForState& state, const std::function<void(int)>* fn)
+{
+    int finished = 0;
+    for (int i = state.next++; i < state.count; i = state.next++) {
+        (*fn)(i);
+        ++finished;
+    }
+    if (finished > 0) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.done += finished;
+        if (state.done == state.count)
+            state.cv.notify_all();
+    }
+}
+
+void parallel_for_pool(int count, int threads, const std::function<void(int)>& fn)
+{
+    threads = std::min(resolve_thread_count(threads), count);
+
+    auto state = std::make_shared<ParallelForState>();
+    state->count = count;
+
+    // Helpers that start after every index is claimed exit without touching fn
+    auto& pool = get_thread_pool(threads);
+    auto* fn_ptr = &fn;
+    for (auto i = 1; i < threads; ++i)
+        pool.submit([state, fn_ptr] { run_parallel_for(*state, fn_ptr); });
+
+    run_parallel_for(*state, fn_ptr);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [&] { return state->done == state->count; });
+}
+
+// Per-worker job queue. The owner pops from the back; idle workers steal from the front.
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<int> jobs;
+
+    bool pop_back(int& job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobs.empty())
+            return false;
+        job = jobs.back();
+        jobs.pop_back();
+        return true;
+    }
+
+    bool steal_front(int& job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobs.empty())
+            return false;
+        job = jobs.front();
+        jobs.pop_front();
+        return true;
+    }
+};
+
+void work_stealing_for(int count, int threads, const std::function<void(int)>& fn)
+{
+    threads = std::max(1, std::min(resolve_thread_count(threads), count));
+
+    // Contiguous initial split; jobs only move between queues when a worker runs dry
+    std::vector<WorkQueue> queues(threads);
+    for (auto i = 0; i < count; ++i)
+        queues[static_cast<size_t>(i) * threads / count].jobs.push_back(i);
+
+    auto worker = [&](int self) {
+        int job;
+        for (;;) {
+            if (queues[self].pop_back(job)) {
+                fn(job);
+                continue;
+            }
+            auto stolen = false;
+            for (auto offset = 1; offset < threads && !stolen; ++offset)
+                stolen = queues[(self + offset) % threads].steal_front(job);
+            if (!stolen)
+                return;  // every queue is empty and no job ever re-enters one
+            fn(job);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (auto i = 1; i < threads; ++i)
+        workers.emplace_back(worker, i);
+    worker(0);
+    for (auto& thread : workers)
+        thread.join();
+}
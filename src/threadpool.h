@@ -0,0 +1,55 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads pulling tasks from a shared queue
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    int size() const { return static_cast<int>(workers.size()); }
+    void submit(std::function<void()> task);
+
+private:
+    void worker_loop();
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+// Number of threads to use when the user asks for "all cores" (0 or negative)
+extern int resolve_thread_count(int threads);
+
+// Shared pool grown on demand to at least threads - 1 workers
+extern ThreadPool& get_thread_pool(int threads);
+
+// Pool-backed half of parallel_for
+extern void parallel_for_pool(int count, int threads, const std::function<void(int)>& fn);
+
+// Call fn(i) for every i in [0, count) using up to threads threads, the caller included.
+// Indices are claimed dynamically; the call returns once all of them have finished.
+// Safe to nest: a caller only ever waits on work that is already running.
+// Single-threaded calls run inline and never type-erase (or allocate for) fn.
+template <typename Fn>
+void parallel_for(int count, int threads, Fn&& fn)
+{
+    if (count <= 1 || resolve_thread_count(threads) <= 1) {
+        for (auto i = 0; i < count; ++i)
+            fn(i);
+        return;
+    }
+    parallel_for_pool(count, threads, std::function<void(int)>(std::forward<Fn>(fn)));
+}
+
+// Call fn(i) for every i in [0, count) on dedicated threads, each owning a deque of indices.
+// A worker whose deque runs dry steals from the front of the others', which evens out
+// jobs of very different cost (e.g. images of different sizes).
+extern void work_stealing_for(int count, int threads, const std::function<void(int)>& fn);
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include "trace.h"
+
+// JSON string contents for text
+static std::string json_escape(const std::string& text)
+{
+    std::string escaped;
+    for (unsigned char ch : text) {
+        if (ch == '"' || ch == '\\') {
+            escaped += '\\';
+            escaped += static_cast<char>(ch);
+        }
+        else if (ch < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", ch);
+            escaped += code;
+        }
+        else {
+            escaped += static_cast<char>(ch);
+        }
+    }
+    return escaped;
+}
+
+TraceRecorder::TraceRecorder() : origin(Clock::now()), main_thread(std::this_thread::get_id())
+{
+    threads.push_back(main_thread);
+}
+
+void TraceRecorder::add(const std::string& name, Clock::time_point start, Clock::time_point end,
+    const std::string& args)
+{
+    auto id = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = std::find(threads.begin(), threads.end(), id);
+    if (found == threads.end())
+        found = threads.insert(threads.end(), id);
+    events.push_back({ name, args, start, end, static_cast<int>(found - threads.begin()) });
+}
+
+void TraceRecorder::write(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto sorted = events;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Event& a, const Event& b) { return a.start < b.start; });
+    auto micros = [](Clock::duration duration) { return std::chrono::duration<double, std::micro>(duration).count(); };
+
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(3);
+    text << "{\"traceEvents\": [\n";
+    for (size_t i = 0; i < threads.size(); ++i) {
+        text << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << i
+            << ", \"args\": {\"name\": \"" << (i == 0 ? std::string("main") : "worker " + std::to_string(i))
+            << "\"}},\n";
+    }
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        auto& event = sorted[i];
+        text << "{\"name\": \"" << json_escape(event.name) << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+            << ", \"ts\": " << micros(event.start - origin) << ", \"dur\": " << micros(event.end - event.start);
+        if (!event.args.empty())
+            text << ", \"args\": {" << event.args << "}";
+        text << "}" << (i + 1 < sorted.size() ? ",\n" : "\n");
+    }
+    text << "], \"displayTimeUnit\": \"ms\"}\n";
+    out << text.str();
+}
+
+void TraceRecorder::write_file(const std::string& path) const
+{
+    std::ofstream file(path, std::ios::binary);
+    if (file)
+        write(file);
+    if (!file)
+        throw std::runtime_error("Cannot write trace: " + path);
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (!trace)
+        return;
+    char args[96] = "";
+    if (arg_name)
+        std::snprintf(args, sizeof args, "\"%s\": %lld", arg_name, arg);
+    trace->add(name, start, TraceRecorder::Clock::now(), args);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Collects timed events from any thread and writes them in the Chrome Trace Event format
+// (chrome://tracing, ui.perfetto.dev). Every event is a complete event on the thread that
+// recorded it; threads show up as "main" (the one that created the recorder) and "worker N"
+// in the order they first record something.
+class TraceRecorder {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TraceRecorder();
+
+    // One event from start to end on the calling thread. args, if given, is the inside of a
+    // JSON object ("\"row\": 3"); name is escaped here.
+    void add(const std::string& name, Clock::time_point start, Clock::time_point end, const std::string& args = {});
+
+    // {"traceEvents": [...]} with timestamps in microseconds since the recorder was created
+    void write(std::ostream& out) const;
+    // Same, into a file; throws std::runtime_error if it cannot be written
+    void write_file(const std::string& path) const;
+
+private:
+    struct Event {
+        std::string name;
+        std::string args;
+        Clock::time_point start;
+        Clock::time_point end;
+        int thread;
+    };
+
+    Clock::time_point origin;
+    std::thread::id main_thread;
+    mutable std::mutex mutex;
+    std::vector<Event> events;
+    std::vector<std::thread::id> threads;   // index is the trace's thread id
+};
+
+// Records one event from construction to destruction. Without a recorder it does nothing,
+// not even read the clock. name (and arg_name) must outlive the span.
+class TraceSpan {
+public:
+    TraceSpan(TraceRecorder* trace, const char* name, const char* arg_name = nullptr, long long arg = 0)
+        : trace(trace), name(name), arg_name(arg_name), arg(arg)
+    {
+        if (trace)
+            start = TraceRecorder::Clock::now();
+    }
+    ~TraceSpan();
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    TraceRecorder* trace;
+    const char* name;
+    const char* arg_name;
+    long long arg;
+    TraceRecorder::Clock::time_point start;
+};